@@ -0,0 +1,301 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "folder/transfer/downloader/RequestWindow.h"
+#include "folder/transfer/downloader/WeightedChunkQueue.h"
+#include "util/AvailabilityMap.h"
+#include <QByteArray>
+#include <QHash>
+#include <QMultiHash>
+#include <QSet>
+#include <QtEndian>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+/* Measures the request path of Downloader: requestOne() over WeightedChunkQueue, nodeForRequest() over the owners' request windows,
+ * requestMap() of the chosen chunk, and window parking. Downloader itself needs live RemoteFolders, so this is a replica of that path
+ * over stub remotes, with the same RequestWindow and AvailabilityMap. Replies arrive in rounds: every outstanding block completes,
+ * frees its window slot and unparks the chunks, that waited for it.
+ * Usage: librevault-bench-requestone [chunk_count] [remote_count] [window] */
+
+using namespace librevault;
+using bench_clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr quint32 CHUNK_SIZE = 1024*1024;
+constexpr quint32 BLOCK_SIZE = 32768;
+constexpr unsigned BUILDERS_MAX = 64;   // p2p_download_builders_max
+
+struct StubRemote {
+	RequestWindow request_window;
+	QSet<QByteArray> window_parked;
+};
+
+struct StubRequest {
+	StubRemote* remote;
+	quint32 offset;
+	quint32 size;
+	RequestWindow::clock::time_point started;
+};
+
+struct StubChunk {
+	explicit StubChunk(QByteArray ct_hash) : ct_hash(ct_hash), file_map(CHUNK_SIZE) {}
+
+	QByteArray ct_hash;
+	AvailabilityMap<uint32_t> file_map;     // Blocks, not yet received
+	std::vector<StubRemote*> owned_by;
+	QMultiHash<StubRemote*, StubRequest> requests;
+	bool started = false;
+	bool window_parked = false;
+
+	AvailabilityMap<uint32_t> requestMap() const {
+		AvailabilityMap<uint32_t> request_map = file_map;
+		for(auto& request : requests)
+			request_map.insert({request.offset, request.size});
+		return request_map;
+	}
+};
+
+class StubDownloader {
+public:
+	std::vector<std::unique_ptr<StubRemote>> remotes;
+	QHash<QByteArray, std::shared_ptr<StubChunk>> down_chunks;
+	WeightedChunkQueue download_queue;
+	std::vector<StubRequest> in_flight;
+	unsigned builders_count = 0;
+	size_t parked_count = 0;
+
+	quint32 requestOne() {
+		StubRemote* remote = nullptr;
+		std::shared_ptr<StubChunk> chunk;
+		AvailabilityMap<uint32_t> request_map(0);
+		for(;;) {
+			std::vector<std::shared_ptr<StubChunk>> skipped;
+			QByteArray ct_hash = download_queue.findRequestable([&](const QByteArray& candidate){
+				remote = nodeForRequest(candidate);
+				if(! remote)
+					skipped.push_back(down_chunks.value(candidate));
+				return remote != nullptr;
+			}, builders_count >= BUILDERS_MAX);
+
+			for(auto& skipped_chunk : skipped)
+				parkIfWindowsFull(skipped_chunk);
+
+			if(ct_hash.isEmpty())
+				return 0;
+
+			chunk = down_chunks.value(ct_hash);
+			request_map = chunk->requestMap();
+			if(! request_map.full()) break;
+
+			updateRequestable(chunk);
+		}
+
+		if(! chunk->started) {
+			chunk->started = true;
+			builders_count++;
+			download_queue.markStarted(chunk->ct_hash);
+		}
+
+		StubRequest request;
+		request.remote = remote;
+		request.offset = request_map.begin()->first;
+		request.size = std::min(request_map.begin()->second, remote->request_window.blockSize());
+		request.started = RequestWindow::clock::now();
+
+		chunk->requests.insert(remote, request);
+		remote->request_window.requestSent();
+		in_flight.push_back(request);
+		flight_chunks_.push_back(chunk);
+		updateRequestable(chunk);
+		return request.size;
+	}
+
+	// Every outstanding block arrives
+	size_t deliverAll() {
+		size_t delivered = in_flight.size();
+		for(size_t i = 0; i < in_flight.size(); i++) {
+			StubRequest& request = in_flight[i];
+			auto& chunk = flight_chunks_[i];
+
+			for(auto request_it = chunk->requests.find(request.remote); request_it != chunk->requests.end() && request_it.key() == request.remote; ++request_it) {
+				if(request_it->offset == request.offset) {
+					chunk->requests.erase(request_it);
+					break;
+				}
+			}
+
+			chunk->file_map.insert({request.offset, request.size});
+			request.remote->request_window.requestCompleted(request.size, request.started, std::chrono::milliseconds(0));
+
+			if(chunk->file_map.full()) {
+				download_queue.removeChunk(chunk->ct_hash);
+				down_chunks.remove(chunk->ct_hash);
+				builders_count--;
+			}else
+				updateRequestable(chunk);
+			windowFreed(request.remote);
+		}
+		in_flight.clear();
+		flight_chunks_.clear();
+		return delivered;
+	}
+
+private:
+	std::vector<std::shared_ptr<StubChunk>> flight_chunks_;
+
+	StubRemote* nodeForRequest(const QByteArray& ct_hash) {
+		auto chunk = down_chunks.value(ct_hash);
+		if(! chunk) return nullptr;
+
+		StubRemote* best_remote = nullptr;
+		RequestWindow::clock::duration best_delivery = RequestWindow::clock::duration::max();
+		for(StubRemote* owner_remote : chunk->owned_by) {
+			if(! owner_remote->request_window.hasFreeSlot()) continue;
+
+			auto delivery = owner_remote->request_window.expectedDelivery();
+			if(delivery < best_delivery) {
+				best_remote = owner_remote;
+				best_delivery = delivery;
+			}
+		}
+		return best_remote;
+	}
+
+	void updateRequestable(const std::shared_ptr<StubChunk>& chunk) {
+		if(! down_chunks.contains(chunk->ct_hash)) return;
+		download_queue.setRequestable(chunk->ct_hash, !chunk->window_parked && !chunk->requestMap().full());
+	}
+
+	void parkIfWindowsFull(const std::shared_ptr<StubChunk>& chunk) {
+		for(StubRemote* owner_remote : chunk->owned_by)
+			if(owner_remote->request_window.hasFreeSlot()) return;
+
+		chunk->window_parked = true;
+		for(StubRemote* owner_remote : chunk->owned_by)
+			owner_remote->window_parked.insert(chunk->ct_hash);
+		download_queue.setRequestable(chunk->ct_hash, false);
+		parked_count++;
+	}
+
+	void windowFreed(StubRemote* remote) {
+		if(! remote->request_window.hasFreeSlot()) return;
+
+		QSet<QByteArray> parked = std::move(remote->window_parked);
+		remote->window_parked.clear();
+		for(const QByteArray& ct_hash : parked) {
+			auto chunk = down_chunks.value(ct_hash);
+			if(!chunk || !chunk->window_parked) continue;
+
+			chunk->window_parked = false;
+			updateRequestable(chunk);
+		}
+	}
+};
+
+QByteArray make_ct_hash(quint32 idx) {
+	QByteArray ct_hash(28, 0);
+	qToBigEndian(idx * 2654435761u, (uchar*)ct_hash.data());  // Spread over the hash table, like real hashes
+	qToBigEndian(idx, (uchar*)ct_hash.data() + sizeof(quint32));
+	return ct_hash;
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	size_t chunk_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	size_t remote_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16;
+	quint32 window = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 32;
+	remote_count = std::max(remote_count, size_t(1));
+
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<size_t> remote_dist(0, remote_count-1);
+	std::uniform_int_distribution<int> owners_dist(1, std::min(remote_count, size_t(4)));
+	std::uniform_real_distribution<float> completion_dist(0, 1);
+
+	StubDownloader downloader;
+
+	RequestWindow::Limits limits;
+	limits.window_initial = limits.window_min = limits.window_max = window;
+	limits.block_initial = limits.block_min = limits.block_max = BLOCK_SIZE;
+	for(size_t i = 0; i < remote_count; i++) {
+		downloader.remotes.push_back(std::make_unique<StubRemote>());
+		downloader.remotes.back()->request_window.setLimits(limits);
+	}
+
+	for(size_t i = 0; i < chunk_count; i++) {
+		auto chunk = std::make_shared<StubChunk>(make_ct_hash(i));
+		int owners = owners_dist(rng);
+		while(chunk->owned_by.size() < size_t(owners)) {
+			StubRemote* owner = downloader.remotes[remote_dist(rng)].get();
+			if(std::find(chunk->owned_by.begin(), chunk->owned_by.end(), owner) == chunk->owned_by.end())
+				chunk->owned_by.push_back(owner);
+		}
+
+		downloader.down_chunks.insert(chunk->ct_hash, chunk);
+		downloader.download_queue.addChunk(chunk->ct_hash);
+		downloader.download_queue.setOwnedBy(chunk->ct_hash, owners);
+		downloader.download_queue.setFileWeight(chunk->ct_hash, 0, completion_dist(rng));
+		downloader.download_queue.setRequestable(chunk->ct_hash, true);
+	}
+
+	// Windows are filled, then every block arrives, until every chunk is downloaded
+	bench_clock::duration request_time = bench_clock::duration::zero(), deliver_time = bench_clock::duration::zero();
+	size_t requested = 0, rounds = 0, empty_calls = 0;
+	while(! downloader.down_chunks.isEmpty()) {
+		auto started = bench_clock::now();
+		for(;;) {
+			if(downloader.requestOne() == 0) {
+				empty_calls++;
+				break;
+			}
+			requested++;
+		}
+		request_time += bench_clock::now() - started;
+
+		started = bench_clock::now();
+		if(downloader.deliverAll() == 0) break;     // Stalled
+		deliver_time += bench_clock::now() - started;
+		rounds++;
+	}
+
+	double request_ns = std::chrono::duration<double, std::nano>(request_time).count();
+	double deliver_ns = std::chrono::duration<double, std::nano>(deliver_time).count();
+	std::printf("%-32s %10zu ops %12.3f ms %10.1f ns/op\n", "requestOne", requested + empty_calls, request_ns / 1e6,
+		request_ns / std::max(requested + empty_calls, size_t(1)));
+	std::printf("%-32s %10zu ops %12.3f ms %10.1f ns/op\n", "deliver", requested, deliver_ns / 1e6, deliver_ns / std::max(requested, size_t(1)));
+	std::printf("rounds: %zu, parked: %zu\n", rounds, downloader.parked_count);
+
+	return downloader.down_chunks.isEmpty() ? 0 : 1;
+}
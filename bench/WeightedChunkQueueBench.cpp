@@ -0,0 +1,127 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "folder/transfer/downloader/WeightedChunkQueue.h"
+#include <QByteArray>
+#include <QtEndian>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/* Measures WeightedChunkQueue on a large download queue, the way Downloader drives it: chunks are added as remotes announce them,
+ * requestOne() takes the heaviest requestable chunk, and verified chunks are removed.
+ * Usage: librevault-bench-chunkqueue [chunk_count] [request_count] */
+
+using namespace librevault;
+using bench_clock = std::chrono::steady_clock;
+
+namespace {
+
+QByteArray make_ct_hash(quint32 idx) {
+	QByteArray ct_hash(28, 0);
+	qToBigEndian(idx * 2654435761u, (uchar*)ct_hash.data());  // Spread over the hash table, like real hashes
+	qToBigEndian(idx, (uchar*)ct_hash.data() + sizeof(quint32));
+	return ct_hash;
+}
+
+void report(const char* phase, size_t ops, bench_clock::time_point started) {
+	double elapsed_ns = std::chrono::duration<double, std::nano>(bench_clock::now() - started).count();
+	std::printf("%-32s %10zu ops %12.3f ms %10.1f ns/op\n", phase, ops, elapsed_ns / 1e6, ops > 0 ? elapsed_ns / ops : 0.0);
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	size_t chunk_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	size_t request_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+	request_count = std::min(request_count, chunk_count);
+
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<int> owners_dist(1, 8);
+	std::uniform_real_distribution<float> completion_dist(0, 1);
+
+	std::vector<QByteArray> chunks;
+	chunks.reserve(chunk_count);
+	for(size_t i = 0; i < chunk_count; i++)
+		chunks.push_back(make_ct_hash(i));
+
+	WeightedChunkQueue queue;
+
+	// Remotes announce their bitfields
+	auto started = bench_clock::now();
+	for(auto& ct_hash : chunks) {
+		queue.addChunk(ct_hash);
+		queue.setOwnedBy(ct_hash, owners_dist(rng));
+		queue.setFileWeight(ct_hash, 0, completion_dist(rng));
+		queue.setRequestable(ct_hash, true);
+	}
+	report("add", chunk_count, started);
+
+	// Every owner has a free window slot: the first candidate is taken
+	started = bench_clock::now();
+	size_t requested = 0;
+	for(size_t i = 0; i < request_count; i++) {
+		QByteArray ct_hash = queue.findRequestable([](const QByteArray&){return true;});
+		if(ct_hash.isEmpty()) break;
+		queue.markStarted(ct_hash);
+		queue.setRequestable(ct_hash, false);   // Every block is requested
+		requested++;
+	}
+	report("requestOne", requested, started);
+
+	// Owners of every other chunk have full windows. Downloader parks such chunks, so each of them is passed over only once.
+	started = bench_clock::now();
+	requested = 0;
+	for(size_t i = 0; i < request_count; i++) {
+		std::vector<QByteArray> parked;
+		QByteArray ct_hash = queue.findRequestable([&](const QByteArray& candidate){
+			if(candidate[7] & 1) {
+				parked.push_back(candidate);
+				return false;
+			}
+			return true;
+		});
+		for(auto& parked_hash : parked)
+			queue.setRequestable(parked_hash, false);
+		if(ct_hash.isEmpty()) break;
+		queue.setRequestable(ct_hash, false);
+		requested++;
+	}
+	report("requestOne (half windows full)", requested, started);
+
+	// Verified chunks leave the queue
+	started = bench_clock::now();
+	for(auto& ct_hash : chunks)
+		queue.removeChunk(ct_hash);
+	report("remove", chunk_count, started);
+
+	return queue.size() == 0 ? 0 : 1;
+}
@@ -69,6 +69,10 @@ Client::Client(int argc, char** argv) : QCoreApplication(argc, argv) {
 
 	connect(control_server_, &ControlServer::restart, this, &Client::restart);
 	connect(control_server_, &ControlServer::shutdown, this, &Client::shutdown);
+	connect(control_server_, &ControlServer::prioritizeFile, folder_service_, [this](QByteArray folderid, QString path){
+		FolderGroup* group = folder_service_->getGroup(folderid);
+		if(group) group->prioritizeFile(path);
+	});
 }
 
 Client::~Client() {
@@ -27,6 +27,7 @@
  * files in the program, then also delete it here.
  */
 #include "FolderParams.h"
+#include <QDir>
 #include <QJsonArray>
 #include <QtDebug>
 
@@ -65,6 +66,27 @@ FolderParams::FolderParams(QVariantMap fconfig) {
 	archive_trash_ttl = fconfig["archive_trash_ttl"].toInt();
 	archive_timestamp_count = fconfig["archive_timestamp_count"].toInt();
 	mainline_dht_enabled = fconfig["mainline_dht_enabled"].toBool();
+	delta_assembly = fconfig["delta_assembly"].toBool();
+	meta_delta_chunks_min = fconfig["meta_delta_chunks_min"].toUInt();
+
+	upload_limit = fconfig["bandwidth_upload_limit"].toULongLong();
+	download_limit = fconfig["bandwidth_download_limit"].toULongLong();
+	transfer_weight = fconfig["transfer_weight"].toUInt();
+	super_seeding = fconfig["super_seeding"].toBool();
+
+	foreach(const QVariant& rule, fconfig["download_priorities"].toList()) {
+		QVariantMap rule_map = rule.toMap();
+		download_priorities.push_back(qMakePair(rule_map["pattern"].toString(), rule_map["priority"].toInt()));
+	}
+}
+
+int FolderParams::downloadPriority(const QByteArray& normpath) const {
+	QString path = QString::fromUtf8(normpath);
+	for(auto& rule : download_priorities) {
+		if(QDir::match(rule.first, path) || QDir::match(rule.first + "/*", path))  // Patterns match directories, like in .lvignore
+			return rule.second;
+	}
+	return 0;
 }
 
 } /* namespace librevault */
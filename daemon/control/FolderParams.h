@@ -47,6 +47,8 @@ struct FolderParams {
 
 	FolderParams(QVariantMap fconfig);
 
+	int downloadPriority(const QByteArray& normpath) const;
+
 	/* Parameters */
 	Secret secret;
 	QString path;
@@ -64,6 +66,13 @@ struct FolderParams {
 	unsigned archive_trash_ttl;
 	unsigned archive_timestamp_count;
 	bool mainline_dht_enabled;
+	bool delta_assembly;
+	unsigned meta_delta_chunks_min;     // Smaller files are always sent as a whole Meta
+	QList<QPair<QString, int>> download_priorities;    // Wildcard pattern -> priority. The first matching pattern wins.
+	quint64 upload_limit;       // bytes/s, 0 is unlimited
+	quint64 download_limit;
+	unsigned transfer_weight;   // Share of the daemon-wide download request budget
+	bool super_seeding;         // Reveal local chunks a few at a time, see SuperSeeder
 };
 
 } /* namespace librevault */
@@ -50,6 +50,9 @@ ControlHTTPServer::ControlHTTPServer(ControlServer& cs, ControlServer::server& s
 	ADD_HANDLER(R"(^\/v1\/folders\/state\/?$)", handle_folders_state_all);
 	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/state\/?$)", handle_folders_state_one);
 
+	// actions
+	ADD_HANDLER(R"(^\/v1\/folders\/(?!state)(\w+?)\/priority\/?$)", handle_folders_priority);
+
 	// daemon
 	ADD_HANDLER(R"(^\/v1\/version\/?$)", handle_version);
 	ADD_HANDLER(R"(^\/v1\/restart\/?$)", handle_restart);
@@ -169,6 +172,21 @@ void ControlHTTPServer::handle_folders_state_one(pconn conn, QRegularExpressionM
 	sendJson(QJsonDocument(state_collector_.folder_state(folderid)), http_code::ok, conn);
 }
 
+void ControlHTTPServer::handle_folders_priority(pconn conn, QRegularExpressionMatch match) {
+	QByteArray folderid = QByteArray::fromHex(match.captured(1).toLatin1());
+	if(conn->get_request().get_method() == "POST") {
+		QJsonObject o = QJsonDocument::fromJson(QByteArray::fromStdString(conn->get_request_body())).object();
+		if(o["path"].toString().isEmpty()) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			conn->set_body(make_error_body("NO_PATH", "\"path\" is required"));
+			return;
+		}
+
+		conn->set_status(websocketpp::http::status_code::ok);
+		emit cs_.prioritizeFile(folderid, o["path"].toString());
+	}
+}
+
 std::string ControlHTTPServer::make_error_body(const std::string& code, const std::string& description) {
 	QJsonObject error_json;
 	error_json["error_code"] = code.empty() ? "UNKNOWN" : QString::fromStdString(code);
@@ -66,6 +66,9 @@ private:
 	void handle_folders_state_all(pconn conn, QRegularExpressionMatch match);
 	void handle_folders_state_one(pconn conn, QRegularExpressionMatch match);
 
+	// actions
+	void handle_folders_priority(pconn conn, QRegularExpressionMatch match);
+
 	// daemon
 	void handle_restart(pconn conn, QRegularExpressionMatch match);
 	void handle_shutdown(pconn conn, QRegularExpressionMatch match);
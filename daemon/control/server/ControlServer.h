@@ -59,6 +59,7 @@ public:
 signals:
 	void shutdown();
 	void restart();
+	void prioritizeFile(QByteArray folderid, QString path);
 
 public slots:
 	void notify_global_config_changed(QString key, QVariant state);
@@ -31,13 +31,18 @@
 #include "IgnoreList.h"
 #include "PathNormalizer.h"
 #include "control/StateCollector.h"
+#include "folder/chunk/ChunkIOService.h"
+#include "folder/chunk/ChunkPrefetcher.h"
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/meta/MetaStorage.h"
 #include "folder/transfer/MetaDownloader.h"
 #include "folder/transfer/MetaUploader.h"
+#include "folder/transfer/SuperSeeder.h"
 #include "folder/transfer/Uploader.h"
 #include "folder/transfer/Downloader.h"
+#include "p2p/BandwidthLimiter.h"
 #include "p2p/P2PFolder.h"
+#include "util/FdBudget.h"
 #include <QDir>
 #include <QJsonArray>
 #ifdef Q_OS_WIN
@@ -46,7 +51,7 @@
 
 namespace librevault {
 
-FolderGroup::FolderGroup(FolderParams params, StateCollector* state_collector, QObject* parent) :
+FolderGroup::FolderGroup(FolderParams params, TransferScheduler* transfer_scheduler, StateCollector* state_collector, QObject* parent) :
 		QObject(parent),
 		params_(std::move(params)),
 		state_collector_(state_collector) {
@@ -73,21 +78,36 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector* state_collector, Q
 	meta_storage_ = new MetaStorage(params_, ignore_list.get(), path_normalizer_.get(), state_collector_, this);
 	chunk_storage_ = new ChunkStorage(params_, meta_storage_, path_normalizer_.get(), this);
 
+	bandwidth_limiter_ = new BandwidthLimiter(BandwidthLimiter::global(), this);
+	bandwidth_limiter_->setLimits(params_.upload_limit, params_.download_limit);
+
 	uploader_ = new Uploader(chunk_storage_, this);
-	downloader_ = new Downloader(params_, meta_storage_, this);
-	meta_uploader_ = new MetaUploader(meta_storage_, chunk_storage_, this);
-	meta_downloader_ = new MetaDownloader(meta_storage_, downloader_, this);
+	downloader_ = new Downloader(params_, meta_storage_, chunk_storage_->io(), transfer_scheduler, this);
+	super_seeder_ = params_.super_seeding ? new SuperSeeder(meta_storage_, chunk_storage_, this) : nullptr;
+	meta_uploader_ = new MetaUploader(meta_storage_, chunk_storage_, super_seeder_, this);
+	meta_downloader_ = new MetaDownloader(params_, meta_storage_, downloader_, this);
 
 	state_pusher_ = new QTimer(this);
 
 	// Connecting signals and slots
 	connect(meta_storage_, &MetaStorage::metaAdded, this, &FolderGroup::handle_indexed_meta);
 	connect(chunk_storage_, &ChunkStorage::chunkAdded, this, [this](const blob& ct_hash){
+		meta_storage_->touchChunk(ct_hash);    // Bitfields have changed, so the metas, containing it, are re-sent to peers past their watermark
 		downloader_->notifyLocalChunk(ct_hash);
-		uploader_->broadcast_chunk(remotes(), ct_hash);
+		if(super_seeder_ && super_seeder_->active())
+			super_seeder_->handleLocalChunk(ct_hash);
+		else
+			uploader_->broadcast_chunk(remotes(), ct_hash);
 	});
 	connect(downloader_, &Downloader::chunkDownloaded, chunk_storage_, &ChunkStorage::put_chunk);
 	connect(state_pusher_, &QTimer::timeout, this, &FolderGroup::push_state);
+	if(super_seeder_) {
+		// Everything is in the swarm, advertise all chunks normally
+		connect(super_seeder_, &SuperSeeder::finished, this, [this]{
+			foreach(RemoteFolder* remote, remotes_ready_)
+				meta_uploader_->post_all_meta(remote);
+		});
+	}
 
 	// Set up state pusher
 	state_pusher_->setInterval(1000);
@@ -97,6 +117,7 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector* state_collector, Q
 	QTimer::singleShot(0, this, [=]{
 		for(auto& smeta : meta_storage_->getMeta())
 			handle_indexed_meta(smeta);
+		downloader_->pruneIncomplete();
 	});
 }
 
@@ -129,23 +150,57 @@ void FolderGroup::handle_handshake(RemoteFolder* origin) {
 	connect(origin, &RemoteFolder::rcvdHaveMeta, meta_downloader_, [=](Meta::PathRevision revision, bitfield_type bitfield){
 		meta_downloader_->handle_have_meta(origin, revision, bitfield);
 	});
+	connect(origin, &RemoteFolder::rcvdHaveMeta, chunk_storage_->prefetcher(), [=](Meta::PathRevision revision, bitfield_type bitfield){
+		chunk_storage_->prefetcher()->hintRemoteMeta(revision, bitfield);
+	});
 	connect(origin, &RemoteFolder::rcvdHaveChunk, downloader_, [=](const blob& ct_hash){
 		downloader_->notifyRemoteChunk(origin, ct_hash);
 	});
+	connect(origin, &RemoteFolder::rcvdIndexDigest, meta_uploader_, [=](QVector<quint64> digests){
+		meta_uploader_->handle_index_digest(origin, digests);
+	});
+	connect(origin, &RemoteFolder::rcvdIndexSince, meta_uploader_, [=](QByteArray log_id, quint64 seq, QList<QByteArray> incomplete_path_ids){
+		meta_uploader_->handle_index_since(origin, log_id, seq, incomplete_path_ids);
+	});
+	connect(origin, &RemoteFolder::rcvdIndexUpTo, meta_downloader_, [=](QByteArray log_id, quint64 seq){
+		meta_downloader_->handle_index_upto(origin, log_id, seq);
+	});
 	connect(origin, &RemoteFolder::rcvdMetaRequest, meta_uploader_, [=](Meta::PathRevision path_revision){
 		meta_uploader_->handle_meta_request(origin, path_revision);
 	});
 	connect(origin, &RemoteFolder::rcvdMetaReply, meta_downloader_, [=](const SignedMeta& smeta, const bitfield_type& bitfield){
 		meta_downloader_->handle_meta_reply(origin, smeta, bitfield);
 	});
+	connect(origin, &RemoteFolder::rcvdMetaDeltaRequest, meta_uploader_, [=](Meta::PathRevision path_revision, qint64 base_revision){
+		meta_uploader_->handle_meta_delta_request(origin, path_revision, base_revision);
+	});
+	connect(origin, &RemoteFolder::rcvdMetaDelta, meta_downloader_, [=](const MetaDelta& delta, const bitfield_type& bitfield){
+		meta_downloader_->handle_meta_delta(origin, delta, bitfield);
+	});
 	connect(origin, &RemoteFolder::rcvdBlockRequest, uploader_, [=](const blob& ct_hash, uint32_t offset, uint32_t size){
 		uploader_->handle_block_request(origin, ct_hash, offset, size);
 	});
+	connect(origin, &RemoteFolder::rcvdBlockCancel, uploader_, [=](const blob& ct_hash, uint32_t offset, uint32_t size){
+		uploader_->handle_block_cancel(origin, ct_hash, offset, size);
+	});
 	connect(origin, &RemoteFolder::rcvdBlockReply, downloader_, [=](const blob& ct_hash, uint32_t offset, const blob& block){
 		downloader_->putBlock(ct_hash, offset, block, origin);
 	});
 
-	QTimer::singleShot(0, meta_uploader_, [=]{meta_uploader_->handle_handshake(origin);});
+	if(super_seeder_) {
+		connect(origin, &RemoteFolder::rcvdHaveMeta, super_seeder_, [=](Meta::PathRevision revision, bitfield_type bitfield){
+			super_seeder_->handleRemoteMeta(origin, revision, bitfield);
+		});
+		connect(origin, &RemoteFolder::rcvdHaveChunk, super_seeder_, [=](blob ct_hash){
+			super_seeder_->handleRemoteChunk(origin, ct_hash);
+		});
+		QTimer::singleShot(0, super_seeder_, [=]{super_seeder_->addRemote(origin);});
+	}
+
+	QTimer::singleShot(0, meta_uploader_, [=]{
+		meta_downloader_->handle_handshake(origin);   // INDEX_SINCE goes first, so that the remote answers it before our index digest
+		meta_uploader_->handle_handshake(origin);
+	});
 }
 
 bool FolderGroup::attach(P2PFolder* remote) {
@@ -174,6 +229,9 @@ void FolderGroup::detach(P2PFolder* remote) {
 
 	emit detached(remote);
 	downloader_->untrackRemote(remote);
+	uploader_->untrack_remote(remote);
+	if(super_seeder_)
+		super_seeder_->removeRemote(remote);
 
 	p2p_folders_digests_.remove(remote->digest());
 	p2p_folders_endpoints_.remove(remote->endpoint());
@@ -184,6 +242,15 @@ void FolderGroup::detach(P2PFolder* remote) {
 	LOGD("Detached remote " << remote->displayName());
 }
 
+bool FolderGroup::prioritizeFile(QString path) {
+	if(params_.secret.get_type() > Secret::Type::ReadOnly)
+		return false;   // path_id can't be derived without the encryption key
+
+	QByteArray normpath = path_normalizer_->normalizePath(QDir(params_.path).absoluteFilePath(path));
+	downloader_->prioritizeFile(conv_bytearray(Meta::make_path_id(normpath.toStdString(), params_.secret)));
+	return true;
+}
+
 QList<RemoteFolder*> FolderGroup::remotes() const {
 	return remotes_.toList();
 }
@@ -199,8 +266,18 @@ void FolderGroup::push_state() {
 		peers_array.append(p2p_folder->collect_state());
 	}
 	state_collector_->folder_state_set(folderid(), "peers", peers_array);
+	state_collector_->folder_state_set(folderid(), "peer_reputation", downloader_->reputation().collect_state());
+	state_collector_->folder_state_set(folderid(), "upload_slots", uploader_->collect_state());
+	state_collector_->folder_state_set(folderid(), "chunk_io", chunk_storage_->io()->collect_state());
+	if(super_seeder_)
+		state_collector_->folder_state_set(folderid(), "super_seeding", super_seeder_->collect_state());
 	// bandwidth
 	state_collector_->folder_state_set(folderid(), "traffic_stats", bandwidth_counter_.heartbeat_json());
+	state_collector_->folder_state_set(folderid(), "bandwidth_limits", bandwidth_limiter_->collect_state());
+	state_collector_->global_state_set("bandwidth_limits", BandwidthLimiter::global()->collect_state());
+	// process-wide file descriptors
+	state_collector_->global_state_set("fd_budget", FdBudget::get_instance()->collect_state());
+	state_collector_->global_state_set("chunk_fd_pool", ChunkFileBuilderFdPool::get_instance()->collect_state());
 }
 
 } /* namespace librevault */
@@ -42,6 +42,7 @@
 namespace librevault {
 
 class RemoteFolder;
+class BandwidthLimiter;
 class FSFolder;
 class P2PFolder;
 
@@ -56,6 +57,8 @@ class MetaUploader;
 class MetaDownloader;
 class Uploader;
 class Downloader;
+class SuperSeeder;
+class TransferScheduler;
 
 class FolderGroup : public QObject {
 	Q_OBJECT
@@ -66,7 +69,7 @@ signals:
 	void detached(P2PFolder* remote_ptr);
 
 public:
-	FolderGroup(FolderParams params, StateCollector* state_collector, QObject* parent);
+	FolderGroup(FolderParams params, TransferScheduler* transfer_scheduler, StateCollector* state_collector, QObject* parent);
 	virtual ~FolderGroup();
 
 	/* Membership management */
@@ -82,6 +85,10 @@ public:
 	QByteArray folderid() const {return conv_bytearray(secret().get_Hash());}
 
 	BandwidthCounter& bandwidth_counter() {return bandwidth_counter_;}
+	BandwidthLimiter* bandwidth_limiter() {return bandwidth_limiter_;}
+
+	/* Actions */
+	bool prioritizeFile(QString path);
 
 	QString log_tag() const;
 
@@ -99,8 +106,10 @@ private:
 	Downloader* downloader_;
 	MetaUploader* meta_uploader_;
 	MetaDownloader* meta_downloader_;
+	SuperSeeder* super_seeder_;
 
 	BandwidthCounter bandwidth_counter_;
+	BandwidthLimiter* bandwidth_limiter_;
 
 	QTimer* state_pusher_;
 
@@ -31,6 +31,7 @@
 #include "control/Config.h"
 #include "control/StateCollector.h"
 #include "folder/meta/IndexerQueue.h"
+#include "folder/transfer/TransferScheduler.h"
 #include "util/log.h"
 
 namespace librevault {
@@ -38,6 +39,7 @@ namespace librevault {
 FolderService::FolderService(StateCollector* state_collector, QObject* parent) : QObject(parent),
 	state_collector_(state_collector) {
 	LOGFUNC();
+	transfer_scheduler_ = new TransferScheduler(state_collector_, this);
 }
 
 FolderService::~FolderService() {
@@ -64,7 +66,7 @@ void FolderService::stop() {
 
 void FolderService::initFolder(const FolderParams& params) {
 	LOGFUNC();
-	auto fgroup = new FolderGroup(params, state_collector_, this);
+	auto fgroup = new FolderGroup(params, transfer_scheduler_, state_collector_, this);
 	groups_[fgroup->folderid()] = fgroup;
 
 	emit folderAdded(fgroup);
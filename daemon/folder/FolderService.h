@@ -38,6 +38,7 @@ namespace librevault {
 class FolderGroup;
 class FolderParams;
 class StateCollector;
+class TransferScheduler;
 
 class FolderService : public QObject {
 	Q_OBJECT
@@ -65,6 +66,7 @@ signals:
 
 private:
 	StateCollector* state_collector_;
+	TransferScheduler* transfer_scheduler_;
 
 	QMap<QByteArray, FolderGroup*> groups_;
 };
@@ -28,13 +28,19 @@
  */
 #pragma once
 #include "blob.h"
+#include "folder/meta/MetaDelta.h"
+#include "folder/transfer/downloader/RequestWindow.h"
 #include <librevault/Meta.h>
 #include <librevault/SignedMeta.h>
 #include <librevault/util/conv_bitfield.h>
 #include <QObject>
+#include <QVector>
+#include <chrono>
 
 namespace librevault {
 
+class BandwidthLimiter;
+
 class RemoteFolder : public QObject {
 	Q_OBJECT
 	friend class FolderGroup;
@@ -51,10 +57,15 @@ signals:
 
 	void rcvdHaveMeta(Meta::PathRevision, bitfield_type);
 	void rcvdHaveChunk(blob);
+	void rcvdIndexDigest(QVector<quint64>);
+	void rcvdIndexSince(QByteArray, quint64, QList<QByteArray>);
+	void rcvdIndexUpTo(QByteArray, quint64);
 
 	void rcvdMetaRequest(Meta::PathRevision);
 	void rcvdMetaReply(SignedMeta, bitfield_type);
 	void rcvdMetaCancel(Meta::PathRevision);
+	void rcvdMetaDeltaRequest(Meta::PathRevision, qint64);
+	void rcvdMetaDelta(MetaDelta, bitfield_type);
 
 	void rcvdBlockRequest(blob, uint32_t, uint32_t);
 	void rcvdBlockReply(blob, uint32_t, blob);
@@ -65,7 +76,9 @@ public:
 	virtual ~RemoteFolder();
 
 	virtual QString displayName() const = 0;
+	virtual QByteArray digest() const = 0;  // Stable identity of the remote node
 	virtual QJsonObject collect_state() = 0;
+	virtual bool supports(const QString& extension) const = 0;    // Protocol extensions, see V1Extensions
 	QString log_tag() const;
 
 	/* Message senders */
@@ -76,10 +89,15 @@ public:
 
 	virtual void post_have_meta(const Meta::PathRevision& revision, const bitfield_type& bitfield) = 0;
 	virtual void post_have_chunk(const blob& ct_hash) = 0;
+	virtual void post_index_digest(const QVector<quint64>& digests) = 0;
+	virtual void post_index_since(const QByteArray& log_id, quint64 seq, const QList<QByteArray>& incomplete_path_ids) = 0;
+	virtual void post_index_upto(const QByteArray& log_id, quint64 seq) = 0;
 
 	virtual void request_meta(const Meta::PathRevision& revision) = 0;
 	virtual void post_meta(const SignedMeta& smeta, const bitfield_type& bitfield) = 0;
 	virtual void cancel_meta(const Meta::PathRevision& revision) = 0;
+	virtual void request_meta_delta(const Meta::PathRevision& revision, qint64 base_revision) = 0;
+	virtual void post_meta_delta(const MetaDelta& delta, const bitfield_type& bitfield) = 0;
 
 	virtual void request_block(const blob& ct_hash, uint32_t offset, uint32_t size) = 0;
 	virtual void post_block(const blob& ct_hash, uint32_t offset, const blob& chunk) = 0;
@@ -101,6 +119,12 @@ public:
 	bool peer_interested() const {return peer_interested_;}
 
 	virtual bool ready() const = 0;
+	virtual std::chrono::milliseconds rtt() const = 0;
+	virtual BandwidthLimiter* limiter() = 0;    // Paces block transfers with this remote
+
+	/* Download pipeline towards this remote, managed by Downloader */
+	RequestWindow& request_window() {return request_window_;}
+	const RequestWindow& request_window() const {return request_window_;}
 
 protected:
 	bool am_choking_ = true;
@@ -109,6 +133,8 @@ protected:
 	bool peer_interested_ = false;
 
 	std::weak_ptr<InterestGuard> interest_guard_;
+
+	RequestWindow request_window_;
 };
 
 } /* namespace librevault */
@@ -28,6 +28,7 @@
  */
 #include "AssemblerQueue.h"
 #include "AssemblerWorker.h"
+#include "ChunkStorage.h"
 #include "folder/meta/MetaStorage.h"
 #include <QLoggingCategory>
 
@@ -48,23 +49,140 @@ AssemblerQueue::AssemblerQueue(const FolderParams& params,
 	archive_(archive) {
 
 	threadpool_ = new QThreadPool(this);
+	chunk_threadpool_ = new QThreadPool(this);
 
 	assemble_timer_ = new QTimer(this);
-	assemble_timer_->setInterval(30*1000);
+	assemble_timer_->setInterval(5*60*1000);    // Only a safety net, files are assembled as soon as their last chunk arrives
 	connect(assemble_timer_, &QTimer::timeout, this, &AssemblerQueue::periodic_assemble_operation);
 	assemble_timer_->start();
+
+	QTimer::singleShot(0, this, &AssemblerQueue::periodic_assemble_operation);  // Pick up files, left incomplete after the last run
 }
 
 AssemblerQueue::~AssemblerQueue() {
 	qCDebug(log_assembler) << "Stopping assembler queue";
 	emit aboutToStop();
 	threadpool_->waitForDone();
+	chunk_threadpool_->waitForDone();
 	qCDebug(log_assembler) << "Assembler queue stopped";
 }
 
 void AssemblerQueue::addAssemble(SignedMeta smeta) {
-	AssemblerWorker* worker = new AssemblerWorker(smeta, params_, meta_storage_, chunk_storage_, path_normalizer_, archive_);
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+	if(assembling_.contains(path_id)) {
+		deferred_.insert(path_id, smeta);
+		return;
+	}
+	untrack(path_id);
+
+	if(smeta.meta().meta_type() == Meta::FILE)
+		track(smeta);
+	else
+		startAssemble(smeta);
+}
+
+void AssemblerQueue::notifyChunk(blob ct_hash, QByteArray hot_chunk) {
+	QSet<QByteArray> waiters = chunk_waiters_.take(conv_bytearray(ct_hash));
+	for(const QByteArray& path_id : waiters) {
+		auto pending_it = pending_files_.find(path_id);
+		if(pending_it == pending_files_.end()) continue;
+
+		pending_it->missing_chunks.remove(conv_bytearray(ct_hash));
+		if(pending_it->missing_chunks.isEmpty()) {
+			SignedMeta smeta = pending_it->smeta;
+			pending_files_.erase(pending_it);
+
+			QHash<QByteArray, QByteArray> hot_chunks;
+			if(! hot_chunk.isEmpty())
+				hot_chunks.insert(conv_bytearray(ct_hash), hot_chunk);
+			startAssemble(smeta, hot_chunks);
+		}
+	}
+}
+
+bool AssemblerQueue::completesAllWaiting(const blob& ct_hash) const {
+	auto waiters_it = chunk_waiters_.find(conv_bytearray(ct_hash));
+	if(waiters_it == chunk_waiters_.end() || waiters_it->isEmpty()) return false;
+
+	for(const QByteArray& path_id : *waiters_it) {
+		auto pending_it = pending_files_.find(path_id);
+		if(pending_it == pending_files_.end() || pending_it->missing_chunks.size() != 1)
+			return false;
+	}
+	return true;
+}
+
+void AssemblerQueue::notifyAssembled(SignedMeta smeta) {
+	// Chunks of the assembled file are now available from OpenStorage
+	for(auto& chunk : smeta.meta().chunks())
+		notifyChunk(chunk.ct_hash);
+}
+
+void AssemblerQueue::workerFinished(SignedMeta smeta, bool assembled) {
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+	QList<QByteArray> hot_chunks = assembling_.take(path_id);
+
+	auto deferred_it = deferred_.find(path_id);
+	if(deferred_it == deferred_.end()) {
+		// The worker hands its hot chunks to ChunkStorage::keep_chunk(). The file waits for them once more, instead of the periodic sweep.
+		if(!assembled && !hot_chunks.isEmpty() && !pending_files_.contains(path_id)) {
+			PendingFile pending_file;
+			pending_file.smeta = smeta;
+			for(const QByteArray& ct_hash : hot_chunks) {
+				pending_file.missing_chunks.insert(ct_hash);
+				chunk_waiters_[ct_hash].insert(path_id);
+			}
+			pending_files_.insert(path_id, pending_file);
+		}
+		return;
+	}
+	SignedMeta deferred = deferred_it.value();
+	deferred_.erase(deferred_it);
+
+	if(assembled && deferred.meta().revision() == smeta.meta().revision()) return;  // The sweep has found it, while it was assembled
+	addAssemble(deferred);
+}
+
+void AssemblerQueue::track(SignedMeta smeta) {
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+
+	PendingFile pending_file;
+	pending_file.smeta = smeta;
+	for(auto& chunk : smeta.meta().chunks())
+		if(! chunk_storage_->have_chunk(chunk.ct_hash))
+			pending_file.missing_chunks.insert(conv_bytearray(chunk.ct_hash));
+
+	if(pending_file.missing_chunks.isEmpty()) {
+		startAssemble(smeta);
+		return;
+	}
+
+	for(const QByteArray& ct_hash : pending_file.missing_chunks)
+		chunk_waiters_[ct_hash].insert(path_id);
+	pending_files_.insert(path_id, pending_file);
+}
+
+void AssemblerQueue::untrack(const QByteArray& path_id) {
+	auto pending_it = pending_files_.find(path_id);
+	if(pending_it == pending_files_.end()) return;
+
+	for(const QByteArray& ct_hash : pending_it->missing_chunks) {
+		auto waiters_it = chunk_waiters_.find(ct_hash);
+		if(waiters_it == chunk_waiters_.end()) continue;
+		waiters_it->remove(path_id);
+		if(waiters_it->isEmpty())
+			chunk_waiters_.erase(waiters_it);
+	}
+	pending_files_.erase(pending_it);
+}
+
+void AssemblerQueue::startAssemble(SignedMeta smeta, QHash<QByteArray, QByteArray> hot_chunks) {
+	assembling_.insert(conv_bytearray(smeta.meta().path_id()), hot_chunks.keys());
+
+	AssemblerWorker* worker = new AssemblerWorker(smeta, params_, meta_storage_, chunk_storage_, path_normalizer_, archive_, chunk_threadpool_, hot_chunks);
 	worker->setAutoDelete(true);
+	connect(worker, &AssemblerWorker::metaAssembled, this, &AssemblerQueue::notifyAssembled, Qt::QueuedConnection);
+	connect(worker, &AssemblerWorker::finished, this, &AssemblerQueue::workerFinished, Qt::QueuedConnection);
 	threadpool_->start(worker);
 }
 
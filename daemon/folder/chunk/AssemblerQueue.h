@@ -27,7 +27,10 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "blob.h"
 #include <librevault/SignedMeta.h>
+#include <QHash>
+#include <QSet>
 #include <QTimer>
 #include <QThreadPool>
 
@@ -59,6 +62,14 @@ public:
 
 public slots:
 	void addAssemble(SignedMeta smeta);
+	void notifyChunk(blob ct_hash, QByteArray hot_chunk = QByteArray());
+
+public:
+	bool completesAllWaiting(const blob& ct_hash) const;   // Every file, waiting for this chunk, is assembled, once it arrives
+
+private slots:
+	void notifyAssembled(SignedMeta smeta);
+	void workerFinished(SignedMeta smeta, bool assembled);
 
 private:
 	const FolderParams& params_;
@@ -68,6 +79,23 @@ private:
 	Archive* archive_;
 
 	QThreadPool* threadpool_;
+	QThreadPool* chunk_threadpool_; // Used by AssemblerWorker to fetch and decrypt chunks in parallel
+
+	/* Readiness tracker. Incomplete files wait here until their last missing chunk arrives */
+	struct PendingFile {
+		SignedMeta smeta;
+		QSet<QByteArray> missing_chunks;
+	};
+	QHash<QByteArray, PendingFile> pending_files_;          // path_id -> file
+	QHash<QByteArray, QSet<QByteArray>> chunk_waiters_;     // ct_hash -> path_ids
+
+	/* One worker per path at a time. A Meta, added while its path is assembled, waits for the worker to finish. */
+	QHash<QByteArray, QList<QByteArray>> assembling_;   // path_id -> ct_hashes of hot chunks, handed to the worker
+	QHash<QByteArray, SignedMeta> deferred_;            // path_id -> the latest Meta, added meanwhile
+
+	void track(SignedMeta smeta);
+	void untrack(const QByteArray& path_id);
+	void startAssemble(SignedMeta smeta, QHash<QByteArray, QByteArray> hot_chunks = QHash<QByteArray, QByteArray>());
 
 	void periodic_assemble_operation();
 	QTimer* assemble_timer_;
@@ -35,11 +35,17 @@
 #include "folder/chunk/archive/Archive.h"
 #include "folder/meta/MetaStorage.h"
 #include "util/conv_fspath.h"
+#include "util/PositionalFile.h"
 #include "util/readable.h"
+#include <librevault/crypto/HMAC-SHA3.h>
 #include <boost/filesystem.hpp>
 #include <QDir>
+#include <QFileInfo>
 #include <QLoggingCategory>
-#include <QSaveFile>
+#include <QSemaphore>
+#include <atomic>
+#include <functional>
+#include <tuple>
 #ifdef Q_OS_UNIX
 #   include <sys/stat.h>
 #endif
@@ -51,28 +57,44 @@ Q_LOGGING_CATEGORY(log_assembler, "folder.chunk.assembler")
 
 namespace librevault {
 
+namespace {
+
+class ChunkTask : public QRunnable {
+public:
+	explicit ChunkTask(std::function<void()> task) : task_(std::move(task)) {}
+	void run() override {task_();}
+
+private:
+	std::function<void()> task_;
+};
+
+} /* namespace */
+
 AssemblerWorker::AssemblerWorker(SignedMeta smeta, const FolderParams& params,
 	                             MetaStorage* meta_storage,
 	                             ChunkStorage* chunk_storage,
 	                             PathNormalizer* path_normalizer,
-	                             Archive* archive) :
+	                             Archive* archive,
+	                             QThreadPool* chunk_threadpool,
+	                             QHash<QByteArray, QByteArray> hot_chunks) :
 	params_(params),
 	meta_storage_(meta_storage),
 	chunk_storage_(chunk_storage),
 	path_normalizer_(path_normalizer),
 	archive_(archive),
+	chunk_threadpool_(chunk_threadpool),
+	hot_chunks_(hot_chunks),
 	smeta_(smeta),
 	meta_(smeta.meta()) {}
 
 AssemblerWorker::~AssemblerWorker() {}
 
-QByteArray AssemblerWorker::get_chunk_pt(const blob& ct_hash) const {
-	blob chunk = conv_bytearray(chunk_storage_->get_chunk(ct_hash));
+blob AssemblerWorker::get_chunk_pt(const Meta::Chunk& chunk) const {
+	auto hot_chunk_it = hot_chunks_.constFind(conv_bytearray(chunk.ct_hash));
+	blob chunk_ct = conv_bytearray(hot_chunk_it != hot_chunks_.constEnd() ? hot_chunk_it.value() : chunk_storage_->get_chunk(chunk.ct_hash));
 
 	try {
-		QPair<quint32, QByteArray> size_iv = meta_storage_->getChunkSizeIv(ct_hash);
-		blob chunk_pt_v = Meta::Chunk::decrypt(chunk, size_iv.first, params_.secret.get_Encryption_Key(), conv_bytearray(size_iv.second));
-		return conv_bytearray(chunk_pt_v);
+		return Meta::Chunk::decrypt(chunk_ct, chunk.size, params_.secret.get_Encryption_Key(), chunk.iv);
 	}catch(std::exception& e){
 		qCWarning(log_assembler) << "Could not get plaintext chunk (which is marked as existing in index), DB collision";
 		throw ChunkStorage::no_such_chunk();
@@ -85,8 +107,8 @@ void AssemblerWorker::run() noexcept {
 	normpath_ = QByteArray::fromStdString(meta_.path(params_.secret));
 	denormpath_ = path_normalizer_->denormalizePath(normpath_);
 
+	bool assembled = false;
 	try {
-		bool assembled = false;
 		switch(meta_.meta_type()) {
 			case Meta::FILE: assembled = assemble_file();
 				break;
@@ -104,13 +126,22 @@ void AssemblerWorker::run() noexcept {
 			if(meta_.meta_type() != Meta::DELETED)
 				apply_attrib();
 
-			meta_storage_->markAssembled(meta_.path_id());
+			meta_storage_->markAssembled(meta_);
 			chunk_storage_->cleanup(meta_);
+
+			emit metaAssembled(smeta_);
 		}
 	}catch(abort_assembly& e) {  // Already handled
 	}catch(std::exception& e) {
 		qCWarning(log_assembler) << "Unknown exception while assembling:" << meta_.path(params_.secret).c_str() << "E:" << e.what();    // FIXME: #83
 	}
+
+	// Hot chunks may be stored nowhere else. The file is retried, once they are.
+	if(! assembled) {
+		for(auto hot_chunk_it = hot_chunks_.constBegin(); hot_chunk_it != hot_chunks_.constEnd(); ++hot_chunk_it)
+			QMetaObject::invokeMethod(chunk_storage_, "keep_chunk", Qt::QueuedConnection, Q_ARG(QByteArray, hot_chunk_it.key()), Q_ARG(QByteArray, hot_chunk_it.value()));
+	}
+	emit finished(smeta_, assembled);
 }
 
 bool AssemblerWorker::assemble_deleted() {
@@ -149,27 +180,37 @@ bool AssemblerWorker::assemble_directory() {
 bool AssemblerWorker::assemble_file() {
 	LOGFUNC();
 
-	// Check if we have all needed chunks
-	for(auto b : chunk_storage_->make_bitfield(meta_))
-		if(!b) return false;    // retreat!
+	// Check if we have all needed chunks. Hot ones may be nowhere but in our hands.
+	bitfield_type bitfield = chunk_storage_->make_bitfield(meta_);
+	for(size_t chunk_idx = 0; chunk_idx < bitfield.size(); chunk_idx++)
+		if(!bitfield[chunk_idx] && !hot_chunks_.contains(conv_bytearray(meta_.chunks()[chunk_idx].ct_hash)))
+			return false;    // retreat!
 
 	//
 	QString assembly_path = params_.system_path + "/" + conv_fspath(boost::filesystem::unique_path("assemble-%%%%-%%%%-%%%%-%%%%"));
 
 	// TODO: Check for assembled chunk and try to extract them and push into encstorage.
-	QSaveFile assembly_f(assembly_path); // Opening file
+	PositionalFile assembly_f(assembly_path); // Opening file
 	if(! assembly_f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
 		qCWarning(log_assembler) << "File cannot be opened:" << assembly_path << "E:" << assembly_f.errorString();  // FIXME: #83
 		throw abort_assembly();
 	}
 
-	for(auto chunk : meta_.chunks()) {
-		assembly_f.write(get_chunk_pt(chunk.ct_hash)); // Writing to file
-	}
+	try {
+		if(! assembly_f.preallocate(meta_.size()))
+			qCWarning(log_assembler) << "File cannot be preallocated:" << assembly_path << "E:" << assembly_f.errorString();
 
-	if(!assembly_f.commit()) {
-		qCWarning(log_assembler) << "File cannot be written:" << assembly_path << "E:" << assembly_f.errorString(); // FIXME: #83
-		throw abort_assembly();
+		write_chunks(assembly_f);
+
+		if(! assembly_f.sync()) {
+			qCWarning(log_assembler) << "File cannot be written:" << assembly_path << "E:" << assembly_f.errorString(); // FIXME: #83
+			throw abort_assembly();
+		}
+		assembly_f.close();
+	}catch(std::exception& e) {
+		assembly_f.close();
+		QFile::remove(assembly_path);
+		throw;
 	}
 
 	{
@@ -194,6 +235,128 @@ bool AssemblerWorker::assemble_file() {
 	return true;
 }
 
+void AssemblerWorker::write_chunks(PositionalFile& assembly_f) {
+	// Local plaintext sources. Chunks from them are copied as is, without a round trip through encryption.
+	SourceFiles source_files;
+
+	// Delta assembly: chunks, that are already in place in the previous revision of this file, are copied from it
+	QHash<QByteArray, quint64> delta_base;
+	if(params_.delta_assembly) {
+		std::unique_ptr<PositionalFile> previous_f(new PositionalFile(denormpath_));
+		delta_base = load_delta_base(*previous_f);
+		if(! delta_base.isEmpty())
+			source_files[denormpath_] = std::move(previous_f);
+	}
+
+	// Chunks are fetched and decrypted in parallel, each one is written at its own offset (the same, as stored in "openfs" table)
+	QSemaphore chunks_done;
+	std::atomic<bool> failed(false);
+	std::atomic<quint64> copied_bytes(0);
+
+	uint64_t offset = 0;
+	for(const Meta::Chunk& chunk : meta_.chunks()) {
+		PositionalFile* source_f = nullptr;
+		quint64 source_offset = 0;
+
+		auto delta_it = delta_base.constFind(conv_bytearray(chunk.ct_hash));
+		if(delta_it != delta_base.constEnd()) {
+			source_f = source_files[denormpath_].get();
+			source_offset = delta_it.value();
+		}else
+			std::tie(source_f, source_offset) = find_plaintext(chunk, source_files);
+
+		auto task = new ChunkTask([&, chunk, offset, source_f, source_offset]{
+			try {
+				if(! failed) {
+					bool written = false;
+					if(source_f && verify_plaintext(*source_f, source_offset, chunk)) {
+						written = assembly_f.copy_range(*source_f, source_offset, offset, chunk.size);
+						if(written)
+							copied_bytes += chunk.size;
+					}
+					if(! written) {
+						blob chunk_pt = get_chunk_pt(chunk);
+						written = assembly_f.write(offset, reinterpret_cast<const char*>(chunk_pt.data()), chunk_pt.size());
+					}
+					if(! written) {
+						qCWarning(log_assembler) << "Chunk cannot be written:" << assembly_f.fileName() << "E:" << assembly_f.errorString(); // FIXME: #83
+						failed = true;
+					}
+				}
+			}catch(std::exception& e) {
+				failed = true;
+			}
+			chunks_done.release();
+		});
+		task->setAutoDelete(true);
+		chunk_threadpool_->start(task);
+
+		offset += chunk.size;
+	}
+	chunks_done.acquire(meta_.chunks().size());
+
+	if(failed)
+		throw abort_assembly();
+
+	if(copied_bytes > 0)
+		qCDebug(log_assembler) << "Assembly of" << denormpath_ << "copied" << copied_bytes << "of" << offset << "bytes from local files";
+}
+
+bool AssemblerWorker::verify_plaintext(PositionalFile& source_f, quint64 source_offset, const Meta::Chunk& chunk) const {
+	// Size and mtime of the source don't prove, that the range is the same. Its HMAC does, and it takes no decryption.
+	blob chunk_pt(chunk.size);
+	if(source_f.read(source_offset, reinterpret_cast<char*>(chunk_pt.data()), chunk.size) != chunk.size)
+		return false;
+	if((chunk_pt | crypto::HMAC_SHA3_224(params_.secret.get_Encryption_Key())) != chunk.pt_hmac) {
+		qCDebug(log_assembler) << "Local plaintext of" << ct_hash_readable(chunk.ct_hash) << "in" << source_f.fileName() << "has changed, decrypting it instead";
+		return false;
+	}
+	return true;
+}
+
+std::pair<PositionalFile*, quint64> AssemblerWorker::find_plaintext(const Meta::Chunk& chunk, SourceFiles& source_files) {
+	for(const OpenStorage::PlaintextLocation& location : chunk_storage_->locate_plaintext(chunk.ct_hash)) {
+		if(location.size != chunk.size) continue;
+
+		std::unique_ptr<PositionalFile>& source_f = source_files[location.path];
+		if(! source_f) {
+			source_f.reset(new PositionalFile(location.path));
+			source_f->open(QIODevice::ReadOnly);
+		}
+		if(source_f->isOpen())
+			return {source_f.get(), location.offset};
+	}
+	return {nullptr, 0};
+}
+
+QHash<QByteArray, quint64> AssemblerWorker::load_delta_base(PositionalFile& previous_f) {
+	QHash<QByteArray, quint64> delta_base;
+
+	// Layout of the previously assembled revision. It is used only if the file is as it was assembled, each range is still checked by verify_plaintext().
+	QPair<quint64, qint64> assembled_stat = meta_storage_->getAssembledStat(meta_.path_id());
+	if(! OpenStorage::is_unmodified(denormpath_, assembled_stat.first, assembled_stat.second))
+		return delta_base;
+
+	QList<Index::ChunkLocation> layout = meta_storage_->getAssembledLayout(meta_.path_id());
+	quint64 layout_size = 0;
+	for(const Index::ChunkLocation& location : layout) {
+		if(location.offset != layout_size)
+			return delta_base;
+		layout_size += location.size;
+	}
+
+	QFileInfo previous_info(denormpath_);
+	if(layout.isEmpty() || !previous_info.isFile() || quint64(previous_info.size()) != layout_size)
+		return delta_base;
+
+	if(! previous_f.open(QIODevice::ReadOnly))
+		return delta_base;
+
+	for(const Index::ChunkLocation& location : layout)
+		delta_base.insert(conv_bytearray(location.ct_hash), location.offset);
+	return delta_base;
+}
+
 void AssemblerWorker::apply_attrib() {
 #if defined(Q_OS_UNIX)
 	if(params_.preserve_unix_attrib) {
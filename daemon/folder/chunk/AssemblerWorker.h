@@ -29,8 +29,12 @@
 #pragma once
 #include "blob.h"
 #include <librevault/SignedMeta.h>
+#include <QHash>
 #include <QObject>
 #include <QRunnable>
+#include <QThreadPool>
+#include <map>
+#include <memory>
 
 namespace librevault {
 
@@ -40,9 +44,15 @@ class Archive;
 class MetaStorage;
 class FolderParams;
 class ChunkStorage;
+class PositionalFile;
 class Secret;
 
 class AssemblerWorker : public QObject, public QRunnable {
+	Q_OBJECT
+signals:
+	void metaAssembled(SignedMeta smeta);
+	void finished(SignedMeta smeta, bool assembled);
+
 public:
 	struct abort_assembly : std::runtime_error {
 		explicit abort_assembly() : std::runtime_error("Assembly aborted") {}
@@ -53,7 +63,9 @@ public:
 					MetaStorage* meta_storage,
 					ChunkStorage* chunk_storage,
 					PathNormalizer* path_normalizer,
-					Archive* archive);
+					Archive* archive,
+					QThreadPool* chunk_threadpool,
+					QHash<QByteArray, QByteArray> hot_chunks = QHash<QByteArray, QByteArray>());
 	virtual ~AssemblerWorker();
 
 	void run() noexcept override;
@@ -64,6 +76,8 @@ private:
 	ChunkStorage* chunk_storage_;
 	PathNormalizer* path_normalizer_;
 	Archive* archive_;
+	QThreadPool* chunk_threadpool_;
+	const QHash<QByteArray, QByteArray> hot_chunks_;  // Encrypted chunks, that have just been downloaded. Used instead of reading them back from storage.
 
 	SignedMeta smeta_;
 	const Meta& meta_;
@@ -78,7 +92,13 @@ private:
 
 	void apply_attrib();
 
-	QByteArray get_chunk_pt(const blob& ct_hash) const;
+	using SourceFiles = std::map<QString, std::unique_ptr<PositionalFile>>;
+
+	void write_chunks(PositionalFile& assembly_f);
+	std::pair<PositionalFile*, quint64> find_plaintext(const Meta::Chunk& chunk, SourceFiles& source_files);
+	QHash<QByteArray, quint64> load_delta_base(PositionalFile& previous_f);
+	blob get_chunk_pt(const Meta::Chunk& chunk) const;
+	bool verify_plaintext(PositionalFile& source_f, quint64 source_offset, const Meta::Chunk& chunk) const;
 };
 
 } /* namespace librevault */
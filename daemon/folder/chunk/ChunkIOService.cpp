@@ -0,0 +1,133 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "ChunkIOService.h"
+#include "control/Config.h"
+#include <QRunnable>
+
+namespace librevault {
+
+class ChunkIOTask : public QRunnable {
+public:
+	ChunkIOTask(ChunkIOService* service, QByteArray key, ChunkIOService::Job job) :
+		service_(service), key_(key), job_(std::move(job)) {}
+
+	void run() override {
+		job_.work();
+		service_->finished(key_, std::move(job_));
+	}
+
+private:
+	ChunkIOService* service_;
+	QByteArray key_;
+	ChunkIOService::Job job_;
+};
+
+ChunkIOService::ChunkIOService(QObject* parent) : QObject(parent) {
+	threadpool_ = new QThreadPool(this);
+	threadpool_->setMaxThreadCount(Config::get()->getGlobal("chunk_io_threads").toInt());
+}
+
+ChunkIOService::~ChunkIOService() {
+	{
+		QMutexLocker lk(&mtx_);
+		strands_.clear();
+	}
+	threadpool_->clear();
+	threadpool_->waitForDone();
+}
+
+void ChunkIOService::post(const QByteArray& key, std::function<void()> work, QObject* context, std::function<void()> done, Priority priority) {
+	QMutexLocker lk(&mtx_);
+
+	Job job{std::move(work), context, std::move(done), priority};
+	auto strand_it = strands_.find(key);
+	if(strand_it != strands_.end())
+		strand_it->enqueue(std::move(job));   // Started, when the running one finishes
+	else {
+		strands_.insert(key, QQueue<Job>());
+		start(key, std::move(job));
+	}
+}
+
+QJsonObject ChunkIOService::collect_state() const {
+	QMutexLocker lk(&mtx_);
+
+	int waiting = 0;
+	for(auto& strand : strands_)
+		waiting += strand.size();
+
+	QJsonObject state;
+	state["running"] = strands_.size();
+	state["waiting"] = waiting;
+	state["completions"] = completions_.size();
+	state["done"] = double(jobs_done_);
+	return state;
+}
+
+void ChunkIOService::start(const QByteArray& key, Job job) {
+	Priority priority = job.priority;
+	threadpool_->start(new ChunkIOTask(this, key, std::move(job)), priority);
+}
+
+void ChunkIOService::finished(const QByteArray& key, Job job) {
+	QMutexLocker lk(&mtx_);
+	jobs_done_++;
+
+	auto strand_it = strands_.find(key);
+	if(strand_it != strands_.end()) {
+		if(strand_it->isEmpty())
+			strands_.erase(strand_it);
+		else
+			start(key, strand_it->dequeue());
+	}
+
+	if(job.done) {
+		completions_.enqueue(std::move(job));
+		if(! drain_scheduled_) {
+			drain_scheduled_ = true;
+			QMetaObject::invokeMethod(this, "drainCompletions", Qt::QueuedConnection);
+		}
+	}
+}
+
+void ChunkIOService::drainCompletions() {
+	QQueue<Job> completions;
+	{
+		QMutexLocker lk(&mtx_);
+		completions.swap(completions_);
+		drain_scheduled_ = false;
+	}
+
+	for(Job& job : completions) {
+		if(job.context)
+			job.done();
+	}
+}
+
+} /* namespace librevault */
@@ -0,0 +1,81 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QThreadPool>
+#include <functional>
+
+namespace librevault {
+
+/* ChunkIOService runs disk reads, writes and hashing of chunks on a dedicated thread pool, so that the event loop never waits for the disk.
+ * Completions are queued and run on the event loop in one batch. Jobs with the same key (usually, ct_hash) run in order of submission. */
+class ChunkIOService : public QObject {
+	Q_OBJECT
+public:
+	enum Priority {BACKGROUND = 0, URGENT = 1};
+
+	ChunkIOService(QObject* parent);
+	~ChunkIOService();  // Waits for running jobs. Queued jobs and completions are dropped
+
+	/* work() runs on the pool, then done() runs on the event loop, if context is still alive */
+	void post(const QByteArray& key, std::function<void()> work, QObject* context, std::function<void()> done, Priority priority = BACKGROUND);
+
+	QJsonObject collect_state() const;
+
+private:
+	struct Job {
+		std::function<void()> work;
+		QPointer<QObject> context;
+		std::function<void()> done;
+		Priority priority;
+	};
+
+	QThreadPool* threadpool_;
+
+	mutable QMutex mtx_;
+	QHash<QByteArray, QQueue<Job>> strands_;    // Keys with a running job -> jobs waiting for it
+	QQueue<Job> completions_;
+	bool drain_scheduled_ = false;
+	quint64 jobs_done_ = 0;
+
+	void start(const QByteArray& key, Job job);
+	void finished(const QByteArray& key, Job job);
+
+	friend class ChunkIOTask;
+
+private slots:
+	void drainCompletions();
+};
+
+} /* namespace librevault */
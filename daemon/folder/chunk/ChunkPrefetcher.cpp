@@ -0,0 +1,109 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "ChunkPrefetcher.h"
+#include "ChunkIOService.h"
+#include "ChunkStorage.h"
+#include "control/Config.h"
+#include "folder/meta/MetaStorage.h"
+#include "util/readable.h"
+#include <QLoggingCategory>
+
+namespace librevault {
+
+Q_LOGGING_CATEGORY(log_prefetcher, "folder.chunk.prefetcher")
+
+ChunkPrefetcher::ChunkPrefetcher(ChunkStorage* chunk_storage, MetaStorage* meta_storage, ChunkIOService* io, QObject* parent) :
+	QObject(parent),
+	chunk_storage_(chunk_storage),
+	meta_storage_(meta_storage),
+	io_(io) {}
+
+void ChunkPrefetcher::load(const QByteArray& ct_hash, bool urgent) {
+	if(loading_.contains(ct_hash)) return;
+	if(!urgent && loading_.size() >= Config::get()->getGlobal("prefetch_queue_max").toInt()) return;   // Speculative loads must not hold up the urgent ones
+
+	loading_.insert(ct_hash);
+
+	auto success = std::make_shared<bool>(true);
+	io_->post(ct_hash, [=]{
+		try {
+			chunk_storage_->get_chunk(conv_bytearray(ct_hash));     // Puts it into the memory cache
+		}catch(std::exception& e){
+			*success = false;
+		}
+	}, this, [=]{handleLoaded(ct_hash, *success);}, urgent ? ChunkIOService::URGENT : ChunkIOService::BACKGROUND);
+}
+
+void ChunkPrefetcher::hintRemoteMeta(const Meta::PathRevision& revision, bitfield_type bitfield) {
+	// The Meta is read from the index and every chunk is looked up, so the bitfield is scanned on ChunkIOService, not on every HAVE_META here.
+	// Only the first prefetch_hint_max missing chunks are linked, so a huge file costs no more than a small one.
+	int hint_max = Config::get()->getGlobal("prefetch_hint_max").toInt();
+	auto missing = std::make_shared<QList<QByteArray>>();
+	io_->post(conv_bytearray(revision.path_id_), [=]() mutable {
+		try {
+			auto chunks = meta_storage_->getMeta(revision).meta().chunks();
+			bitfield.resize(chunks.size(), 0);
+			for(size_t chunk_idx = 0; chunk_idx < chunks.size() && missing->size() < hint_max; chunk_idx++) {
+				if(!bitfield[chunk_idx] && chunk_storage_->have_chunk(chunks[chunk_idx].ct_hash))
+					*missing << conv_bytearray(chunks[chunk_idx].ct_hash);
+			}
+		}catch(MetaStorage::no_such_meta){}
+	}, this, [=]{addMissing(*missing);});
+}
+
+void ChunkPrefetcher::addMissing(const QList<QByteArray>& missing) {
+	if(missing.isEmpty()) return;
+
+	if(next_chunk_.size() > Config::get()->getGlobal("prefetch_index_max").toInt())
+		next_chunk_.clear();    // Only a hint, rebuilt from the next bitfields
+	for(int i = 0; i+1 < missing.size(); i++)
+		next_chunk_.insert(missing[i], missing[i+1]);
+
+	readAhead(missing.first(), Config::get()->getGlobal("prefetch_depth").toInt());
+}
+
+void ChunkPrefetcher::hintRequested(const QByteArray& ct_hash) {
+	readAhead(next_chunk_.value(ct_hash), Config::get()->getGlobal("prefetch_depth").toInt());
+}
+
+void ChunkPrefetcher::readAhead(QByteArray ct_hash, int depth) {
+	for(; depth > 0 && !ct_hash.isEmpty(); depth--, ct_hash = next_chunk_.value(ct_hash)) {
+		if(! chunk_storage_->have_cached_chunk(conv_bytearray(ct_hash)))
+			load(ct_hash, false);
+	}
+}
+
+void ChunkPrefetcher::handleLoaded(QByteArray ct_hash, bool success) {
+	loading_.remove(ct_hash);
+	if(! success)
+		qCDebug(log_prefetcher) << "Could not load chunk" << ct_hash_readable(ct_hash);
+	emit loaded(ct_hash, success);
+}
+
+} /* namespace librevault */
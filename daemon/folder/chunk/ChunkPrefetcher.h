@@ -0,0 +1,73 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <librevault/Meta.h>
+#include <librevault/util/conv_bitfield.h>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+
+namespace librevault {
+
+class ChunkIOService;
+class ChunkStorage;
+class MetaStorage;
+
+/* ChunkPrefetcher loads chunks into the memory cache of ChunkStorage on ChunkIOService, so that block replies are served from memory.
+ * Chunks are predicted in file order: from the bitfields, that remotes advertise, and from the chunks, they request. */
+class ChunkPrefetcher : public QObject {
+	Q_OBJECT
+signals:
+	void loaded(QByteArray ct_hash, bool success);
+
+public:
+	ChunkPrefetcher(ChunkStorage* chunk_storage, MetaStorage* meta_storage, ChunkIOService* io, QObject* parent);
+
+	void load(const QByteArray& ct_hash, bool urgent);
+	bool loading(const QByteArray& ct_hash) const {return loading_.contains(ct_hash);}
+
+	/* Hints */
+	void hintRemoteMeta(const Meta::PathRevision& revision, bitfield_type bitfield);    // Remote misses chunks, we have
+	void hintRequested(const QByteArray& ct_hash);                                      // Remote started downloading this chunk
+
+private:
+	ChunkStorage* chunk_storage_;
+	MetaStorage* meta_storage_;
+	ChunkIOService* io_;
+
+	QSet<QByteArray> loading_;
+	QHash<QByteArray, QByteArray> next_chunk_;  // Next chunk in file order, that some remote misses
+
+	void addMissing(const QList<QByteArray>& missing);
+	void readAhead(QByteArray ct_hash, int depth);
+	void handleLoaded(QByteArray ct_hash, bool success);
+};
+
+} /* namespace librevault */
@@ -27,6 +27,8 @@
  * files in the program, then also delete it here.
  */
 #include "ChunkStorage.h"
+#include "ChunkIOService.h"
+#include "ChunkPrefetcher.h"
 #include "MemoryCachedStorage.h"
 #include "EncStorage.h"
 #include "OpenStorage.h"
@@ -43,21 +45,29 @@ ChunkStorage::ChunkStorage(const FolderParams& params, MetaStorage* meta_storage
 	meta_storage_(meta_storage) {
 	mem_storage = new MemoryCachedStorage(this);
 	enc_storage = new EncStorage(params, this);
+	io_ = new ChunkIOService(this);
+	prefetcher_ = new ChunkPrefetcher(this, meta_storage_, io_, this);
 	if(params.secret.get_type() <= Secret::Type::ReadOnly) {
 		open_storage = new OpenStorage(params, meta_storage_, path_normalizer, this);
 		archive = new Archive(params, meta_storage_, path_normalizer, this);
 		file_assembler = new AssemblerQueue(params, meta_storage_,  this, path_normalizer, archive, this);
-	}
 
-	connect(meta_storage_, &MetaStorage::metaAddedExternal, file_assembler, &AssemblerQueue::addAssemble);
+		connect(meta_storage_, &MetaStorage::metaAddedExternal, file_assembler, &AssemblerQueue::addAssemble);
+	}
 };
 
-ChunkStorage::~ChunkStorage() {}
+ChunkStorage::~ChunkStorage() {
+	delete io_;     // Waits for background jobs, before the storages are gone
+}
 
 bool ChunkStorage::have_chunk(const blob& ct_hash) const noexcept {
 	return mem_storage->have_chunk(ct_hash) || enc_storage->have_chunk(ct_hash) || (open_storage && open_storage->have_chunk(ct_hash));
 }
 
+bool ChunkStorage::have_cached_chunk(const blob& ct_hash) const noexcept {
+	return mem_storage->have_chunk(ct_hash);
+}
+
 QByteArray ChunkStorage::get_chunk(const blob& ct_hash) {
 	try {
 		// Cache hit
@@ -78,12 +88,53 @@ QByteArray ChunkStorage::get_chunk(const blob& ct_hash) {
 	}
 }
 
-void ChunkStorage::put_chunk(QByteArray ct_hash, QFile* chunk_f) {
-	enc_storage->put_chunk(ct_hash, chunk_f);
-	for(auto& smeta : meta_storage_->containingChunk(conv_bytearray(ct_hash)))
-		file_assembler->addAssemble(smeta);
+QList<OpenStorage::PlaintextLocation> ChunkStorage::locate_plaintext(const blob& ct_hash) const {
+	if(open_storage)
+		return open_storage->locate_chunk(ct_hash);
+	return {};
+}
+
+void ChunkStorage::put_chunk(QByteArray ct_hash, QFile* chunk_f, QByteArray chunk) {
+	if(chunk_f)
+		chunk_f->setParent(this);
+
+	// If this chunk completes every file, that waits for it, they are assembled straight from the verified bytes, without reading them back.
+	bool completes_all = file_assembler && file_assembler->completesAllWaiting(conv_bytearray(ct_hash));
+
+	// A chunk, built in memory, is not written at all then: the encrypted copy would be removed by cleanup() after assembly anyway.
+	// Meanwhile, it is served from the memory cache. If assembly fails, the assembler hands it back to keep_chunk().
+	if(completes_all && !chunk_f) {
+		mem_storage->put_chunk(conv_bytearray(ct_hash), chunk);
+		file_assembler->notifyChunk(conv_bytearray(ct_hash), chunk);
+		emit chunkAdded(conv_bytearray(ct_hash));
+		return;
+	}
+
+	// A verified file is only renamed into EncStorage, so that it survives a crash before assembly
+	io_->post(ct_hash, [=]{
+		if(chunk_f)
+			enc_storage->put_chunk(ct_hash, chunk_f);
+		else
+			enc_storage->put_chunk(ct_hash, chunk);
+	}, this, [=]{
+		if(chunk_f)
+			chunk_f->deleteLater();
+		if(file_assembler)
+			file_assembler->notifyChunk(conv_bytearray(ct_hash), completes_all ? chunk : QByteArray());
+
+		emit chunkAdded(conv_bytearray(ct_hash));
+	}, ChunkIOService::URGENT);
+}
 
-	emit chunkAdded(conv_bytearray(ct_hash));
+void ChunkStorage::keep_chunk(QByteArray ct_hash, QByteArray chunk) {
+	bool stored = enc_storage->have_chunk(conv_bytearray(ct_hash)) || (open_storage && open_storage->have_chunk(conv_bytearray(ct_hash)));
+	io_->post(ct_hash, [=]{
+		if(! stored)
+			enc_storage->put_chunk(ct_hash, chunk);
+	}, this, [=]{
+		if(file_assembler)
+			file_assembler->notifyChunk(conv_bytearray(ct_hash));   // The file is retried, now that the chunk is on disk
+	});
 }
 
 bitfield_type ChunkStorage::make_bitfield(const Meta& meta) const noexcept {
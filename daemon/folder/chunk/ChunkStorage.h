@@ -28,6 +28,7 @@
  */
 #pragma once
 #include "blob.h"
+#include "OpenStorage.h"
 #include <librevault/Meta.h>
 #include <librevault/util/conv_bitfield.h>
 #include <QFile>
@@ -40,9 +41,10 @@ class PathNormalizer;
 
 class MemoryCachedStorage;
 class EncStorage;
-class OpenStorage;
 class Archive;
 class AssemblerQueue;
+class ChunkIOService;
+class ChunkPrefetcher;
 
 class ChunkStorage : public QObject {
 	Q_OBJECT
@@ -55,13 +57,21 @@ public:
 	virtual ~ChunkStorage();
 
 	bool have_chunk(const blob& ct_hash) const noexcept ;
+	bool have_cached_chunk(const blob& ct_hash) const noexcept;    // In memory, get_chunk() won't touch the disk
 	QByteArray get_chunk(const blob& ct_hash);  // Throws AbstractFolder::no_such_chunk
-	void put_chunk(QByteArray ct_hash, QFile* chunk_f);
+	QList<OpenStorage::PlaintextLocation> locate_plaintext(const blob& ct_hash) const;
+	void put_chunk(QByteArray ct_hash, QFile* chunk_f, QByteArray chunk);    // Asynchronous, emits chunkAdded() when done. chunk_f may be null
 
 	bitfield_type make_bitfield(const Meta& meta) const noexcept;   // Bulk version of "have_chunk"
 
 	void cleanup(const Meta& meta);
 
+	ChunkIOService* io() {return io_;}
+	ChunkPrefetcher* prefetcher() {return prefetcher_;}
+
+public slots:
+	void keep_chunk(QByteArray ct_hash, QByteArray chunk);  // Stores a hot chunk after a failed assembly, if it was not stored, and retries the file
+
 signals:
 	void chunkAdded(blob ct_hash);
 
@@ -70,9 +80,11 @@ protected:
 
 	MemoryCachedStorage* mem_storage;
 	EncStorage* enc_storage;
-	OpenStorage* open_storage;
-	Archive* archive;
-	AssemblerQueue* file_assembler;
+	OpenStorage* open_storage = nullptr;
+	Archive* archive = nullptr;
+	AssemblerQueue* file_assembler = nullptr;
+	ChunkIOService* io_;
+	ChunkPrefetcher* prefetcher_;
 };
 
 } /* namespace librevault */
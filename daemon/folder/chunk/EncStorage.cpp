@@ -31,6 +31,7 @@
 #include "control/FolderParams.h"
 #include "util/readable.h"
 #include <librevault/crypto/Base32.h>
+#include <QSaveFile>
 
 namespace librevault {
 
@@ -66,13 +67,21 @@ QByteArray EncStorage::get_chunk(const blob& ct_hash) const {
 void EncStorage::put_chunk(const QByteArray& ct_hash, QFile* chunk_f) {
 	QWriteLocker lk(&storage_mtx_);
 
-	chunk_f->setParent(this);
 	chunk_f->rename(make_chunk_ct_path(ct_hash));
-	chunk_f->deleteLater();
 
 	LOGD("Encrypted block" << ct_hash_readable(ct_hash) << "pushed into EncStorage");
 }
 
+void EncStorage::put_chunk(const QByteArray& ct_hash, const QByteArray& chunk) {
+	QWriteLocker lk(&storage_mtx_);
+
+	QSaveFile chunk_f(make_chunk_ct_path(ct_hash));
+	if(chunk_f.open(QIODevice::WriteOnly) && chunk_f.write(chunk) == chunk.size() && chunk_f.commit())
+		LOGD("Encrypted block" << ct_hash_readable(ct_hash) << "pushed into EncStorage");
+	else
+		LOGW("Encrypted block" << ct_hash_readable(ct_hash) << "could not be written:" << chunk_f.errorString());
+}
+
 void EncStorage::remove_chunk(const blob& ct_hash) {
 	QWriteLocker lk(&storage_mtx_);
 	QFile::remove(make_chunk_ct_path(ct_hash));
@@ -44,7 +44,8 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	QByteArray get_chunk(const blob& ct_hash) const;
-	void put_chunk(const QByteArray& ct_hash, QFile* chunk_f);
+	void put_chunk(const QByteArray& ct_hash, QFile* chunk_f);  // Moves the file into storage. chunk_f is still owned by the caller
+	void put_chunk(const QByteArray& ct_hash, const QByteArray& chunk);
 	void remove_chunk(const blob& ct_hash);
 
 private:
@@ -34,6 +34,7 @@ namespace librevault {
 MemoryCachedStorage::MemoryCachedStorage(QObject* parent) : QObject(parent), cache_(50*1024*1024) {}    // 50 MB cache is enough for most purposes
 
 bool MemoryCachedStorage::have_chunk(const blob& ct_hash) const noexcept {
+	QMutexLocker lk(&cache_lock_);
 	return cache_.contains(conv_bytearray(ct_hash));
 }
 
@@ -32,6 +32,9 @@
 #include "folder/meta/MetaStorage.h"
 #include "folder/PathNormalizer.h"
 #include "util/readable.h"
+#include <boost/filesystem.hpp>
+#include <QFile>
+#include <algorithm>
 
 namespace librevault {
 
@@ -48,32 +51,59 @@ bool OpenStorage::have_chunk(const blob& ct_hash) const noexcept {
 QByteArray OpenStorage::get_chunk(const blob& ct_hash) const {
 	LOGD("get_chunk(" << ct_hash_readable(ct_hash) << ")");
 
-	foreach(auto& smeta, meta_storage_->containingChunk(ct_hash)) {
-		// Search for chunk offset and index
-		uint64_t offset = 0;
-		unsigned chunk_idx = 0;
-		for(auto& chunk : smeta.meta().chunks()) {
-			if(chunk.ct_hash == ct_hash) break;
-			offset += chunk.size;
-			chunk_idx++;
-		}
-		if(chunk_idx > smeta.meta().chunks().size()) continue;
+	foreach(auto& assembled_chunk, meta_storage_->getAssembledChunk(ct_hash)) {
+		const Meta& meta = assembled_chunk.smeta.meta();
+
+		auto chunk_it = std::find_if(meta.chunks().begin(), meta.chunks().end(), [&](const Meta::Chunk& chunk){return chunk.ct_hash == ct_hash;});
+		if(chunk_it == meta.chunks().end()) continue;
 
 		// Found chunk & offset
-		auto chunk = smeta.meta().chunks().at(chunk_idx);
+		const Meta::Chunk& chunk = *chunk_it;
 		blob chunk_pt = blob(chunk.size);
 
-		QFile f(path_normalizer_->denormalizePath(QByteArray::fromStdString(smeta.meta().path(params_.secret))));
+		QFile f(path_normalizer_->denormalizePath(QByteArray::fromStdString(meta.path(params_.secret))));
 		if(! f.open(QIODevice::ReadOnly)) continue;
-		if(! f.seek(offset)) continue;
+		if(! f.seek(assembled_chunk.offset)) continue;
 		if(f.read(reinterpret_cast<char*>(chunk_pt.data()), chunk.size) != chunk.size) continue;
 
 		blob chunk_ct = Meta::Chunk::encrypt(chunk_pt, params_.secret.get_Encryption_Key(), chunk.iv);
 
 		// Check
-		if(verify_chunk(ct_hash, chunk_ct, smeta.meta().strong_hash_type())) return conv_bytearray(chunk_ct);
+		if(verify_chunk(ct_hash, chunk_ct, meta.strong_hash_type())) return conv_bytearray(chunk_ct);
 	}
 	throw ChunkStorage::no_such_chunk();
 }
 
+QList<OpenStorage::PlaintextLocation> OpenStorage::locate_chunk(const blob& ct_hash) const {
+	QList<PlaintextLocation> locations;
+
+	foreach(auto& assembled_chunk, meta_storage_->getAssembledChunk(ct_hash)) {
+		const Meta& meta = assembled_chunk.smeta.meta();
+
+		auto chunk_it = std::find_if(meta.chunks().begin(), meta.chunks().end(), [&](const Meta::Chunk& chunk){return chunk.ct_hash == ct_hash;});
+		if(chunk_it == meta.chunks().end()) continue;
+
+		// A cheap filter. The plaintext itself is checked against pt_hmac by the reader, before it is used.
+		QString path = path_normalizer_->denormalizePath(QByteArray::fromStdString(meta.path(params_.secret)));
+		if(! is_unmodified(path, meta)) continue;
+
+		locations << PlaintextLocation{path, assembled_chunk.offset, chunk_it->size};
+	}
+	return locations;
+}
+
+bool OpenStorage::is_unmodified(const QString& path, const Meta& meta) const noexcept {
+	return is_unmodified(path, meta.size(), meta.mtime());
+}
+
+bool OpenStorage::is_unmodified(const QString& path, uint64_t size, int64_t mtime) noexcept {
+	boost::system::error_code ec;
+	boost::filesystem::path path_fs(path.toStdWString());
+
+	if(boost::filesystem::status(path_fs, ec).type() != boost::filesystem::regular_file) return false;
+	if(boost::filesystem::file_size(path_fs, ec) != size || ec) return false;
+	if(boost::filesystem::last_write_time(path_fs, ec) != mtime || ec) return false;
+	return true;
+}
+
 } /* namespace librevault */
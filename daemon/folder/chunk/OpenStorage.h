@@ -46,14 +46,25 @@ class OpenStorage : public QObject {
 public:
 	OpenStorage(const FolderParams& params, MetaStorage* meta_storage, PathNormalizer* path_normalizer, QObject* parent);
 
+	struct PlaintextLocation {
+		QString path;
+		quint64 offset;
+		quint32 size;
+	};
+
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	QByteArray get_chunk(const blob& ct_hash) const;
+	QList<PlaintextLocation> locate_chunk(const blob& ct_hash) const;   // Plaintext locations in assembled files, not modified since indexing. Unverified, check pt_hmac.
+
+	static bool is_unmodified(const QString& path, uint64_t size, int64_t mtime) noexcept;
 
 private:
 	const FolderParams& params_;
 	MetaStorage* meta_storage_;
 	PathNormalizer* path_normalizer_;
 
+	bool is_unmodified(const QString& path, const Meta& meta) const noexcept;
+
 	inline bool verify_chunk(const blob& ct_hash, const blob& chunk_pt, Meta::StrongHashType strong_hash_type) const {
 		return ct_hash == Meta::Chunk::compute_strong_hash(chunk_pt, strong_hash_type);
 	}
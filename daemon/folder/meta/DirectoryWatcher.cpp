@@ -31,6 +31,7 @@
 #include "folder/IgnoreList.h"
 #include "folder/PathNormalizer.h"
 #include "util/conv_fspath.h"
+#include "util/FdBudget.h"
 #include <QTimer>
 
 namespace librevault {
@@ -70,9 +71,12 @@ DirectoryWatcher::DirectoryWatcher(const FolderParams& params, IgnoreList* ignor
 
 	watcher_thread_ = new DirectoryWatcherThread(params_.path, this);
 	connect(watcher_thread_, &DirectoryWatcherThread::dirEvent, this, &DirectoryWatcher::handleDirEvent, Qt::QueuedConnection);
+	FdBudget::get_instance()->reserve();    // Kernel notification handle
 }
 
-DirectoryWatcher::~DirectoryWatcher() {}
+DirectoryWatcher::~DirectoryWatcher() {
+	FdBudget::get_instance()->release();
+}
 
 void DirectoryWatcher::prepareAssemble(QByteArray normpath, Meta::Type type, bool with_removal) {
 	unsigned skip_events = 0;
@@ -30,11 +30,19 @@
 #include "control/FolderParams.h"
 #include "control/StateCollector.h"
 #include "folder/meta/MetaStorage.h"
+#include "util/FdBudget.h"
 #include "util/readable.h"
 #include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QUuid>
 
 namespace librevault {
 
+namespace {
+constexpr int SQLITE_FDS = 2;   // Database and its rollback journal
+} /* namespace */
+
 Index::Index(const FolderParams& params, StateCollector* state_collector, QObject* parent) : QObject(parent), params_(params), state_collector_(state_collector) {
 	auto db_filepath = params_.system_path + "/librevault.db";
 
@@ -43,6 +51,7 @@ Index::Index(const FolderParams& params, StateCollector* state_collector, QObjec
 	else
 		LOGD("Creating new SQLite3 DB:" << db_filepath);
 	db_ = std::make_unique<SQLiteDB>(db_filepath.toStdString());
+	FdBudget::get_instance()->reserve(SQLITE_FDS);
 	db_->exec("PRAGMA foreign_keys = ON;");
 
 	/* TABLE meta */
@@ -50,6 +59,32 @@ Index::Index(const FolderParams& params, StateCollector* state_collector, QObjec
 	db_->exec("CREATE INDEX IF NOT EXISTS meta_type_idx ON meta (type);");   // For making "COUNT(*) ... WHERE type=x" way faster
 	db_->exec("CREATE INDEX IF NOT EXISTS meta_not_deleted_idx ON meta(type<>255);");   // For faster Index::getExistingMeta
 
+	/* Change log: every change of a meta row, or of its chunk availability, gets the next sequence number. It is allocated inside the writing
+	 * statement, so that sequence numbers are committed in order, even with writers on other threads. */
+	QSet<QString> meta_columns;
+	for(auto row : db_->exec("PRAGMA table_info(meta);"))
+		meta_columns << QString::fromStdString(row[1].as_text());
+	if(! meta_columns.contains("seq"))
+		db_->exec("ALTER TABLE meta ADD COLUMN seq INTEGER DEFAULT (0) NOT NULL;");    // Rows from older versions are "before any watermark"
+	db_->exec("CREATE INDEX IF NOT EXISTS meta_seq_idx ON meta (seq);");   // For faster Index::getMetaSince
+	db_->exec("CREATE TABLE IF NOT EXISTS changelog (log_id BLOB NOT NULL);");
+
+	/* Previous revision of big files, kept as a base for META_DELTA. Rows from older versions have no revision and no base. */
+	if(! meta_columns.contains("revision")) {
+		db_->exec("ALTER TABLE meta ADD COLUMN revision INTEGER DEFAULT (0) NOT NULL;");
+		db_->exec("ALTER TABLE meta ADD COLUMN base_revision INTEGER DEFAULT (0) NOT NULL;");
+		db_->exec("ALTER TABLE meta ADD COLUMN base_meta BLOB;");
+	}
+
+	/* Size and mtime of the file, as it was assembled. Kept over unassembled revisions, to check the file before delta assembly. */
+	if(! meta_columns.contains("assembled_size")) {
+		db_->exec("ALTER TABLE meta ADD COLUMN assembled_size INTEGER DEFAULT (0) NOT NULL;");
+		db_->exec("ALTER TABLE meta ADD COLUMN assembled_mtime INTEGER DEFAULT (0) NOT NULL;");
+	}
+
+	/* TABLE peer_watermark. How far we've got in change logs of other peers */
+	db_->exec("CREATE TABLE IF NOT EXISTS peer_watermark (digest BLOB PRIMARY KEY NOT NULL, log_id BLOB NOT NULL, seq INTEGER NOT NULL);");
+
 	/* TABLE chunk */
 	db_->exec("CREATE TABLE IF NOT EXISTS chunk (ct_hash BLOB NOT NULL PRIMARY KEY, size INTEGER NOT NULL, iv BLOB NOT NULL);");
 
@@ -72,9 +107,21 @@ Index::Index(const FolderParams& params, StateCollector* state_collector, QObjec
 	hash_file.write(hexhash_conf);
 	hash_file.close();
 
+	/* Load change log position */
+	for(auto row : db_->exec("SELECT log_id FROM changelog LIMIT 1;"))
+		log_id_ = conv_bytearray(row[0].as_blob());
+	if(log_id_.isEmpty()) {
+		log_id_ = QUuid::createUuid().toRfc4122();
+		db_->exec("INSERT INTO changelog (log_id) VALUES (:log_id);", {{":log_id", conv_bytearray(log_id_)}});
+	}
+
 	notifyState();
 }
 
+Index::~Index() {
+	FdBudget::get_instance()->release(SQLITE_FDS);
+}
+
 bool Index::haveMeta(const Meta::PathRevision& path_revision) noexcept {
 	try {
 		getMeta(path_revision);
@@ -99,30 +146,88 @@ void Index::putMeta(const SignedMeta& signed_meta, bool fully_assembled) {
 	QString transaction_name = QStringLiteral("put_Meta_%1").arg(qrand());
 	SQLiteSavepoint raii_transaction(*db_, transaction_name.toStdString()); // Begin transaction
 
-	db_->exec("INSERT OR REPLACE INTO meta (path_id, meta, signature, type, assembled) VALUES (:path_id, :meta, :signature, :type, :assembled);", {
+	// The replaced revision becomes the base for META_DELTA, unless the same revision is put again (e.g. when it is assembled)
+	bool keep_base = signed_meta.meta().chunks().size() >= params_.meta_delta_chunks_min;
+
+	// Not "INSERT OR REPLACE", because it would drop "openfs" rows of the assembled revision along with the old "meta" row
+	db_->exec("UPDATE meta SET meta=:meta, signature=:signature, type=:type, assembled=:assembled, seq=(SELECT IFNULL(MAX(seq), 0)+1 FROM meta), "
+		"base_meta=CASE WHEN revision=:revision THEN base_meta WHEN :keep_base AND revision<>0 THEN meta ELSE NULL END, "
+		"base_revision=CASE WHEN revision=:revision THEN base_revision WHEN :keep_base AND revision<>0 THEN revision ELSE 0 END, "
+		"assembled_size=CASE WHEN :assembled THEN :size ELSE assembled_size END, "
+		"assembled_mtime=CASE WHEN :assembled THEN :mtime ELSE assembled_mtime END, "
+		"revision=:revision WHERE path_id=:path_id;", {
+			{":path_id", signed_meta.meta().path_id()},
+			{":meta", signed_meta.raw_meta()},
+			{":signature", signed_meta.signature()},
+			{":type", (uint64_t)signed_meta.meta().meta_type()},
+			{":assembled", (uint64_t)fully_assembled},
+			{":revision", (int64_t)signed_meta.meta().revision()},
+			{":keep_base", (uint64_t)keep_base},
+			{":size", (uint64_t)signed_meta.meta().size()},
+			{":mtime", (int64_t)signed_meta.meta().mtime()}
+	});
+	db_->exec("INSERT OR IGNORE INTO meta (path_id, meta, signature, type, assembled, seq, revision, assembled_size, assembled_mtime) "
+		"VALUES (:path_id, :meta, :signature, :type, :assembled, (SELECT IFNULL(MAX(seq), 0)+1 FROM meta), :revision, "
+		"CASE WHEN :assembled THEN :size ELSE 0 END, CASE WHEN :assembled THEN :mtime ELSE 0 END);", {
 			{":path_id", signed_meta.meta().path_id()},
 			{":meta", signed_meta.raw_meta()},
 			{":signature", signed_meta.signature()},
 			{":type", (uint64_t)signed_meta.meta().meta_type()},
-			{":assembled", (uint64_t)fully_assembled}
+			{":assembled", (uint64_t)fully_assembled},
+			{":revision", (int64_t)signed_meta.meta().revision()},
+			{":size", (uint64_t)signed_meta.meta().size()},
+			{":mtime", (int64_t)signed_meta.meta().mtime()}
 	});
 
+	/* Chunk rows are rewritten incrementally: a new revision of a big file usually differs in a few chunks.
+	 * Chunk layout of the currently assembled revision is kept until the new one is assembled. It is used by delta assembly. */
+	struct OpenfsRow {
+		int64_t rowid;
+		bool assembled;
+	};
+	QMultiHash<QPair<QByteArray, quint64>, OpenfsRow> old_rows;    // (ct_hash, offset) -> rows
+	QSet<QByteArray> known_chunks;
+	for(auto row : db_->exec("SELECT rowid, ct_hash, [offset], assembled FROM openfs WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}})) {
+		QByteArray ct_hash = conv_bytearray(row[1].as_blob());
+		old_rows.insert({ct_hash, row[2].as_uint()}, {row[0].as_int(), row[3].as_uint() != 0});
+		known_chunks << ct_hash;
+	}
+
 	uint64_t offset = 0;
 	for(auto chunk : signed_meta.meta().chunks()){
-		db_->exec("INSERT OR IGNORE INTO chunk (ct_hash, size, iv) VALUES (:ct_hash, :size, :iv);", {
-				{":ct_hash", chunk.ct_hash},
-				{":size", (uint64_t)chunk.size},
-				{":iv", chunk.iv}
-		});
+		QPair<QByteArray, quint64> key = {conv_bytearray(chunk.ct_hash), offset};
+		offset += chunk.size;
 
-		db_->exec("INSERT OR REPLACE INTO openfs (ct_hash, path_id, [offset], assembled) VALUES (:ct_hash, :path_id, :offset, :assembled);", {
+		// A row of the assembled layout can't be taken over by an unassembled revision
+		auto old_row_it = old_rows.find(key);
+		while(old_row_it != old_rows.end() && old_row_it.key() == key && !fully_assembled && old_row_it->assembled)
+			++old_row_it;
+		if(old_row_it != old_rows.end() && old_row_it.key() == key) {
+			if(fully_assembled && !old_row_it->assembled)
+				db_->exec("UPDATE openfs SET assembled=1 WHERE rowid=:rowid;", {{":rowid", old_row_it->rowid}});
+			old_rows.erase(old_row_it);
+			continue;
+		}
+
+		if(! known_chunks.contains(key.first)) {
+			db_->exec("INSERT OR IGNORE INTO chunk (ct_hash, size, iv) VALUES (:ct_hash, :size, :iv);", {
+					{":ct_hash", chunk.ct_hash},
+					{":size", (uint64_t)chunk.size},
+					{":iv", chunk.iv}
+			});
+		}
+
+		db_->exec("INSERT INTO openfs (ct_hash, path_id, [offset], assembled) VALUES (:ct_hash, :path_id, :offset, :assembled);", {
 				{":ct_hash", chunk.ct_hash},
 				{":path_id", signed_meta.meta().path_id()},
-				{":offset", (uint64_t)offset},
+				{":offset", (uint64_t)key.second},
 				{":assembled", (uint64_t)fully_assembled}
 		});
+	}
 
-		offset += chunk.size;
+	for(auto& old_row : old_rows) {
+		if(fully_assembled || !old_row.assembled)
+			db_->exec("DELETE FROM openfs WHERE rowid=:rowid;", {{":rowid", old_row.rowid}});
 	}
 
 	raii_transaction.commit();  // End transaction
@@ -157,6 +262,10 @@ QList<SignedMeta> Index::getMeta(){
 	return getMeta("SELECT meta, signature FROM meta");
 }
 
+QList<SignedMeta> Index::getMetaSince(quint64 seq) {
+	return getMeta("SELECT meta, signature FROM meta WHERE seq>:seq;", {{":seq", (uint64_t)seq}});
+}
+
 QList<SignedMeta> Index::getExistingMeta() {
 	return getMeta("SELECT meta, signature FROM meta WHERE (type<>255)=1 AND assembled=1;");
 }
@@ -173,18 +282,55 @@ bool Index::putAllowed(const Meta::PathRevision& path_revision) noexcept {
 	}
 }
 
-void Index::setAssembled(blob path_id) {
-	db_->exec("UPDATE meta SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}});
+void Index::setAssembled(const Meta& meta) {
+	blob path_id = meta.path_id();
+	SQLiteSavepoint raii_transaction(*db_, "Index::setAssembled");
+	for(auto row : db_->exec("SELECT revision FROM meta WHERE path_id=:path_id", {{":path_id", path_id}}))
+		if(row[0].as_int() != 0 && row[0].as_int() != meta.revision()) return;  // A newer revision has arrived meanwhile. Rows of older versions have no revision.
+	db_->exec("UPDATE meta SET assembled=1, assembled_size=:size, assembled_mtime=:mtime WHERE path_id=:path_id", {
+		{":path_id", path_id},
+		{":size", (uint64_t)meta.size()},
+		{":mtime", (int64_t)meta.mtime()}
+	});
+	db_->exec("DELETE FROM openfs WHERE path_id=:path_id AND assembled=1", {{":path_id", path_id}});   // Layout of the previous revision
 	db_->exec("UPDATE openfs SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}});
+	raii_transaction.commit();
 }
 
 bool Index::isAssembledChunk(blob ct_hash) {
-	auto sql_result = db_->exec("SELECT assembled FROM openfs WHERE ct_hash=:ct_hash AND openfs.assembled=1 LIMIT 1", {
+	// Layout of the previous revision is kept for delta assembly only. It can't be served, until the file is assembled in its current revision.
+	auto sql_result = db_->exec("SELECT openfs.assembled FROM openfs JOIN meta ON meta.path_id=openfs.path_id WHERE openfs.ct_hash=:ct_hash AND openfs.assembled=1 AND meta.assembled=1 LIMIT 1", {
 		{":ct_hash", ct_hash}
 	});
 	return sql_result.have_rows();
 }
 
+QPair<quint64, qint64> Index::getAssembledStat(blob path_id) {
+	for(auto row : db_->exec("SELECT assembled_size, assembled_mtime FROM meta WHERE path_id=:path_id;", {{":path_id", path_id}}))
+		return {row[0].as_uint(), row[1].as_int()};
+	return {0, 0};
+}
+
+QList<Index::ChunkLocation> Index::getAssembledLayout(blob path_id) {
+	QList<ChunkLocation> layout;
+	for(auto row : db_->exec("SELECT openfs.ct_hash, openfs.[offset], chunk.size FROM openfs JOIN chunk ON openfs.ct_hash=chunk.ct_hash WHERE openfs.path_id=:path_id AND openfs.assembled=1 ORDER BY openfs.[offset]", {{":path_id", path_id}})) {
+		ChunkLocation location;
+		location.ct_hash = row[0].as_blob();
+		location.offset = row[1].as_uint();
+		location.size = row[2].as_uint();
+		layout << location;
+	}
+	return layout;
+}
+
+QList<Index::AssembledChunk> Index::getAssembledChunk(const blob& ct_hash) {
+	QList<AssembledChunk> result_list;
+	// Only files, that are assembled in their current revision, so that "openfs" offsets match the stored Meta
+	for(auto row : db_->exec("SELECT meta.meta, meta.signature, openfs.[offset] FROM meta JOIN openfs ON meta.path_id=openfs.path_id WHERE openfs.ct_hash=:ct_hash AND openfs.assembled=1 AND meta.assembled=1", {{":ct_hash", ct_hash}}))
+		result_list << AssembledChunk{SignedMeta(row[0], row[1], params_.secret), row[2].as_uint()};
+	return result_list;
+}
+
 QPair<quint32, QByteArray> Index::getChunkSizeIv(blob ct_hash) {
 	for(auto row : db_->exec("SELECT size, iv FROM chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}})) {
 		return qMakePair(row[0].as_uint(), conv_bytearray(row[1].as_blob()));
@@ -197,11 +343,48 @@ QList<SignedMeta> Index::containingChunk(const blob& ct_hash) {
 		{{":ct_hash", ct_hash}});
 }
 
+QPair<qint64, blob> Index::getBaseMeta(const blob& path_id) {
+	for(auto row : db_->exec("SELECT base_revision, base_meta FROM meta WHERE path_id=:path_id AND base_meta IS NOT NULL;", {{":path_id", path_id}}))
+		return {row[0].as_int(), row[1].as_blob()};
+	return {0, blob()};
+}
+
+quint64 Index::lastSeq() {
+	for(auto row : db_->exec("SELECT IFNULL(MAX(seq), 0) FROM meta;"))
+		return row[0].as_uint();
+	return 0;
+}
+
+void Index::touchChunks(const QList<blob>& ct_hashes) {
+	SQLiteSavepoint raii_transaction(*db_, "Index::touchChunks");
+	for(auto& ct_hash : ct_hashes) {
+		db_->exec("UPDATE meta SET seq=(SELECT IFNULL(MAX(seq), 0)+1 FROM meta) WHERE path_id IN (SELECT path_id FROM openfs WHERE ct_hash=:ct_hash);", {
+			{":ct_hash", ct_hash}
+		});
+	}
+}
+
+QPair<QByteArray, quint64> Index::peerWatermark(const QByteArray& digest) {
+	for(auto row : db_->exec("SELECT log_id, seq FROM peer_watermark WHERE digest=:digest;", {{":digest", conv_bytearray(digest)}}))
+		return {conv_bytearray(row[0].as_blob()), row[1].as_uint()};
+	return {QByteArray(), 0};
+}
+
+void Index::setPeerWatermark(const QByteArray& digest, const QByteArray& log_id, quint64 seq) {
+	db_->exec("INSERT OR REPLACE INTO peer_watermark (digest, log_id, seq) VALUES (:digest, :log_id, :seq);", {
+		{":digest", conv_bytearray(digest)},
+		{":log_id", conv_bytearray(log_id)},
+		{":seq", (uint64_t)seq}
+	});
+}
+
 void Index::wipe() {
 	SQLiteSavepoint savepoint(*db_, "Index::wipe");
 	db_->exec("DELETE FROM meta");
 	db_->exec("DELETE FROM chunk");
 	db_->exec("DELETE FROM openfs");
+	db_->exec("DELETE FROM changelog");         // Starts a new log, so that peers don't take old sequence numbers for ours
+	db_->exec("DELETE FROM peer_watermark");    // We don't have what we've got from others anymore
 	savepoint.commit();
 	db_->exec("VACUUM");
 }
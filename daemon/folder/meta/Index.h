@@ -46,31 +46,55 @@ signals:
 	void metaAddedExternal(SignedMeta meta);
 
 public:
+	struct ChunkLocation {
+		blob ct_hash;
+		quint64 offset;
+		quint32 size;
+	};
+	struct AssembledChunk {
+		SignedMeta smeta;
+		quint64 offset;
+	};
+
 	Index(const FolderParams& params, StateCollector* state_collector, QObject* parent);
+	~Index();
 
 	/* Meta manipulators */
 	bool haveMeta(const Meta::PathRevision& path_revision) noexcept;
 	SignedMeta getMeta(const Meta::PathRevision& path_revision);
 	SignedMeta getMeta(const blob& path_id);
 	QList<SignedMeta> getMeta();
+	QList<SignedMeta> getMetaSince(quint64 seq);     // Changed after seq
 	QList<SignedMeta> getExistingMeta();
 	QList<SignedMeta> getIncompleteMeta();
 	void putMeta(const SignedMeta& signed_meta, bool fully_assembled = false);
+	QPair<qint64, blob> getBaseMeta(const blob& path_id);   // (revision, raw meta) of the previous revision, if it was kept
 
 	bool putAllowed(const Meta::PathRevision& path_revision) noexcept;
 
-	void setAssembled(blob path_id);
+	void setAssembled(const Meta& meta);
 	bool isAssembledChunk(blob ct_hash);
+	QList<ChunkLocation> getAssembledLayout(blob path_id);
+	QPair<quint64, qint64> getAssembledStat(blob path_id);     // (size, mtime) of the file, when it was assembled
+	QList<AssembledChunk> getAssembledChunk(const blob& ct_hash);
 	QPair<quint32, QByteArray> getChunkSizeIv(blob ct_hash);
 
 	/* Properties */
 	QList<SignedMeta> containingChunk(const blob& ct_hash);
 
+	/* Change log */
+	QByteArray logId() const {return log_id_;}      // Regenerated, when the index is wiped
+	quint64 lastSeq();
+	void touchChunks(const QList<blob>& ct_hashes);     // Chunk availability of the files, containing them, has changed
+	QPair<QByteArray, quint64> peerWatermark(const QByteArray& digest);    // (log_id, seq) of the peer's log, up to which we have everything
+	void setPeerWatermark(const QByteArray& digest, const QByteArray& log_id, quint64 seq);
+
 private:
 	const FolderParams& params_;
 	StateCollector* state_collector_;
 
 	std::unique_ptr<SQLiteDB> db_;	// Better use SOCI library ( https://github.com/SOCI/soci ). My "reinvented wheel" isn't stable enough.
+	QByteArray log_id_;
 
 	QList<SignedMeta> getMeta(const std::string& sql, const std::map<std::string, SQLValue>& values = std::map<std::string, SQLValue>());
 	void wipe();
@@ -0,0 +1,144 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "MetaDelta.h"
+#include <QHash>
+#include <cstring>
+
+namespace librevault {
+
+namespace {
+const int BLOCK_SIZE = 32;          // Less than a half of a serialized chunk entry, so an unchanged entry always covers an aligned block of the base
+const int CANDIDATES_MAX = 8;       // Per weak hash, bounds the work on repetitive input
+const int APPLIED_SIZE_MAX = 64*1024*1024;   // Copy ranges of the remote are not trusted
+
+/* Rolling checksum from rsync */
+struct RollingChecksum {
+	quint32 a = 0, b = 0;
+
+	void reset(const uint8_t* data) {
+		a = 0; b = 0;
+		for(int i = 0; i < BLOCK_SIZE; i++) {
+			a += data[i];
+			b += (BLOCK_SIZE - i) * data[i];
+		}
+	}
+	void roll(uint8_t out, uint8_t in) {
+		a += in - out;
+		b += a - BLOCK_SIZE * out;
+	}
+	quint32 value() const {return (a & 0xffff) | (b << 16);}
+};
+} /* anonymous namespace */
+
+MetaDelta::MetaDelta(const blob& base_raw, qint64 base_revision, const SignedMeta& smeta) :
+	revision(smeta.meta().path_revision()), base_revision(base_revision), signature(smeta.signature()) {
+	const blob& target = smeta.raw_meta();
+
+	QMultiHash<quint32, int> base_blocks;  // Weak checksum -> offset of a block in the base
+	RollingChecksum block_checksum;
+	for(int offset = 0; offset + BLOCK_SIZE <= (int)base_raw.size(); offset += BLOCK_SIZE) {
+		block_checksum.reset(base_raw.data() + offset);
+		base_blocks.insert(block_checksum.value(), offset);
+	}
+
+	int literal_start = 0;
+	int pos = 0;
+	RollingChecksum checksum;
+	bool checksum_valid = false;
+	while(pos + BLOCK_SIZE <= (int)target.size()) {
+		if(!checksum_valid) {
+			checksum.reset(target.data() + pos);
+			checksum_valid = true;
+		}
+
+		int match_base = -1;
+		int candidates = 0;
+		for(auto it = base_blocks.find(checksum.value()); it != base_blocks.end() && it.key() == checksum.value() && candidates < CANDIDATES_MAX; ++it, candidates++) {
+			if(std::memcmp(base_raw.data() + it.value(), target.data() + pos, BLOCK_SIZE) == 0) {
+				match_base = it.value();
+				break;
+			}
+		}
+
+		if(match_base < 0) {
+			if(pos + BLOCK_SIZE < (int)target.size())
+				checksum.roll(target[pos], target[pos + BLOCK_SIZE]);
+			pos++;
+			continue;
+		}
+
+		// Extending the match both ways. Backwards, it takes over the pending literal.
+		int forward = BLOCK_SIZE;
+		while(match_base + forward < (int)base_raw.size() && pos + forward < (int)target.size() && base_raw[match_base + forward] == target[pos + forward])
+			forward++;
+		int backward = 0;
+		while(pos - backward > literal_start && match_base - backward > 0 && base_raw[match_base - backward - 1] == target[pos - backward - 1])
+			backward++;
+
+		Op op;
+		op.literal = QByteArray((const char*)target.data() + literal_start, pos - backward - literal_start);
+		op.copy_offset = match_base - backward;
+		op.copy_length = forward + backward;
+		ops << op;
+
+		pos += forward;
+		literal_start = pos;
+		checksum_valid = false;
+	}
+
+	if(literal_start < (int)target.size()) {
+		Op op;
+		op.literal = QByteArray((const char*)target.data() + literal_start, target.size() - literal_start);
+		ops << op;
+	}
+}
+
+SignedMeta MetaDelta::apply(const blob& base_raw, const Secret& secret) const {
+	blob raw_meta;
+	for(const Op& op : ops) {
+		if((quint64)op.copy_offset + op.copy_length > base_raw.size()) throw delta_error();
+		if(raw_meta.size() + op.literal.size() + op.copy_length > APPLIED_SIZE_MAX) throw delta_error();
+
+		raw_meta.insert(raw_meta.end(), op.literal.begin(), op.literal.end());
+		raw_meta.insert(raw_meta.end(), base_raw.begin() + op.copy_offset, base_raw.begin() + op.copy_offset + op.copy_length);
+	}
+
+	SignedMeta smeta(raw_meta, signature, secret);  // Checks the signature
+	if(smeta.meta().path_id() != revision.path_id_ || smeta.meta().revision() != revision.revision_) throw delta_error();
+	return smeta;
+}
+
+int MetaDelta::literalSize() const {
+	int size = 0;
+	for(const Op& op : ops)
+		size += op.literal.size();
+	return size;
+}
+
+} /* namespace librevault */
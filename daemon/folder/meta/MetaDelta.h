@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <librevault/SignedMeta.h>
+#include <QList>
+
+namespace librevault {
+
+/* Newer revision of a Meta, encoded against an older revision of the same path, that the receiver has. The signed bytes are rebuilt
+ * exactly from the receiver's copy of the base, so the signature is checked as if the full Meta was sent. */
+class MetaDelta {
+public:
+	struct delta_error : public std::runtime_error {
+		delta_error() : std::runtime_error("Meta delta doesn't apply to the base revision"){}
+	};
+
+	/* Literal bytes, then a range, copied from the base */
+	struct Op {
+		QByteArray literal;
+		quint32 copy_offset = 0;
+		quint32 copy_length = 0;
+	};
+
+	MetaDelta() = default;
+	MetaDelta(const blob& base_raw, qint64 base_revision, const SignedMeta& smeta);
+
+	SignedMeta apply(const blob& base_raw, const Secret& secret) const;
+	int literalSize() const;    // Bytes on the wire, not counting the ops themselves
+
+	Meta::PathRevision revision;
+	qint64 base_revision = 0;
+	QList<Op> ops;
+	blob signature;
+};
+
+} /* namespace librevault */
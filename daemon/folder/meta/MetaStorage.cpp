@@ -31,8 +31,10 @@
 #include "DirectoryWatcher.h"
 #include "Index.h"
 #include "IndexerQueue.h"
+#include "control/Config.h"
 #include "control/FolderParams.h"
 #include "folder/PathNormalizer.h"
+#include <QTimer>
 
 namespace librevault {
 
@@ -51,9 +53,16 @@ MetaStorage::MetaStorage(const FolderParams& params, IgnoreList* ignore_list, Pa
 
 	connect(index_, &Index::metaAdded, this, &MetaStorage::metaAdded);
 	connect(index_, &Index::metaAddedExternal, this, &MetaStorage::metaAddedExternal);
+
+	touch_timer_ = new QTimer(this);
+	touch_timer_->setSingleShot(true);
+	touch_timer_->setInterval(Config::get()->getGlobal("meta_touch_interval").toInt()*1000);
+	connect(touch_timer_, &QTimer::timeout, this, &MetaStorage::flushTouchedChunks);
 };
 
-MetaStorage::~MetaStorage() {}
+MetaStorage::~MetaStorage() {
+	flushTouchedChunks();
+}
 
 bool MetaStorage::haveMeta(const Meta::PathRevision& path_revision) noexcept {
 	return index_->haveMeta(path_revision);
@@ -71,6 +80,10 @@ QList<SignedMeta> MetaStorage::getMeta() {
 	return index_->getMeta();
 }
 
+QList<SignedMeta> MetaStorage::getMetaSince(quint64 seq) {
+	return index_->getMetaSince(seq);
+}
+
 QList<SignedMeta> MetaStorage::getExistingMeta() {
 	return index_->getExistingMeta();
 }
@@ -83,22 +96,70 @@ void MetaStorage::putMeta(const SignedMeta& signed_meta, bool fully_assembled) {
 	return index_->putMeta(signed_meta, fully_assembled);
 }
 
+QPair<qint64, blob> MetaStorage::getBaseMeta(const blob& path_id) {
+	return index_->getBaseMeta(path_id);
+}
+
 QList<SignedMeta> MetaStorage::containingChunk(const blob& ct_hash) {
 	return index_->containingChunk(ct_hash);
 }
 
-void MetaStorage::markAssembled(blob path_id) {
-	index_->setAssembled(path_id);
+void MetaStorage::markAssembled(const Meta& meta) {
+	index_->setAssembled(meta);
 }
 
 bool MetaStorage::isChunkAssembled(blob ct_hash) {
 	return index_->isAssembledChunk(ct_hash);
 }
 
+QList<Index::ChunkLocation> MetaStorage::getAssembledLayout(blob path_id) {
+	return index_->getAssembledLayout(path_id);
+}
+
+QPair<quint64, qint64> MetaStorage::getAssembledStat(blob path_id) {
+	return index_->getAssembledStat(path_id);
+}
+
+QList<Index::AssembledChunk> MetaStorage::getAssembledChunk(const blob& ct_hash) {
+	return index_->getAssembledChunk(ct_hash);
+}
+
 QPair<quint32, QByteArray> MetaStorage::getChunkSizeIv(blob ct_hash) {
 	return index_->getChunkSizeIv(ct_hash);
 };
 
+QByteArray MetaStorage::logId() const {
+	return index_->logId();
+}
+
+quint64 MetaStorage::lastSeq() {
+	return index_->lastSeq();
+}
+
+void MetaStorage::touchChunk(const blob& ct_hash) {
+	touched_chunks_.insert(conv_bytearray(ct_hash));
+	if(! touch_timer_->isActive())
+		touch_timer_->start();
+}
+
+void MetaStorage::flushTouchedChunks() {
+	if(touched_chunks_.isEmpty()) return;
+
+	QList<blob> ct_hashes;
+	for(auto& ct_hash : touched_chunks_)
+		ct_hashes << conv_bytearray(ct_hash);
+	touched_chunks_.clear();
+	index_->touchChunks(ct_hashes);
+}
+
+QPair<QByteArray, quint64> MetaStorage::peerWatermark(const QByteArray& digest) {
+	return index_->peerWatermark(digest);
+}
+
+void MetaStorage::setPeerWatermark(const QByteArray& digest, const QByteArray& log_id, quint64 seq) {
+	index_->setPeerWatermark(digest, log_id, seq);
+}
+
 bool MetaStorage::putAllowed(const Meta::PathRevision& path_revision) noexcept {
 	return index_->putAllowed(path_revision);
 }
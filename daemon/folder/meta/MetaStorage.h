@@ -28,8 +28,10 @@
  */
 #pragma once
 #include "blob.h"
+#include "Index.h"
 #include <librevault/SignedMeta.h>
 #include <QObject>
+#include <QSet>
 
 namespace librevault {
 
@@ -37,10 +39,10 @@ class DirectoryPoller;
 class DirectoryWatcher;
 class FolderParams;
 class IgnoreList;
-class Index;
 class IndexerQueue;
 class PathNormalizer;
 class StateCollector;
+class QTimer;
 
 class MetaStorage : public QObject {
 	Q_OBJECT
@@ -60,18 +62,30 @@ public:
 	SignedMeta getMeta(const Meta::PathRevision& path_revision);
 	SignedMeta getMeta(const blob& path_id);
 	QList<SignedMeta> getMeta();
+	QList<SignedMeta> getMetaSince(quint64 seq);
 	QList<SignedMeta> getExistingMeta();
 	QList<SignedMeta> getIncompleteMeta();
 	void putMeta(const SignedMeta& signed_meta, bool fully_assembled = false);
+	QPair<qint64, blob> getBaseMeta(const blob& path_id);
 	QList<SignedMeta> containingChunk(const blob& ct_hash);
 	QPair<quint32, QByteArray> getChunkSizeIv(blob ct_hash);
 
 	// Assembled index
-	void markAssembled(blob path_id);
+	void markAssembled(const Meta& meta);
 	bool isChunkAssembled(blob ct_hash);
+	QList<Index::ChunkLocation> getAssembledLayout(blob path_id);
+	QPair<quint64, qint64> getAssembledStat(blob path_id);
+	QList<Index::AssembledChunk> getAssembledChunk(const blob& ct_hash);
 
 	bool putAllowed(const Meta::PathRevision& path_revision) noexcept;
 
+	// Change log
+	QByteArray logId() const;
+	quint64 lastSeq();
+	void touchChunk(const blob& ct_hash);   // Coalesced, the change log is bumped once for every chunk, added within meta_touch_interval
+	QPair<QByteArray, quint64> peerWatermark(const QByteArray& digest);
+	void setPeerWatermark(const QByteArray& digest, const QByteArray& log_id, quint64 seq);
+
 	void prepareAssemble(QByteArray normpath, Meta::Type type, bool with_removal = false);
 
 private:
@@ -79,6 +93,11 @@ private:
 	IndexerQueue* indexer_;
 	DirectoryPoller* poller_;
 	DirectoryWatcher* watcher_;
+
+	QSet<QByteArray> touched_chunks_;
+	QTimer* touch_timer_;
+
+	void flushTouchedChunks();
 };
 
 } /* namespace librevault */
@@ -30,43 +30,57 @@
 
 #include "control/Config.h"
 #include "control/FolderParams.h"
+#include "folder/chunk/ChunkIOService.h"
 #include "folder/meta/MetaStorage.h"
+#include "p2p/BandwidthLimiter.h"
 #include "util/readable.h"
+#include <QDir>
+#include <QFileInfo>
 #include <QLoggingCategory>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <boost/range/adaptor/map.hpp>
 
 namespace librevault {
 
 Q_LOGGING_CATEGORY(log_downloader, "folder.downloader")
 
-DownloadChunk::DownloadChunk(const FolderParams& params, QByteArray ct_hash, quint32 size) : builder(params.system_path, ct_hash, size), ct_hash(ct_hash) {}
+DownloadChunk::DownloadChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type) :
+	size(size), strong_hash_type(strong_hash_type), ct_hash(ct_hash) {}
 
 AvailabilityMap<uint32_t> DownloadChunk::requestMap() {
-	AvailabilityMap<uint32_t> request_map = builder.file_map();
+	AvailabilityMap<uint32_t> request_map = builder ? builder->file_map() : AvailabilityMap<uint32_t>(size);
 		foreach(auto& request, requests.values())
 			request_map.insert({request.offset, request.size});
 	return request_map;
 }
 
-Downloader::Downloader(const FolderParams& params, MetaStorage* meta_storage, QObject* parent) :
+Downloader::Downloader(const FolderParams& params, MetaStorage* meta_storage, ChunkIOService* io, TransferScheduler* scheduler, QObject* parent) :
 	QObject(parent),
 	params_(params),
-	meta_storage_(meta_storage) {
+	meta_storage_(meta_storage),
+	io_(io),
+	scheduler_(scheduler),
+	reputation_(Config::get()->getGlobal("p2p_ban_blame_threshold").toDouble()) {
 	LOGFUNC();
-	maintain_timer_ = new QTimer(this);
-	connect(maintain_timer_, &QTimer::timeout, this, &Downloader::maintainRequests);
-	maintain_timer_->setInterval(Config::get()->getGlobal("p2p_request_timeout").toInt()*1000);
-	maintain_timer_->setTimerType(Qt::VeryCoarseTimer);
-	maintain_timer_->start();
+	scheduler_->addClient(this, params_.transfer_weight);
 }
 
-Downloader::~Downloader() {}
+Downloader::~Downloader() {
+	if(scheduler_)
+		scheduler_->removeClient(this);
+}
 
 void Downloader::notifyLocalMeta(const SignedMeta& smeta, const bitfield_type& bitfield) {
 	SCOPELOG(log_downloader);
 
 	Q_ASSERT(bitfield.size() == smeta.meta().chunks().size());
 
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+	removeFile(path_id);    // Previous revision
+
 	QList<QByteArray> incomplete_chunks;
 	incomplete_chunks.reserve(smeta.meta().chunks().size());
 
@@ -81,35 +95,126 @@ void Downloader::notifyLocalMeta(const SignedMeta& smeta, const bitfield_type& b
 		if(bitfield[chunk_idx]) {
 			have_complete = true;   // We have chunk, remove from missing
 			removeChunk(ct_hash); // Do not mark connected chunks as clustered, because they will be marked inside the loop below.
+			advanceFiles(ct_hash);
 		}else{
 			have_incomplete = true; // We haven't this chunk, we need to download it
-			addChunk(ct_hash, meta_chunk.size);
+			addChunk(ct_hash, meta_chunk.size, smeta.meta().strong_hash_type());
 			incomplete_chunks << ct_hash;
 		}
 	}
 
-	if(have_complete && have_incomplete) {
-		foreach(QByteArray ct_hash, getMetaCluster(incomplete_chunks)) {
-			download_queue_.markClustered(ct_hash);
+	if(have_incomplete) {
+		DownloadFile& file = files_[path_id];
+		file.chunks_total = smeta.meta().chunks().size();
+		file.missing_chunks = incomplete_chunks.toSet();
+		file.immediate = immediate_paths_.contains(path_id);
+		if(params_.secret.get_type() <= Secret::Type::ReadOnly)
+			file.priority = params_.downloadPriority(QByteArray::fromStdString(smeta.meta().path(params_.secret)));
+
+		foreach(QByteArray ct_hash, incomplete_chunks) {
+			chunk_files_[ct_hash].insert(path_id);
+			updateFileWeight(ct_hash);
 		}
+
+		if(have_complete) {
+			foreach(QByteArray ct_hash, incomplete_chunks)
+				markCluster(ct_hash);
+		}
+	}else
+		immediate_paths_.remove(path_id);
+}
+
+float Downloader::DownloadFile::completion() const {
+	// Quantized, so that every received chunk doesn't reweight the whole file
+	if(chunks_total == 0) return 0;
+	return std::floor(20.0f * float(chunks_total - missing_chunks.size()) / chunks_total) / 20.0f;
+}
+
+void Downloader::removeFile(const QByteArray& path_id) {
+	auto file_it = files_.find(path_id);
+	if(file_it == files_.end()) return;
+
+	foreach(QByteArray ct_hash, file_it->missing_chunks) {
+		auto chunk_files_it = chunk_files_.find(ct_hash);
+		if(chunk_files_it == chunk_files_.end()) continue;
+		chunk_files_it->remove(path_id);
+		if(chunk_files_it->isEmpty())
+			chunk_files_.erase(chunk_files_it);
 	}
+	files_.erase(file_it);
+}
+
+void Downloader::updateFileWeight(const QByteArray& ct_hash) {
+	int priority = std::numeric_limits<int>::min();
+	float completion = 0;
+	bool immediate = false;
+	foreach(QByteArray path_id, chunk_files_.value(ct_hash)) {
+		auto file_it = files_.constFind(path_id);
+		if(file_it == files_.constEnd()) continue;
+		priority = std::max(priority, file_it->priority);
+		completion = std::max(completion, file_it->completion());
+		immediate |= file_it->immediate;
+	}
+	if(priority == std::numeric_limits<int>::min()) priority = 0;
+
+	download_queue_.setFileWeight(ct_hash, priority, completion);
+	if(immediate)
+		download_queue_.markImmediate(ct_hash);
+}
+
+void Downloader::prioritizeFile(QByteArray path_id) {
+	SCOPELOG(log_downloader);
+	immediate_paths_.insert(path_id);
+
+	auto file_it = files_.find(path_id);
+	if(file_it == files_.end()) return;    // Will be applied, when its Meta arrives
+
+	file_it->immediate = true;
+	foreach(QByteArray ct_hash, file_it->missing_chunks)
+		download_queue_.markImmediate(ct_hash);
+
+	qCDebug(log_downloader) << "Prioritized" << path_id_readable(path_id) << "with" << file_it->missing_chunks.size() << "missing chunks";
+	scheduleMaintain();
 }
 
-void Downloader::addChunk(QByteArray ct_hash, quint32 size) {
+void Downloader::addChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type) {
+	if(down_chunks_.contains(ct_hash)) return;  // Already queued, keep its requests and owners
+
 	qCDebug(log_downloader) << "Added" << ct_hash_readable(ct_hash) << "to download queue";
 
 	uint32_t padded_size = size % 16 == 0 ? size : ((size / 16) + 1) * 16;
 
-	DownloadChunkPtr chunk = std::make_shared<DownloadChunk>(params_, ct_hash, padded_size);
+	DownloadChunkPtr chunk = std::make_shared<DownloadChunk>(ct_hash, padded_size, strong_hash_type);
 	down_chunks_.insert(ct_hash, chunk);
 
 	download_queue_.addChunk(ct_hash);
+
+	// Partially downloaded in a previous run, continue it first
+	if(!retiring_.contains(ct_hash) && QFile::exists(ChunkFileBuilder::location(params_.system_path, ct_hash)) && canStartChunk())
+		startChunk(chunk);
 }
 
 void Downloader::removeChunk(QByteArray ct_hash) {
-	if(down_chunks_.contains(ct_hash)) {
+	DownloadChunkPtr chunk = down_chunks_.take(ct_hash);
+	if(chunk) {
 		download_queue_.removeChunk(ct_hash);
-		down_chunks_.remove(ct_hash);
+		if(chunk->builder)
+			discardChunk(chunk);
+
+		for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end(); ++request_it) {
+			request_it.key()->cancel_block(conv_bytearray(ct_hash), request_it->offset, request_it->size);
+			request_it.key()->request_window().requestCancelled();
+		}
+		releaseSlots(chunk->requests.size());
+		requested_chunks_.remove(ct_hash);
+		storing_.remove(ct_hash);
+		for(RemoteFolder* owner_remote : chunk->owned_by.keys()) {
+			remote_chunks_[owner_remote].remove(ct_hash);
+			if(chunk->window_parked)
+				window_parked_[owner_remote].remove(ct_hash);
+		}
+		for(RemoteFolder* remote : chunk->requests.uniqueKeys())
+			windowFreed(remote);
 
 		qCDebug(log_downloader) << "Removed" << ct_hash_readable(ct_hash) << "from download queue";
 	}
@@ -118,34 +223,42 @@ void Downloader::removeChunk(QByteArray ct_hash) {
 void Downloader::notifyLocalChunk(const blob& ct_hash) {
 	SCOPELOG(log_downloader);
 
-	removeChunk(conv_bytearray(ct_hash));
+	QByteArray ct_hash_q = conv_bytearray(ct_hash);
+	removeChunk(ct_hash_q);
 
 	// Mark all other chunks "clustered"
-	foreach(QByteArray cluster_hash, getCluster(conv_bytearray(ct_hash))) {
-		download_queue_.markClustered(cluster_hash);
-	}
+	markCluster(ct_hash_q);
+
+	advanceFiles(ct_hash_q);
 }
 
-QSet<QByteArray> Downloader::getCluster(QByteArray ct_hash) {
-	QSet<QByteArray> cluster;
+void Downloader::markCluster(const QByteArray& ct_hash) {
+	// Every file is clustered once, so this is O(siblings) per file, not per chunk
+	foreach(QByteArray path_id, chunk_files_.value(ct_hash)) {
+		auto file_it = files_.find(path_id);
+		if(file_it == files_.end() || file_it->clustered) continue;
 
-	foreach(const SignedMeta& smeta, meta_storage_->containingChunk(conv_bytearray(ct_hash))) {
-		for(auto& chunk : smeta.meta().chunks()) {
-			cluster << conv_bytearray(chunk.ct_hash);
-		}
+		file_it->clustered = true;
+		foreach(QByteArray sibling_hash, file_it->missing_chunks)
+			download_queue_.markClustered(sibling_hash);
 	}
-
-	return cluster;
 }
 
-QSet<QByteArray> Downloader::getMetaCluster(QList<QByteArray> ct_hashes) {
-	QSet<QByteArray> cluster;
-
-	foreach(QByteArray ct_hash, ct_hashes) {
-		cluster += getCluster(ct_hash);
+void Downloader::advanceFiles(const QByteArray& ct_hash) {
+	foreach(QByteArray path_id, chunk_files_.take(ct_hash)) {
+		auto file_it = files_.find(path_id);
+		if(file_it == files_.end()) continue;
+
+		float completion_before = file_it->completion();
+		file_it->missing_chunks.remove(ct_hash);
+		if(file_it->missing_chunks.isEmpty()) {
+			files_.erase(file_it);
+			immediate_paths_.remove(path_id);
+		}else if(file_it->completion() != completion_before) {
+			foreach(QByteArray missing_hash, file_it->missing_chunks)
+				updateFileWeight(missing_hash);
+		}
 	}
-
-	return cluster;
 }
 
 void Downloader::notifyRemoteMeta(RemoteFolder* remote, const Meta::PathRevision& revision, bitfield_type bitfield) {
@@ -170,33 +283,46 @@ void Downloader::notifyRemoteChunk(RemoteFolder* remote, const blob& ct_hash) {
 	if(! chunk)
 		return;
 
+	if(chunk->owned_by.contains(remote))
+		return;
+
 	chunk->owned_by.insert(remote, remote->get_interest_guard());
-	download_queue_.setRemotesCount(ct_hash_q, chunk->owned_by.size());
+	remote_chunks_[remote].insert(ct_hash_q);
+	chunk->window_parked = false;   // The new owner may have free slots
+	download_queue_.setOwnedBy(ct_hash_q, chunk->owned_by.size());
+	updateRequestable(chunk);
 
-	QTimer::singleShot(0, this, &Downloader::maintainRequests);
+	scheduleMaintain();
 }
 
 void Downloader::handleChoke(RemoteFolder* remote) {
 	SCOPELOG(log_downloader);
 
 	/* Remove requests to this node */
-	foreach(DownloadChunkPtr missing_chunk, down_chunks_)
-		missing_chunk->requests.remove(remote);
+	foreach(QByteArray ct_hash, requested_chunks_)
+		removeRequests(down_chunks_.value(ct_hash), remote);
 
-	QTimer::singleShot(0, this, &Downloader::maintainRequests);
+	foreach(QByteArray ct_hash, remote_chunks_.value(remote))
+		updateRequestable(down_chunks_.value(ct_hash));
+
+	scheduleMaintain();
 }
 
 void Downloader::handleUnchoke(RemoteFolder* remote) {
 	SCOPELOG(log_downloader);
-	QTimer::singleShot(0, this, &Downloader::maintainRequests);
+
+	foreach(QByteArray ct_hash, remote_chunks_.value(remote))
+		updateRequestable(down_chunks_.value(ct_hash));
+
+	scheduleMaintain();
 }
 
 void Downloader::putBlock(const blob& ct_hash, uint32_t offset, const blob& data, RemoteFolder* from) {
 	SCOPELOG(log_downloader);
 	auto missing_chunk = down_chunks_.value(conv_bytearray(ct_hash));
-	if(! missing_chunk) return;
+	if(!missing_chunk || !missing_chunk->builder) return;
 
-	QList<QPair<QByteArray, QFile*>> downloaded_chunks;
+	bool accepted = false;
 
 	QMutableHashIterator<RemoteFolder*, DownloadChunk::BlockRequest> request_it(missing_chunk->requests);
 	while(request_it.hasNext()) {
@@ -205,28 +331,59 @@ void Downloader::putBlock(const blob& ct_hash, uint32_t offset, const blob& data
 		if(request_it.value().offset == offset      // Chunk position incorrect
 		&& request_it.value().size == data.size()   // Chunk size incorrect
 		&& request_it.key() == from) {              // Requested node != replied. Well, it isn't critical, but will be useful to ban "fake" peers
+			from->request_window().requestCompleted(data.size(), request_it.value().started, from->rtt());
+			releaseSlots();
 			request_it.remove();
-
-			missing_chunk->builder.put_block(offset, QByteArray::fromRawData((const char*)data.data(), data.size()));
-			if(missing_chunk->builder.complete()) {
-				QFile* chunk_f = missing_chunk->builder.release_chunk();
-				chunk_f->setParent(this);
-
-				downloaded_chunks << qMakePair(conv_bytearray(ct_hash), chunk_f);
-			}   // TODO: catch "invalid hash" exception here
+			requestsRemoved(missing_chunk);
+			windowFreed(from);
+			accepted = true;
+
+			QByteArray block((const char*)data.data(), data.size());
+			if(missing_chunk->builder->put_block(offset, block) && !missing_chunk->builder->in_memory()) {
+				QString chunk_location = missing_chunk->builder->chunk_location();
+				QByteArray chunk_ct_hash = missing_chunk->ct_hash;
+				auto write_failed = missing_chunk->write_failed;
+				io_->post(chunk_ct_hash, [=]{
+					if(! ChunkFileBuilder::write_block(chunk_location, offset, block))
+						*write_failed = true;
+				}, this, [=]{
+					// Unless the builder is already retired, in which case verifyChunk() sees the flag
+					DownloadChunkPtr chunk = down_chunks_.value(chunk_ct_hash);
+					if(*write_failed && chunk && chunk->builder && chunk->write_failed == write_failed)
+						chunkWriteFailed(chunk);
+				});
+			}
+			missing_chunk->block_sources.insert(offset, from->digest());
+			if(missing_chunk->builder->complete()) {
+				verifyChunk(missing_chunk);
+				break;
+			}
 		}
 	}
 
-	for(QPair<QByteArray, QFile*> chunk : downloaded_chunks) {
-		emit chunkDownloaded(chunk.first, chunk.second);
+	// Endgame duplicates of this block are not needed anymore
+	if(accepted) {
+		request_it.toFront();
+		while(request_it.hasNext()) {
+			request_it.next();
+			if(request_it.value().offset == offset && request_it.value().size == data.size()) {
+				request_it.key()->cancel_block(ct_hash, offset, data.size());
+				request_it.key()->request_window().requestCancelled();
+				releaseSlots();
+				windowFreed(request_it.key());
+				request_it.remove();
+			}
+		}
+		requestsRemoved(missing_chunk);
 	}
 
-	QTimer::singleShot(0, this, &Downloader::maintainRequests);
+	updateRequestable(missing_chunk);
+	scheduleMaintain();
 }
 
 void Downloader::trackRemote(RemoteFolder* remote) {
 	remotes_.insert(remote);
-	download_queue_.setRemotesCount(remotes_.size());
+	remote->request_window().setLimits(windowLimits());
 }
 
 void Downloader::untrackRemote(RemoteFolder* remote) {
@@ -234,65 +391,378 @@ void Downloader::untrackRemote(RemoteFolder* remote) {
 
 	if(! remotes_.contains(remote)) return;
 
-	foreach(DownloadChunkPtr missing_chunk, down_chunks_.values()) {
-		missing_chunk->requests.remove(remote);
+	foreach(QByteArray ct_hash, requested_chunks_)
+		removeRequests(down_chunks_.value(ct_hash), remote);
+
+	foreach(QByteArray ct_hash, remote_chunks_.take(remote)) {
+		DownloadChunkPtr missing_chunk = down_chunks_.value(ct_hash);
+		if(! missing_chunk) continue;
+
 		missing_chunk->owned_by.remove(remote);
-		download_queue_.setRemotesCount(missing_chunk->ct_hash, missing_chunk->owned_by.size());
+		missing_chunk->window_parked = false;   // Re-parked by requestOne(), if the other owners are full
+		download_queue_.setOwnedBy(ct_hash, missing_chunk->owned_by.size());
+		updateRequestable(missing_chunk);
 	}
+	window_parked_.remove(remote);
 	remotes_.remove(remote);
-	download_queue_.setRemotesCount(remotes_.size());
+}
+
+void Downloader::pruneIncomplete() {
+	QSet<QString> needed;
+	for(auto& ct_hash : down_chunks_.keys()) {
+		QString chunk_name = QFileInfo(ChunkFileBuilder::location(params_.system_path, ct_hash)).fileName();
+		needed << chunk_name << ChunkFileBuilder::rangesLocation(chunk_name);
+	}
+
+	QDir system_dir(params_.system_path);
+	for(const QString& entry : system_dir.entryList(QStringList() << "incomplete-*", QDir::Files | QDir::Hidden)) {
+		if(! needed.contains(entry)) {
+			qCDebug(log_downloader) << "Removing stale partial chunk" << entry;
+			QFile::remove(system_dir.absoluteFilePath(entry));
+		}
+	}
+}
+
+void Downloader::addRequest(const DownloadChunkPtr& chunk, RemoteFolder* remote, DownloadChunk::BlockRequest request) {
+	chunk->requests.insert(remote, request);
+	requested_chunks_.insert(chunk->ct_hash);
+	remote->request_window().requestSent();
+	if(scheduler_)
+		scheduler_->acquireSlots(this);
+	remote->limiter()->consume(BandwidthLimiter::DOWNLOAD, request.size);   // Charged at request time, so that requests are paced
+}
+
+void Downloader::removeRequests(const DownloadChunkPtr& chunk, RemoteFolder* remote) {
+	if(! chunk) return;
+
+	int removed = chunk->requests.remove(remote);
+	if(removed > 0) {
+		remote->request_window().requestCancelled(removed);
+		releaseSlots(removed);
+		requestsRemoved(chunk);
+		windowFreed(remote);
+	}
+}
+
+void Downloader::requestsRemoved(const DownloadChunkPtr& chunk) {
+	if(chunk->requests.isEmpty())
+		requested_chunks_.remove(chunk->ct_hash);
+	updateRequestable(chunk);
+}
+
+void Downloader::updateRequestable(const DownloadChunkPtr& chunk) {
+	if(! chunk || !down_chunks_.contains(chunk->ct_hash)) return;
+
+	bool requestable = false;
+	if(retiring_.contains(chunk->ct_hash) || storing_.contains(chunk->ct_hash) || chunk->window_parked) {
+		download_queue_.setRequestable(chunk->ct_hash, false);
+		return;
+	}
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+		if(owner_remote->ready() && !owner_remote->peer_choking() && !reputation_.banned(owner_remote->digest())) {
+			requestable = !chunk->requestMap().full();
+			break;
+		}
+	}
+	download_queue_.setRequestable(chunk->ct_hash, requestable);
+}
+
+bool Downloader::parkIfWindowsFull(const DownloadChunkPtr& chunk) {
+	if(! chunk || chunk->owned_by.isEmpty()) return false;
+
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+		if(owner_remote->request_window().hasFreeSlot()) return false;
+	}
+
+	chunk->window_parked = true;
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys())
+		window_parked_[owner_remote].insert(chunk->ct_hash);
+	download_queue_.setRequestable(chunk->ct_hash, false);
+	return true;
+}
+
+void Downloader::windowFreed(RemoteFolder* remote) {
+	if(! remote->request_window().hasFreeSlot()) return;
+
+	auto parked_it = window_parked_.find(remote);
+	if(parked_it == window_parked_.end()) return;
+	QSet<QByteArray> parked = std::move(parked_it.value());
+	window_parked_.erase(parked_it);
+
+	foreach(QByteArray ct_hash, parked) {
+		DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+		if(!chunk || !chunk->window_parked) continue;   // Unparked by another owner already
+
+		chunk->window_parked = false;
+		updateRequestable(chunk);
+	}
+}
+
+void Downloader::verifyChunk(const DownloadChunkPtr& chunk) {
+	// Hashing and moving the file happen on the I/O strand of this chunk, after its pending writes
+	std::shared_ptr<ChunkFileBuilder> builder(std::move(chunk->builder));
+	retiring_.insert(chunk->ct_hash);
+
+	QByteArray ct_hash = chunk->ct_hash;
+	Meta::StrongHashType strong_hash_type = chunk->strong_hash_type;
+	QThread* event_thread = thread();
+	auto chunk_f = std::make_shared<QFile*>(nullptr);
+	auto chunk_data = std::make_shared<QByteArray>();   // Verified bytes are passed on, so that nobody reads them back from disk
+	auto write_failed = chunk->write_failed;
+	io_->post(ct_hash, [=]{
+		if(!*write_failed && builder->verify(ct_hash, strong_hash_type, chunk_data.get())) {
+			*chunk_f = builder->release_chunk();
+			if(*chunk_f)
+				(*chunk_f)->moveToThread(event_thread);
+		}else
+			builder->discard();
+	}, this, [=]{chunkVerified(ct_hash, *chunk_f, *chunk_data, *write_failed);}, ChunkIOService::URGENT);
+}
+
+void Downloader::chunkVerified(QByteArray ct_hash, QFile* chunk_f, QByteArray chunk_data, bool write_failed) {
+	retiring_.remove(ct_hash);
+	builders_count_--;
+
+	DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+	if(! chunk) {
+		// Not needed anymore
+		if(chunk_f) {
+			chunk_f->remove();
+			delete chunk_f;
+		}
+	}else if(! chunk_data.isEmpty()) {
+		reputation_.chunkVerified(chunk->block_sources.values(), chunk->size);
+		storing_.insert(ct_hash);   // Until notifyLocalChunk, there is no builder and nothing requested, but the chunk is not missing
+		if(chunk_f)
+			chunk_f->setParent(this);
+		emit chunkDownloaded(ct_hash, chunk_f, chunk_data);
+	}else if(write_failed) {
+		chunkWriteFailed(chunk);
+	}else{
+		chunkCorrupted(chunk);
+	}
+
+	updateRequestable(chunk);
+	scheduleMaintain();
+}
+
+void Downloader::chunkCorrupted(const DownloadChunkPtr& chunk) {
+	QList<QByteArray> sources = chunk->block_sources.values();  // Blocks resumed from a previous run have no known source
+	qCWarning(log_downloader) << "Chunk" << ct_hash_readable(chunk->ct_hash) << "failed verification, sent by" << sources.toSet().size() << "peer(s)";   // FIXME: #83
+	reputation_.chunkCorrupted(sources);
+
+	// Start over. Only this chunk is lost, and it is downloaded from a single peer now.
+	cancelRequests(chunk);
+	chunk->block_sources.clear();
+	chunk->single_source = true;
+
+	// Forget outstanding requests to peers, that are banned now
+	foreach(RemoteFolder* remote, remotes_) {
+		if(! reputation_.banned(remote->digest())) continue;
+
+		qCWarning(log_downloader) << "Banned" << remote->displayName() << "for sending corrupted chunks";   // FIXME: #83
+		foreach(QByteArray ct_hash, requested_chunks_)
+			removeRequests(down_chunks_.value(ct_hash), remote);
+		foreach(QByteArray ct_hash, remote_chunks_.value(remote))
+			updateRequestable(down_chunks_.value(ct_hash));
+	}
+
+	updateRequestable(chunk);
+}
+
+void Downloader::chunkWriteFailed(const DownloadChunkPtr& chunk) {
+	// Our disk has failed, not the peers. The chunk is started over and nobody is blamed.
+	qCWarning(log_downloader) << "Chunk" << ct_hash_readable(chunk->ct_hash) << "could not be written to disk, discarding it";   // FIXME: #83
+	cancelRequests(chunk);
+	chunk->block_sources.clear();
+	if(chunk->builder)
+		discardChunk(chunk);
+
+	updateRequestable(chunk);
+	scheduleMaintain();
+}
+
+void Downloader::cancelRequests(const DownloadChunkPtr& chunk) {
+	for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end(); ++request_it) {
+		request_it.key()->cancel_block(conv_bytearray(chunk->ct_hash), request_it->offset, request_it->size);
+		request_it.key()->request_window().requestCancelled();
+	}
+	releaseSlots(chunk->requests.size());
+	QList<RemoteFolder*> remotes = chunk->requests.uniqueKeys();
+	chunk->requests.clear();
+	requested_chunks_.remove(chunk->ct_hash);
+	for(RemoteFolder* remote : remotes)
+		windowFreed(remote);
+}
+
+void Downloader::scheduleMaintain() {
+	// Coalesce notifications (e.g. a whole remote bitfield) into a single scheduling pass
+	if(maintain_scheduled_) return;
+	maintain_scheduled_ = true;
+	QTimer::singleShot(0, this, &Downloader::maintainRequests);
 }
 
 void Downloader::maintainRequests() {
 	SCOPELOG(log_downloader);
+	maintain_scheduled_ = false;
 
 	// Prune old requests by timeout
 	{
 		auto request_timeout = std::chrono::seconds(Config::get()->getGlobal("p2p_request_timeout").toUInt());
-		foreach(DownloadChunkPtr missing_chunk, down_chunks_.values()) {
+		auto now = std::chrono::steady_clock::now();
+		foreach(QByteArray ct_hash, requested_chunks_) {
+			DownloadChunkPtr missing_chunk = down_chunks_.value(ct_hash);
+			if(! missing_chunk) continue;
+
+			bool pruned = false;
 			QMutableHashIterator<RemoteFolder*, DownloadChunk::BlockRequest> request_it(missing_chunk->requests);
 			while(request_it.hasNext()) {
-				if(request_it.next().value().started + request_timeout < std::chrono::steady_clock::now())
+				if(request_it.next().value().started + request_timeout < now) {
+					request_it.key()->request_window().requestTimedOut();
+					releaseSlots();
+					windowFreed(request_it.key());
 					request_it.remove();
+					pruned = true;
+				}
 			}
+			if(pruned)
+				requestsRemoved(missing_chunk);
 		}
 	}
 
-	// Make new requests
-	{
-		for(size_t i = countRequests(); i < Config::get()->getGlobal("p2p_download_slots").toUInt(); i++) {
-			bool requested = requestOne();
-			if(!requested) break;
+	// New requests are made by the scheduler, when it is our turn and the daemon-wide budget allows
+	if(scheduler_ && std::any_of(remotes_.begin(), remotes_.end(), [this](RemoteFolder* remote){return canRequestFrom(remote);}))
+		scheduler_->wakeup(this);
+
+	// Endgame: only a few chunks are left, so the tail must not wait for the slowest peer
+	if((size_t)down_chunks_.size() <= Config::get()->getGlobal("p2p_endgame_threshold").toUInt())
+		requestEndgame();
+
+	// Wake up, when a rate limited remote may be asked again
+	if(! limiter_wakeup_scheduled_) {
+		auto min_delay = BandwidthLimiter::clock::duration::max();
+		foreach(RemoteFolder* remote, remotes_) {
+			if(remote->ready() && !remote->peer_choking() && remote->request_window().hasFreeSlot())
+				min_delay = std::min(min_delay, remote->limiter()->delay(BandwidthLimiter::DOWNLOAD));
+		}
+		if(min_delay != BandwidthLimiter::clock::duration::max() && min_delay > BandwidthLimiter::clock::duration::zero()) {
+			limiter_wakeup_scheduled_ = true;
+			QTimer::singleShot(std::chrono::duration_cast<std::chrono::milliseconds>(min_delay).count() + 1, this, [this]{
+				limiter_wakeup_scheduled_ = false;
+				scheduleMaintain();
+			});
 		}
 	}
 }
 
-bool Downloader::requestOne() {
+void Downloader::requestEndgame() {
 	SCOPELOG(log_downloader);
-	// Try to choose chunk to request
-	foreach(QByteArray ct_hash, download_queue_.chunks()) {
-		// Try to choose a remote to request this block from
-		auto remote = nodeForRequest(ct_hash);
-		if(! remote) continue;
 
+	auto now = std::chrono::steady_clock::now();
+	foreach(QByteArray ct_hash, requested_chunks_) {
 		DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+		if(! chunk || chunk->single_source) continue;
 
-		// Rebuild request map to determine, which block to download now.
-		AvailabilityMap<uint32_t> request_map = chunk->requestMap();
-
-		// Request, actually
-		if(!request_map.full()) {
-			DownloadChunk::BlockRequest request;
-			request.offset = request_map.begin()->first;
-			request.size = std::min(request_map.begin()->second, uint32_t(Config::get()->getGlobal("p2p_block_size").toUInt()));
-			request.started = std::chrono::steady_clock::now();
-
-			remote->request_block(conv_bytearray(ct_hash), request.offset, request.size);
-			chunk->requests.insert(remote, request);
-			return true;
+		// Duplicate every outstanding request to other owners with free window slots. The first reply wins, others are cancelled in putBlock().
+		foreach(const DownloadChunk::BlockRequest& request, chunk->requests.values()) {
+			foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+				if(scheduler_ && !scheduler_->hasFreeSlot()) return;  // Duplicates take slots from the shared budget too
+				if(! canRequestFrom(owner_remote)) continue;
+
+				bool requested_already = false;
+				for(auto other_it = chunk->requests.constFind(owner_remote); other_it != chunk->requests.constEnd() && other_it.key() == owner_remote; ++other_it)
+					requested_already |= (other_it->offset == request.offset && other_it->size == request.size);
+				if(requested_already) continue;
+
+				DownloadChunk::BlockRequest duplicate = request;
+				duplicate.started = now;
+
+				owner_remote->request_block(conv_bytearray(ct_hash), duplicate.offset, duplicate.size);
+				addRequest(chunk, owner_remote, duplicate);
+			}
 		}
 	}
-	return false;
+}
+
+quint32 Downloader::requestOne() {
+	SCOPELOG(log_downloader);
+	// Try to choose chunk to request, and a remote to request this block from. Chunks, whose owners have full request windows, are parked.
+	// When too many chunks are in progress, only those are continued.
+	RemoteFolder* remote = nullptr;
+	QByteArray ct_hash;
+	DownloadChunkPtr chunk;
+	AvailabilityMap<uint32_t> request_map(0);
+	for(;;) {
+		QList<DownloadChunkPtr> skipped;
+		ct_hash = download_queue_.findRequestable([&](const QByteArray& candidate){
+			remote = nodeForRequest(candidate);
+			if(! remote)
+				skipped << down_chunks_.value(candidate);
+			return remote != nullptr;
+		}, !canStartChunk());
+
+		// Not while the queue is iterated, parking reorders it
+		for(auto& skipped_chunk : skipped)
+			parkIfWindowsFull(skipped_chunk);
+
+		if(ct_hash.isEmpty())
+			return 0;
+
+		chunk = down_chunks_.value(ct_hash);
+
+		// Rebuild request map to determine, which block to download now.
+		request_map = chunk->requestMap();
+		if(! request_map.full()) break;
+
+		updateRequestable(chunk);   // Stale "requestable" flag, retry
+	}
+
+	if(! chunk->builder)
+		startChunk(chunk);
+
+	// Request, actually
+	DownloadChunk::BlockRequest request;
+	request.offset = request_map.begin()->first;
+	request.size = std::min(request_map.begin()->second, remote->request_window().blockSize());
+	request.started = std::chrono::steady_clock::now();
+
+	remote->request_block(conv_bytearray(ct_hash), request.offset, request.size);
+	addRequest(chunk, remote, request);
+	updateRequestable(chunk);
+	return request.size;
+}
+
+void Downloader::releaseSlots(quint32 count) {
+	if(scheduler_ && count > 0)
+		scheduler_->releaseSlots(this, count);
+}
+
+bool Downloader::canStartChunk() const {
+	return builders_count_ < Config::get()->getGlobal("p2p_download_builders_max").toUInt();
+}
+
+void Downloader::startChunk(const DownloadChunkPtr& chunk) {
+	// Small chunks are built in memory, unless there is a partial file to resume
+	bool in_memory = chunk->size <= Config::get()->getGlobal("p2p_download_memory_chunk_max").toUInt()
+		&& !QFile::exists(ChunkFileBuilder::location(params_.system_path, chunk->ct_hash));
+	chunk->builder = std::make_unique<ChunkFileBuilder>(params_.system_path, chunk->ct_hash, chunk->size, in_memory);
+	chunk->write_failed = std::make_shared<std::atomic<bool>>(false);
+	builders_count_++;
+	download_queue_.markStarted(chunk->ct_hash);
+}
+
+void Downloader::discardChunk(const DownloadChunkPtr& chunk) {
+	// Pending writes must not recreate the files
+	std::shared_ptr<ChunkFileBuilder> builder(std::move(chunk->builder));
+	retiring_.insert(chunk->ct_hash);
+
+	QByteArray ct_hash = chunk->ct_hash;
+	io_->post(ct_hash, [=]{builder->discard();}, this, [=]{
+		retiring_.remove(ct_hash);
+		builders_count_--;
+		updateRequestable(down_chunks_.value(ct_hash));
+		scheduleMaintain();
+	});
 }
 
 RemoteFolder* Downloader::nodeForRequest(QByteArray ct_hash) {
@@ -300,17 +770,53 @@ RemoteFolder* Downloader::nodeForRequest(QByteArray ct_hash) {
 	if(! chunk)
 		return nullptr;
 
-	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys())
-		if(owner_remote->ready() && !owner_remote->peer_choking()) return owner_remote; // TODO: implement more smart peer selection algorithm, based on peer weights.
+	// A chunk, that failed verification, is continued from the peer, that already sent its blocks. Other owners are used only if it is gone.
+	if(chunk->single_source) {
+		QSet<QByteArray> sources = chunk->block_sources.values().toSet();
+		foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+			if(chunk->requests.contains(owner_remote) || sources.contains(owner_remote->digest()))
+				return canRequestFrom(owner_remote) ? owner_remote : nullptr;
+		}
+	}
+
+	// The owner, that is expected to deliver the block first. This spreads blocks across peers proportionally to their throughput.
+	// Peers, that have sent corrupted data, look slower than they are.
+	RemoteFolder* best_remote = nullptr;
+	RequestWindow::clock::duration best_delivery = RequestWindow::clock::duration::max();
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+		if(! canRequestFrom(owner_remote)) continue;
+
+		auto delivery = std::chrono::duration_cast<RequestWindow::clock::duration>(
+			owner_remote->request_window().expectedDelivery() * reputation_.penalty(owner_remote->digest()));
+		if(delivery < best_delivery) {
+			best_remote = owner_remote;
+			best_delivery = delivery;
+		}
+	}
+	return best_remote;
+}
 
-	return nullptr;
+bool Downloader::canRequestFrom(RemoteFolder* remote) const {
+	return remote->ready() && !remote->peer_choking() && remote->request_window().hasFreeSlot() && !reputation_.banned(remote->digest())
+		&& remote->limiter()->delay(BandwidthLimiter::DOWNLOAD) == BandwidthLimiter::clock::duration::zero();
 }
 
-size_t Downloader::countRequests() const {
-	size_t requests = 0;
-	foreach(DownloadChunkPtr chunk, down_chunks_.values())
-		requests += chunk->requests.size();
-	return requests;
+RequestWindow::Limits Downloader::windowLimits() const {
+	RequestWindow::Limits limits;
+	limits.adaptive = Config::get()->getGlobal("p2p_adaptive_transfer").toBool();
+
+	limits.window_initial = Config::get()->getGlobal("p2p_download_slots").toUInt();
+	limits.block_initial = Config::get()->getGlobal("p2p_block_size").toUInt();
+	if(limits.adaptive) {
+		limits.window_min = Config::get()->getGlobal("p2p_download_window_min").toUInt();
+		limits.window_max = Config::get()->getGlobal("p2p_download_window_max").toUInt();
+		limits.block_min = Config::get()->getGlobal("p2p_block_size_min").toUInt();
+		limits.block_max = Config::get()->getGlobal("p2p_block_size_max").toUInt();
+	}else{
+		limits.window_min = limits.window_max = limits.window_initial;
+		limits.block_min = limits.block_max = limits.block_initial;
+	}
+	return limits;
 }
 
 } /* namespace librevault */
@@ -28,16 +28,21 @@
  */
 #pragma once
 #include "downloader/ChunkFileBuilder.h"
+#include "downloader/PeerReputation.h"
 #include "downloader/WeightedChunkQueue.h"
+#include "TransferScheduler.h"
 #include "folder/RemoteFolder.h"
 #include "util/AvailabilityMap.h"
 #include "blob.h"
 #include "util/log.h"
 #include <QList>
+#include <QMap>
+#include <QPointer>
 #include <QTimer>
 #include <boost/bimap.hpp>
 #include <boost/bimap/multiset_of.hpp>
 #include <boost/bimap/unordered_set_of.hpp>
+#include <atomic>
 #include <chrono>
 
 #define CLUSTERED_COEFFICIENT 10.0f
@@ -49,11 +54,21 @@ namespace librevault {
 class FolderParams;
 class MetaStorage;
 class ChunkStorage;
+class ChunkIOService;
 
 struct DownloadChunk : boost::noncopyable {
-	DownloadChunk(const FolderParams& params, QByteArray ct_hash, quint32 size);
+	DownloadChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type);
 
-	ChunkFileBuilder builder;
+	std::unique_ptr<ChunkFileBuilder> builder;  // Created lazily, when the first block is requested
+	std::shared_ptr<std::atomic<bool>> write_failed;    // Set on ChunkIOService, if a block of this builder could not be written
+	const quint32 size;
+	const Meta::StrongHashType strong_hash_type;
+
+	/* Verification */
+	QMap<uint32_t, QByteArray> block_sources;   // Block offset -> digest of the peer, that sent it
+	bool single_source = false;                 // Set after a corrupted attempt, so that the next failure points to exactly one peer
+
+	bool window_parked = false;     // All owners had full request windows, when requestOne() came across it
 
 	AvailabilityMap<uint32_t> requestMap();
 
@@ -74,12 +89,14 @@ using DownloadChunkPtr = std::shared_ptr<DownloadChunk>;
 class Downloader : public QObject {
 	Q_OBJECT
 signals:
-	void chunkDownloaded(QByteArray ct_hash, QFile* chunk_f);
+	void chunkDownloaded(QByteArray ct_hash, QFile* chunk_f, QByteArray chunk);    // chunk_f is null, if the chunk was built in memory
 
 public:
-	Downloader(const FolderParams& params, MetaStorage* meta_storage, QObject* parent);
+	Downloader(const FolderParams& params, MetaStorage* meta_storage, ChunkIOService* io, TransferScheduler* scheduler, QObject* parent);
 	~Downloader();
 
+	QList<QByteArray> incompletePaths() const {return files_.keys();}
+
 public slots:
 	void notifyLocalMeta(const SignedMeta& smeta, const bitfield_type& bitfield);
 	void notifyLocalChunk(const blob& ct_hash);
@@ -95,30 +112,92 @@ public slots:
 	void trackRemote(RemoteFolder* remote);
 	void untrackRemote(RemoteFolder* remote);
 
+	void pruneIncomplete();  // Removes partial chunks, left from previous runs, that are not needed anymore
+	void prioritizeFile(QByteArray path_id);   // Downloads this file before anything else
+
+public:
+	const PeerReputation& reputation() const {return reputation_;}
+
+	/* TransferScheduler interface */
+	void maintainRequests();
+	quint32 requestOne();   // Requests one block. Returns its size, 0 if nothing can be requested now.
+
 private:
 	const FolderParams& params_;
 	MetaStorage* meta_storage_;
+	ChunkIOService* io_;
 
 	QHash<QByteArray, DownloadChunkPtr> down_chunks_;
 	WeightedChunkQueue download_queue_;
 
-	size_t countRequests() const;
+	/* Request bookkeeping */
+	QSet<QByteArray> requested_chunks_;     // Chunks with outstanding requests, so that pruning doesn't walk the whole queue
+	size_t builders_count_ = 0;             // Chunks with a ChunkFileBuilder (and an "incomplete-*" file)
+	QSet<QByteArray> retiring_;             // Chunks, whose builder is still verified or discarded on ChunkIOService. Not restarted until it is done
+	QSet<QByteArray> storing_;              // Verified chunks, handed to ChunkStorage. Not requested until they are stored or removed
 
-	/* Request process */
-	QTimer* maintain_timer_;
+	void addRequest(const DownloadChunkPtr& chunk, RemoteFolder* remote, DownloadChunk::BlockRequest request);
+	void removeRequests(const DownloadChunkPtr& chunk, RemoteFolder* remote);
+	void requestsRemoved(const DownloadChunkPtr& chunk);
 
-	void maintainRequests();
-	bool requestOne();
+	void updateRequestable(const DownloadChunkPtr& chunk);
+
+	/* Chunks are parked, when every owner has a full request window, so that requestOne() doesn't scan over them again and again.
+	 * They are requestable again, as soon as one of their owners has a free slot. */
+	QHash<RemoteFolder*, QSet<QByteArray>> window_parked_;
+
+	bool parkIfWindowsFull(const DownloadChunkPtr& chunk);
+	void windowFreed(RemoteFolder* remote);
+
+	/* Incomplete files and their missing chunks, as a bipartite graph. Used for clustering, priorities and "complete files first". */
+	struct DownloadFile {
+		int chunks_total = 0;
+		QSet<QByteArray> missing_chunks;
+		int priority = 0;
+		bool immediate = false;
+		bool clustered = false;     // Missing chunks are marked clustered already
+
+		float completion() const;
+	};
+	QHash<QByteArray, DownloadFile> files_;             // path_id -> incomplete file
+	QHash<QByteArray, QSet<QByteArray>> chunk_files_;   // ct_hash -> path_ids of incomplete files, containing this chunk
+	QSet<QByteArray> immediate_paths_;                  // Prioritized by the user, possibly before their Meta arrives
+
+	void removeFile(const QByteArray& path_id);
+	void advanceFiles(const QByteArray& ct_hash);
+	void markCluster(const QByteArray& ct_hash);
+	void updateFileWeight(const QByteArray& ct_hash);
+
+	/* Verification */
+	PeerReputation reputation_;
+
+	void verifyChunk(const DownloadChunkPtr& chunk);
+	void chunkVerified(QByteArray ct_hash, QFile* chunk_f, QByteArray chunk_data, bool write_failed);
+	void chunkCorrupted(const DownloadChunkPtr& chunk);
+	void chunkWriteFailed(const DownloadChunkPtr& chunk);
+	void cancelRequests(const DownloadChunkPtr& chunk);
+
+	/* Request process */
+	QPointer<TransferScheduler> scheduler_;
+	bool maintain_scheduled_ = false;
+	bool limiter_wakeup_scheduled_ = false;
+
+	void scheduleMaintain();
+	void releaseSlots(quint32 count = 1);
+	bool canStartChunk() const;
+	void startChunk(const DownloadChunkPtr& chunk);
+	void discardChunk(const DownloadChunkPtr& chunk);
+	void requestEndgame();
 	RemoteFolder* nodeForRequest(QByteArray ct_hash);
+	bool canRequestFrom(RemoteFolder* remote) const;
+	RequestWindow::Limits windowLimits() const;
 
-	void addChunk(QByteArray ct_hash, quint32 size);
+	void addChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type);
 	void removeChunk(QByteArray ct_hash);
 
 	/* Node management */
 	QSet<RemoteFolder*> remotes_;
-
-	QSet<QByteArray> getCluster(QByteArray ct_hash);
-	QSet<QByteArray> getMetaCluster(QList<QByteArray> ct_hashes);
+	QHash<RemoteFolder*, QSet<QByteArray>> remote_chunks_;  // Per-remote candidate sets: missing chunks, owned by the remote
 };
 
 } /* namespace librevault */
@@ -0,0 +1,198 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "IndexDigest.h"
+#include "control/Config.h"
+#include "folder/chunk/ChunkStorage.h"
+#include "folder/meta/MetaStorage.h"
+#include "p2p/V1Extensions.h"
+#include <QCryptographicHash>
+#include <QtEndian>
+
+namespace librevault {
+
+IndexDigest::IndexDigest(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent) :
+	QObject(parent),
+	meta_storage_(meta_storage),
+	chunk_storage_(chunk_storage) {
+	connect(meta_storage_, &MetaStorage::metaAdded, this, &IndexDigest::update);
+	connect(chunk_storage_, &ChunkStorage::chunkAdded, this, &IndexDigest::addChunk);
+}
+
+QVector<quint64> IndexDigest::digests() {
+	int bucket_count = Config::get()->getGlobal("p2p_index_digest_buckets").toInt();
+	if(digests_.size() != bucket_count)
+		rebuild(bucket_count);
+	else
+		flushDirty();
+	return digests_;
+}
+
+QSet<int> IndexDigest::mismatched(const QVector<quint64>& remote_digests) {
+	QVector<quint64> local_digests = digests();
+
+	QSet<int> buckets;
+	for(int i = 0; i < local_digests.size(); i++) {
+		if(remote_digests.size() != local_digests.size() || local_digests[i] != remote_digests[i])
+			buckets << i;
+	}
+	return buckets;
+}
+
+QList<SignedMeta> IndexDigest::metaInBuckets(const QSet<int>& buckets) {
+	QList<SignedMeta> metas;
+	for(int bucket_idx : buckets) {
+		if(bucket_idx < 0 || bucket_idx >= bucket_paths_.size()) continue;
+		for(const QByteArray& path_id : bucket_paths_[bucket_idx]) {
+			try {
+				metas << meta_storage_->getMeta(conv_bytearray(path_id));
+			}catch(MetaStorage::no_such_meta& e){}
+		}
+	}
+	return metas;
+}
+
+void IndexDigest::rebuild(int bucket_count) {
+	digests_.fill(0, bucket_count);
+	bucket_paths_.fill(QSet<QByteArray>(), bucket_count);
+	entries_.clear();
+	incomplete_.clear();
+	chunk_paths_.clear();
+	dirty_.clear();
+	for(auto& smeta : meta_storage_->getMeta())
+		update(smeta);
+}
+
+void IndexDigest::update(const SignedMeta& smeta) {
+	if(digests_.isEmpty()) return;  // Not built yet, digests() reads the whole index anyway
+
+	Meta::PathRevision revision = smeta.meta().path_revision();
+	QByteArray path_id = conv_bytearray(revision.path_id_);
+	untrackIncomplete(path_id);
+
+	bitfield_type bitfield = chunk_storage_->make_bitfield(smeta.meta());
+	setEntry(revision, bitfield);
+
+	// Its chunks are looked up here once, then chunkAdded() only flips bits
+	IncompleteEntry entry;
+	for(size_t chunk_idx = 0; chunk_idx < bitfield.size(); chunk_idx++) {
+		if(bitfield[chunk_idx]) continue;
+		QByteArray ct_hash = conv_bytearray(smeta.meta().chunks()[chunk_idx].ct_hash);
+		entry.missing_chunks[ct_hash] << int(chunk_idx);
+		chunk_paths_[ct_hash].insert(path_id);
+	}
+	if(entry.missing_chunks.isEmpty()) return;
+
+	entry.revision = revision;
+	entry.bitfield = std::move(bitfield);
+	incomplete_.insert(path_id, std::move(entry));
+}
+
+void IndexDigest::addChunk(const blob& ct_hash) {
+	auto paths_it = chunk_paths_.find(conv_bytearray(ct_hash));
+	if(paths_it == chunk_paths_.end()) return;
+	QSet<QByteArray> path_ids = std::move(paths_it.value());
+	chunk_paths_.erase(paths_it);
+
+	for(const QByteArray& path_id : path_ids) {
+		auto entry_it = incomplete_.find(path_id);
+		if(entry_it == incomplete_.end()) continue;
+
+		for(int chunk_idx : entry_it->missing_chunks.take(conv_bytearray(ct_hash)))
+			entry_it->bitfield[chunk_idx] = true;
+		dirty_.insert(path_id);
+	}
+}
+
+void IndexDigest::flushDirty() {
+	for(const QByteArray& path_id : dirty_) {
+		auto entry_it = incomplete_.find(path_id);
+		if(entry_it == incomplete_.end()) continue;
+
+		setEntry(entry_it->revision, entry_it->bitfield);
+		if(entry_it->missing_chunks.isEmpty())
+			incomplete_.erase(entry_it);    // Complete, nothing will change until the next revision
+	}
+	dirty_.clear();
+}
+
+void IndexDigest::untrackIncomplete(const QByteArray& path_id) {
+	dirty_.remove(path_id);
+
+	auto entry_it = incomplete_.find(path_id);
+	if(entry_it == incomplete_.end()) return;
+
+	for(auto chunk_it = entry_it->missing_chunks.begin(); chunk_it != entry_it->missing_chunks.end(); ++chunk_it) {
+		auto paths_it = chunk_paths_.find(chunk_it.key());
+		if(paths_it == chunk_paths_.end()) continue;
+		paths_it->remove(path_id);
+		if(paths_it->isEmpty())
+			chunk_paths_.erase(paths_it);
+	}
+	incomplete_.erase(entry_it);
+}
+
+void IndexDigest::setEntry(const Meta::PathRevision& revision, const bitfield_type& bitfield) {
+	QByteArray path_id = conv_bytearray(revision.path_id_);
+	int bucket_idx = bucket(revision.path_id_, digests_.size());
+
+	quint64 entry_hash = hash(revision, bitfield);
+	auto entry_it = entries_.find(path_id);
+	if(entry_it != entries_.end()) {
+		digests_[bucket_idx] ^= entry_it.value();
+		entry_it.value() = entry_hash;
+	}else{
+		entries_.insert(path_id, entry_hash);
+		bucket_paths_[bucket_idx].insert(path_id);
+	}
+	digests_[bucket_idx] ^= entry_hash;
+}
+
+int IndexDigest::bucket(const blob& path_id, int bucket_count) {
+	if(path_id.size() < sizeof(quint32) || bucket_count <= 0) return 0;
+	return qFromBigEndian<quint32>(path_id.data()) % bucket_count;    // path_id is a hash already
+}
+
+quint64 IndexDigest::hash(const Meta::PathRevision& revision, const bitfield_type& bitfield) {
+	QCryptographicHash hasher(QCryptographicHash::Sha1);
+	hasher.addData((const char*)revision.path_id_.data(), revision.path_id_.size());
+
+	uchar revision_le[sizeof(qint64)];
+	qToLittleEndian<qint64>(revision.revision_, revision_le);
+	hasher.addData((const char*)revision_le, sizeof(revision_le));
+
+	for(quint32 run : V1Extensions::encode_runs(bitfield)) {
+		uchar run_le[sizeof(quint32)];
+		qToLittleEndian<quint32>(run, run_le);
+		hasher.addData((const char*)run_le, sizeof(run_le));
+	}
+
+	return qFromLittleEndian<quint64>((const uchar*)hasher.result().constData());
+}
+
+} /* namespace librevault */
@@ -0,0 +1,86 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <librevault/SignedMeta.h>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QVector>
+
+namespace librevault {
+
+class MetaStorage;
+class ChunkStorage;
+
+/* IndexDigest summarizes the index as buckets of path_id, each holding the XOR of hashes of its (path_id, revision, bitfield) entries.
+ * Remotes exchange it on connect, and send each other HAVE_META only for the buckets that differ. An unchanged reconnect costs one digest.
+ * It is built from the whole index once, and then kept up to date entry by entry, as Meta and chunks are added. Bitfields of incomplete files are
+ * kept in memory, so that an added chunk only flips its bits. Their entries are rehashed lazily, when the digest is read. */
+class IndexDigest : public QObject {
+	Q_OBJECT
+public:
+	IndexDigest(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent);
+
+	QVector<quint64> digests();     // Rebuilt only, if the bucket count has changed. Otherwise, only the changed entries are rehashed.
+
+	QSet<int> mismatched(const QVector<quint64>& remote_digests);   // Every bucket, if the remote uses a different bucket count
+	QList<SignedMeta> metaInBuckets(const QSet<int>& buckets);
+
+private:
+	MetaStorage* meta_storage_;
+	ChunkStorage* chunk_storage_;
+
+	QVector<quint64> digests_;
+	QHash<QByteArray, quint64> entries_;    // path_id -> hash, that is XOR'ed into its bucket now
+	QVector<QSet<QByteArray>> bucket_paths_;
+
+	struct IncompleteEntry {
+		Meta::PathRevision revision;
+		bitfield_type bitfield;
+		QHash<QByteArray, QVector<int>> missing_chunks;     // ct_hash -> its indexes in bitfield
+	};
+	QHash<QByteArray, IncompleteEntry> incomplete_;     // path_id -> entry
+	QHash<QByteArray, QSet<QByteArray>> chunk_paths_;   // ct_hash -> path_ids of incomplete entries, that miss it
+	QSet<QByteArray> dirty_;                            // path_ids, whose bitfield has changed since they were hashed
+
+	void rebuild(int bucket_count);
+	void update(const SignedMeta& smeta);
+	void addChunk(const blob& ct_hash);
+	void flushDirty();
+
+	void setEntry(const Meta::PathRevision& revision, const bitfield_type& bitfield);
+	void untrackIncomplete(const QByteArray& path_id);
+
+	static int bucket(const blob& path_id, int bucket_count);
+	static quint64 hash(const Meta::PathRevision& revision, const bitfield_type& bitfield);
+};
+
+} /* namespace librevault */
@@ -31,22 +31,69 @@
 #include "folder/FolderGroup.h"
 #include "folder/RemoteFolder.h"
 #include "folder/meta/MetaStorage.h"
+#include "control/Config.h"
+#include "control/FolderParams.h"
+#include "folder/meta/MetaDelta.h"
+#include "p2p/V1Extensions.h"
 
 namespace librevault {
 
-MetaDownloader::MetaDownloader(MetaStorage* meta_storage, Downloader* downloader, QObject* parent) :
+namespace {
+constexpr int META_REQUEST_ATTEMPTS = 3;
+} /* namespace */
+
+MetaDownloader::MetaDownloader(const FolderParams& params, MetaStorage* meta_storage, Downloader* downloader, QObject* parent) :
 	QObject(parent),
+	params_(params),
 	meta_storage_(meta_storage),
 	downloader_(downloader) {
 	LOGFUNC();
+
+	expire_timer_ = new QTimer(this);
+	expire_timer_->setSingleShot(true);
+	expire_timer_->setInterval(Config::get()->getGlobal("p2p_meta_request_timeout").toInt()*1000);
+	connect(expire_timer_, &QTimer::timeout, this, &MetaDownloader::expire_requests);
+
+	connect(meta_storage_, &MetaStorage::metaAdded, this, &MetaDownloader::handle_meta_added);
+}
+
+void MetaDownloader::handle_handshake(RemoteFolder* remote) {
+	if(! remote->supports(V1Extensions::WATERMARK)) return;
+
+	connect(remote, &QObject::destroyed, this, [=]{
+		requested_.remove(remote);
+		pending_upto_.remove(remote);
+		watermark_lost_.remove(remote);
+	});
+	watermark_lost_.remove(remote);
+
+	// The remote sends only the changes after our watermark, plus the bitfields of the files, we are still downloading
+	QPair<QByteArray, quint64> watermark = meta_storage_->peerWatermark(remote->digest());
+	QList<QByteArray> incomplete_path_ids = downloader_->incompletePaths();
+	if(incomplete_path_ids.size() > Config::get()->getGlobal("p2p_index_incomplete_max").toInt())
+		watermark = {};     // Too many to list, asking for everything instead
+	if(watermark.first.isEmpty())
+		incomplete_path_ids.clear();
+
+	remote->post_index_since(watermark.first, watermark.second, incomplete_path_ids);
+}
+
+void MetaDownloader::handle_index_upto(RemoteFolder* remote, const QByteArray& log_id, quint64 seq) {
+	pending_upto_[remote] = {log_id, seq};
+	maybe_commit_watermark(remote);
 }
 
 void MetaDownloader::handle_have_meta(RemoteFolder* origin, const Meta::PathRevision& revision, const bitfield_type& bitfield) {
 	if(meta_storage_->haveMeta(revision))
 		downloader_->notifyRemoteMeta(origin, revision, bitfield);
-	else if(meta_storage_->putAllowed(revision))
-		origin->request_meta(revision);
-	else
+	else if(meta_storage_->putAllowed(revision)) {
+		if(origin->supports(V1Extensions::WATERMARK)) {
+			requested_[origin].insert(conv_bytearray(revision.path_id_), {revision.revision_, std::chrono::steady_clock::now()});
+			if(! expire_timer_->isActive())
+				expire_timer_->start();
+		}
+		request_meta(origin, revision);
+	}else
 		LOGD("Remote node notified us about an expired Meta");
 }
 
@@ -56,6 +103,110 @@ void MetaDownloader::handle_meta_reply(RemoteFolder* origin, const SignedMeta& s
 		downloader_->notifyRemoteMeta(origin, smeta.meta().path_revision(), bitfield);
 	}else
 		LOGD("Remote node posted to us about an expired Meta");
+
+	auto requested_it = requested_.find(origin);
+	if(requested_it != requested_.end()) {
+		requested_it->remove(conv_bytearray(smeta.meta().path_id()));
+		maybe_commit_watermark(origin);
+	}
+}
+
+void MetaDownloader::handle_meta_delta(RemoteFolder* origin, const MetaDelta& delta, const bitfield_type& bitfield) {
+	SignedMeta smeta;
+	try {
+		SignedMeta base = meta_storage_->getMeta(delta.revision.path_id_);
+		if(base.meta().revision() != delta.base_revision) throw MetaDelta::delta_error();
+		smeta = delta.apply(base.raw_meta(), params_.secret);
+	}catch(std::exception& e) {
+		// Our base has changed meanwhile, or the delta is broken. The full Meta is asked for instead.
+		LOGD("Meta delta is not applied: " << e.what());
+		if(meta_storage_->putAllowed(delta.revision))
+			origin->request_meta(delta.revision);
+		else if(requested_.contains(origin)) {
+			requested_[origin].remove(conv_bytearray(delta.revision.path_id_));
+			maybe_commit_watermark(origin);
+		}
+		return;
+	}
+
+	handle_meta_reply(origin, smeta, bitfield);
+}
+
+void MetaDownloader::request_meta(RemoteFolder* origin, const Meta::PathRevision& revision) {
+	// A big file, that we have an older revision of, is asked for as a delta against it
+	if(origin->supports(V1Extensions::META_DELTA)) {
+		try {
+			SignedMeta base = meta_storage_->getMeta(revision.path_id_);
+			if(base.meta().chunks().size() >= params_.meta_delta_chunks_min) {
+				origin->request_meta_delta(revision, base.meta().revision());
+				return;
+			}
+		}catch(MetaStorage::no_such_meta& e){}
+	}
+	origin->request_meta(revision);
+}
+
+void MetaDownloader::maybe_commit_watermark(RemoteFolder* remote) {
+	if(watermark_lost_.contains(remote)) {
+		pending_upto_.remove(remote);
+		return;
+	}
+	if(!pending_upto_.contains(remote) || !requested_.value(remote).isEmpty()) return;
+
+	QPair<QByteArray, quint64> watermark = pending_upto_.take(remote);
+	meta_storage_->setPeerWatermark(remote->digest(), watermark.first, watermark.second);
+}
+
+void MetaDownloader::handle_meta_added(const SignedMeta& smeta) {
+	// Received from another remote, or indexed locally
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+	foreach(RemoteFolder* remote, requested_.keys()) {
+		auto requested_it = requested_[remote].find(path_id);
+		if(requested_it == requested_[remote].end() || requested_it->revision > smeta.meta().revision()) continue;
+
+		requested_[remote].erase(requested_it);
+		maybe_commit_watermark(remote);
+	}
+}
+
+void MetaDownloader::expire_requests() {
+	auto timeout = std::chrono::seconds(Config::get()->getGlobal("p2p_meta_request_timeout").toUInt());
+	auto now = std::chrono::steady_clock::now();
+
+	bool pending = false;
+	foreach(RemoteFolder* remote, requested_.keys()) {
+		int expired = 0;
+		for(auto requested_it = requested_[remote].begin(); requested_it != requested_[remote].end();) {
+			if(requested_it->started + timeout > now) {
+				++requested_it;
+				continue;
+			}
+
+			// The watermark must not pass the sequence number, at which this path was announced
+			Meta::PathRevision revision;
+			revision.path_id_ = conv_bytearray(requested_it.key());
+			revision.revision_ = requested_it->revision;
+			if(requested_it->attempts < META_REQUEST_ATTEMPTS && meta_storage_->putAllowed(revision)) {
+				requested_it->attempts++;
+				requested_it->started = now;
+				request_meta(remote, revision);
+				++requested_it;
+				continue;
+			}
+
+			if(meta_storage_->putAllowed(revision))
+				watermark_lost_.insert(remote);
+			requested_it = requested_[remote].erase(requested_it);
+			expired++;
+		}
+		if(expired > 0) {
+			LOGD("Forgot " << expired << " unanswered Meta requests to " << remote->displayName());
+			maybe_commit_watermark(remote);
+		}
+		pending |= !requested_[remote].isEmpty();
+	}
+	if(pending)
+		expire_timer_->start();
 }
 
 } /* namespace librevault */
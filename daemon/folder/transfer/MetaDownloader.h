@@ -30,27 +30,56 @@
 #include "util/log.h"
 #include <librevault/SignedMeta.h>
 #include <librevault/util/conv_bitfield.h>
+#include <QHash>
 #include <QObject>
+#include <QSet>
+#include <QTimer>
+#include <chrono>
 
 namespace librevault {
 
+class FolderParams;
 class RemoteFolder;
 class MetaStorage;
+class MetaDelta;
 class Downloader;
 
 class MetaDownloader : public QObject {
 	Q_OBJECT
 	LOG_SCOPE("MetaDownloader");
 public:
-	MetaDownloader(MetaStorage* meta_storage, Downloader* downloader, QObject* parent);
+	MetaDownloader(const FolderParams& params, MetaStorage* meta_storage, Downloader* downloader, QObject* parent);
 
 	/* Message handlers */
+	void handle_handshake(RemoteFolder* remote);
+	void handle_index_upto(RemoteFolder* remote, const QByteArray& log_id, quint64 seq);
 	void handle_have_meta(RemoteFolder* origin, const Meta::PathRevision& revision, const bitfield_type& bitfield);
 	void handle_meta_reply(RemoteFolder* origin, const SignedMeta& smeta, const bitfield_type& bitfield);
+	void handle_meta_delta(RemoteFolder* origin, const MetaDelta& delta, const bitfield_type& bitfield);
 
 private:
+	const FolderParams& params_;
 	MetaStorage* meta_storage_;
 	Downloader* downloader_;
+
+	/* Watermarks */
+	struct RequestedMeta {
+		qint64 revision;
+		std::chrono::steady_clock::time_point started;
+		int attempts = 1;
+	};
+	QHash<RemoteFolder*, QHash<QByteArray, RequestedMeta>> requested_;  // Metas, requested from the remote and not received yet
+	QHash<RemoteFolder*, QPair<QByteArray, quint64>> pending_upto_;   // Watermark, committed when all of the requests are answered
+	QSet<RemoteFolder*> watermark_lost_;    // A Meta was never received. The watermark is not moved until the next handshake.
+
+	// A request is forgotten, when the Meta (or a newer one) arrives from anyone. An unanswered request is sent again, and after a few
+	// attempts it is dropped together with the pending watermark, so that the path is announced again on the next handshake.
+	QTimer* expire_timer_;
+
+	void maybe_commit_watermark(RemoteFolder* remote);
+	void handle_meta_added(const SignedMeta& smeta);
+	void expire_requests();
+	void request_meta(RemoteFolder* origin, const Meta::PathRevision& revision);
 };
 
 } /* namespace librevault */
@@ -27,36 +27,141 @@
  * files in the program, then also delete it here.
  */
 #include "MetaUploader.h"
+#include "IndexDigest.h"
+#include "SuperSeeder.h"
 #include "folder/chunk/ChunkStorage.h"
+#include "folder/meta/MetaDelta.h"
 #include "folder/meta/MetaStorage.h"
 #include "folder/RemoteFolder.h"
+#include "p2p/V1Extensions.h"
 
 namespace librevault {
 
-MetaUploader::MetaUploader(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent) :
+MetaUploader::MetaUploader(MetaStorage* meta_storage, ChunkStorage* chunk_storage, SuperSeeder* super_seeder, QObject* parent) :
 	QObject(parent),
-	meta_storage_(meta_storage), chunk_storage_(chunk_storage) {
+	meta_storage_(meta_storage), chunk_storage_(chunk_storage), super_seeder_(super_seeder) {
 	LOGFUNC();
+	index_digest_ = new IndexDigest(meta_storage_, chunk_storage_, this);
 }
 
 void MetaUploader::broadcast_meta(QList<RemoteFolder*> remotes, const Meta::PathRevision& revision, const bitfield_type& bitfield) {
+	if(super_seeder_ && super_seeder_->active()) {
+		SignedMeta smeta = meta_storage_->getMeta(revision);
+		for(auto remote : remotes)
+			remote->post_have_meta(revision, make_bitfield(remote, smeta.meta(), bitfield));
+		return;
+	}
+
 	for(auto remote : remotes) {
 		remote->post_have_meta(revision, bitfield);
 	}
 }
 
+void MetaUploader::post_all_meta(RemoteFolder* remote) {
+	quint64 last_seq = meta_storage_->lastSeq();
+	post_meta_list(remote, meta_storage_->getMeta());
+	post_upto(remote, last_seq);
+}
+
 void MetaUploader::handle_handshake(RemoteFolder* remote) {
-	for(auto& meta : meta_storage_->getMeta()) {
-		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_->make_bitfield(meta.meta()));
+	// A remote with the watermark extension asks for the changes since its watermark (see handle_index_since). Otherwise, or if it is new to us,
+	// both sides send HAVE_META only for the buckets, that differ. Masked bitfields of super-seeding can't be compared, so the remote sends everything.
+	if(remote->supports(V1Extensions::DIGEST_RECONCILE)) {
+		if(super_seeder_ && super_seeder_->active())
+			remote->post_index_digest({});
+		else
+			remote->post_index_digest(index_digest_->digests());
+	}else if(! remote->supports(V1Extensions::WATERMARK))
+		post_all_meta(remote);
+}
+
+void MetaUploader::handle_index_digest(RemoteFolder* remote, const QVector<quint64>& digests) {
+	if(delta_posted_.contains(remote)) return;
+
+	if(super_seeder_ && super_seeder_->active())
+		post_all_meta(remote);
+	else{
+		quint64 last_seq = meta_storage_->lastSeq();
+		post_meta_list(remote, index_digest_->metaInBuckets(index_digest_->mismatched(digests)));
+		post_upto(remote, last_seq);
+	}
+}
+
+void MetaUploader::handle_index_since(RemoteFolder* remote, const QByteArray& log_id, quint64 seq, const QList<QByteArray>& incomplete_path_ids) {
+	quint64 last_seq = meta_storage_->lastSeq();
+	bool known = log_id == meta_storage_->logId() && seq <= last_seq;
+	if(!known && remote->supports(V1Extensions::DIGEST_RECONCILE)) return;   // Index digests are compared instead
+
+	if(!delta_posted_.contains(remote))
+		connect(remote, &QObject::destroyed, this, [=]{delta_posted_.remove(remote);});
+	delta_posted_.insert(remote);
+
+	if(!known || (super_seeder_ && super_seeder_->active())) {
+		post_all_meta(remote);
+		return;
+	}
+
+	QList<SignedMeta> metas = meta_storage_->getMetaSince(seq);
+	QSet<QByteArray> posted;
+	for(auto& smeta : metas)
+		posted << conv_bytearray(smeta.meta().path_id());
+
+	// Bitfields of the files, that the remote is still downloading. Its downloader has forgotten them on disconnect.
+	for(const QByteArray& path_id : incomplete_path_ids) {
+		if(posted.contains(path_id)) continue;
+		try {
+			metas << meta_storage_->getMeta(conv_bytearray(path_id));
+		}catch(MetaStorage::no_such_meta& e){}
 	}
+
+	post_meta_list(remote, metas);
+	post_upto(remote, last_seq);
 }
 
 void MetaUploader::handle_meta_request(RemoteFolder* remote, const Meta::PathRevision& revision) {
 	try {
-		remote->post_meta(meta_storage_->getMeta(revision), chunk_storage_->make_bitfield(meta_storage_->getMeta(revision).meta()));
+		SignedMeta smeta = meta_storage_->getMeta(revision);
+		remote->post_meta(smeta, make_bitfield(remote, smeta.meta(), chunk_storage_->make_bitfield(smeta.meta())));
+	}catch(MetaStorage::no_such_meta& e){
+		LOGW("Requested nonexistent Meta");
+	}
+}
+
+void MetaUploader::handle_meta_delta_request(RemoteFolder* remote, const Meta::PathRevision& revision, qint64 base_revision) {
+	try {
+		SignedMeta smeta = meta_storage_->getMeta(revision);
+		bitfield_type bitfield = make_bitfield(remote, smeta.meta(), chunk_storage_->make_bitfield(smeta.meta()));
+
+		// Only the previous revision is kept as a base. A delta, that saves less than a half, is not worth it.
+		QPair<qint64, blob> base = meta_storage_->getBaseMeta(revision.path_id_);
+		if(base.first == base_revision && !base.second.empty()) {
+			MetaDelta delta(base.second, base_revision, smeta);
+			if((size_t)delta.literalSize() + delta.ops.size() * 16 < smeta.raw_meta().size() / 2) {
+				remote->post_meta_delta(delta, bitfield);
+				return;
+			}
+		}
+		remote->post_meta(smeta, bitfield);
 	}catch(MetaStorage::no_such_meta& e){
 		LOGW("Requested nonexistent Meta");
 	}
 }
 
+void MetaUploader::post_meta_list(RemoteFolder* remote, const QList<SignedMeta>& metas) {
+	for(auto& meta : metas) {
+		remote->post_have_meta(meta.meta().path_revision(), make_bitfield(remote, meta.meta(), chunk_storage_->make_bitfield(meta.meta())));
+	}
+}
+
+void MetaUploader::post_upto(RemoteFolder* remote, quint64 last_seq) {
+	// Masked bitfields are not the real state, the remote must not consider it synced
+	if(remote->supports(V1Extensions::WATERMARK) && !(super_seeder_ && super_seeder_->active()))
+		remote->post_index_upto(meta_storage_->logId(), last_seq);
+}
+
+bitfield_type MetaUploader::make_bitfield(RemoteFolder* remote, const Meta& meta, const bitfield_type& bitfield) const {
+	// Super-seeding hides the chunks, that were not offered to this remote yet
+	return super_seeder_ ? super_seeder_->maskBitfield(remote, meta, bitfield) : bitfield;
+}
+
 } /* namespace librevault */
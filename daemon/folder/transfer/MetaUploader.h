@@ -31,6 +31,8 @@
 #include <librevault/Meta.h>
 #include <librevault/util/conv_bitfield.h>
 #include <QObject>
+#include <QSet>
+#include <QVector>
 #include <set>
 
 namespace librevault {
@@ -38,22 +40,36 @@ namespace librevault {
 class RemoteFolder;
 class MetaStorage;
 class ChunkStorage;
+class SuperSeeder;
+class IndexDigest;
 
 class MetaUploader : public QObject {
 	Q_OBJECT
 	LOG_SCOPE("MetaUploader");
 public:
-	MetaUploader(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent);
+	MetaUploader(MetaStorage* meta_storage, ChunkStorage* chunk_storage, SuperSeeder* super_seeder, QObject* parent);
 
 	void broadcast_meta(QList<RemoteFolder*> remotes, const Meta::PathRevision& revision, const bitfield_type& bitfield);
+	void post_all_meta(RemoteFolder* remote);
 
 	/* Message handlers */
 	void handle_handshake(RemoteFolder* remote);
+	void handle_index_digest(RemoteFolder* remote, const QVector<quint64>& digests);
+	void handle_index_since(RemoteFolder* remote, const QByteArray& log_id, quint64 seq, const QList<QByteArray>& incomplete_path_ids);
 	void handle_meta_request(RemoteFolder* remote, const Meta::PathRevision& revision);
+	void handle_meta_delta_request(RemoteFolder* remote, const Meta::PathRevision& revision, qint64 base_revision);
 
 private:
 	MetaStorage* meta_storage_;
 	ChunkStorage* chunk_storage_;
+	SuperSeeder* super_seeder_;
+	IndexDigest* index_digest_;
+	QSet<RemoteFolder*> delta_posted_;  // Remotes, that got the changes since their watermark. Their index digest is not needed
+
+	void post_meta_list(RemoteFolder* remote, const QList<SignedMeta>& metas);
+	void post_upto(RemoteFolder* remote, quint64 last_seq);
+
+	bitfield_type make_bitfield(RemoteFolder* remote, const Meta& meta, const bitfield_type& bitfield) const;
 };
 
 } /* namespace librevault */
@@ -0,0 +1,177 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "SuperSeeder.h"
+#include "control/Config.h"
+#include "folder/RemoteFolder.h"
+#include "folder/chunk/ChunkStorage.h"
+#include "folder/meta/MetaStorage.h"
+#include <QLoggingCategory>
+#include <algorithm>
+
+namespace librevault {
+
+Q_LOGGING_CATEGORY(log_superseeder, "folder.superseeder")
+
+SuperSeeder::SuperSeeder(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent) :
+	QObject(parent),
+	meta_storage_(meta_storage),
+	chunk_storage_(chunk_storage) {
+	for(auto& smeta : meta_storage_->getMeta()) {
+		for(auto& chunk : smeta.meta().chunks()) {
+			if(chunk_storage_->have_chunk(chunk.ct_hash))
+				unspread_.insert(conv_bytearray(chunk.ct_hash));
+		}
+	}
+	qCDebug(log_superseeder) << "Super-seeding" << unspread_.size() << "chunks";
+}
+
+bitfield_type SuperSeeder::maskBitfield(RemoteFolder* remote, const Meta& meta, bitfield_type bitfield) const {
+	if(! active_) return bitfield;
+
+	const QSet<QByteArray> revealed = revealed_.value(remote);
+	for(size_t chunk_idx = 0; chunk_idx < meta.chunks().size() && chunk_idx < bitfield.size(); chunk_idx++)
+		bitfield[chunk_idx] = bitfield[chunk_idx] && revealed.contains(conv_bytearray(meta.chunks()[chunk_idx].ct_hash));
+	return bitfield;
+}
+
+void SuperSeeder::addRemote(RemoteFolder* remote) {
+	if(! active_) return;
+	offerMore(remote);
+}
+
+void SuperSeeder::removeRemote(RemoteFolder* remote) {
+	foreach(QByteArray ct_hash, offers_.take(remote))
+		offered_to_.remove(ct_hash);
+	revealed_.remove(remote);
+	peer_chunks_.remove(remote);
+
+	// Its offers may be given to others now
+	foreach(RemoteFolder* other_remote, offers_.keys())
+		offerMore(other_remote);
+}
+
+void SuperSeeder::handleLocalChunk(const blob& ct_hash) {
+	if(! active_) return;
+
+	QByteArray ct_hash_q = conv_bytearray(ct_hash);
+	bool spread = std::any_of(peer_chunks_.begin(), peer_chunks_.end(), [&](const QSet<QByteArray>& chunks){return chunks.contains(ct_hash_q);});
+	if(spread) return;
+
+	unspread_.insert(ct_hash_q);
+	foreach(RemoteFolder* remote, offers_.keys())
+		offerMore(remote);
+}
+
+void SuperSeeder::handleRemoteChunk(RemoteFolder* remote, const blob& ct_hash) {
+	QByteArray ct_hash_q = conv_bytearray(ct_hash);
+	peer_chunks_[remote].insert(ct_hash_q);
+	if(! active_) return;
+
+	unspread_.remove(ct_hash_q);
+
+	auto offer_it = offered_to_.find(ct_hash_q);
+	if(offer_it != offered_to_.end()) {
+		// The chunk is out. If somebody else has it, it spreads without us. The receiver itself may get a new chunk only when it is alone.
+		bool alone = offers_.size() <= 1;
+		if(offer_it.value() != remote || alone)
+			completeOffer(ct_hash_q);
+	}
+	checkFinished();
+}
+
+void SuperSeeder::handleRemoteMeta(RemoteFolder* remote, const Meta::PathRevision& revision, bitfield_type bitfield) {
+	try {
+		auto chunks = meta_storage_->getMeta(revision).meta().chunks();
+		bitfield.resize(chunks.size(), 0);
+		for(size_t chunk_idx = 0; chunk_idx < chunks.size(); chunk_idx++)
+			if(bitfield[chunk_idx])
+				handleRemoteChunk(remote, chunks[chunk_idx].ct_hash);
+	}catch(MetaStorage::no_such_meta){
+		// We don't have this Meta, so there is nothing of ours to spread
+	}
+	if(active_) offerMore(remote);
+}
+
+void SuperSeeder::completeOffer(const QByteArray& ct_hash) {
+	RemoteFolder* offered_remote = offered_to_.take(ct_hash);
+	if(! offered_remote) return;
+
+	offers_[offered_remote].remove(ct_hash);
+	offerMore(offered_remote);
+}
+
+void SuperSeeder::offerMore(RemoteFolder* remote) {
+	if(! active_ || !remote->ready()) return;
+
+	QSet<QByteArray>& offers = offers_[remote];
+	int offers_max = Config::get()->getGlobal("p2p_super_seeding_offers").toInt();
+	while(offers.size() < offers_max) {
+		QByteArray ct_hash = pickChunk(remote);
+		if(ct_hash.isEmpty()) break;
+
+		offers.insert(ct_hash);
+		offered_to_.insert(ct_hash, remote);
+		revealed_[remote].insert(ct_hash);
+		revealed_count_++;
+		remote->post_have_chunk(conv_bytearray(ct_hash));
+	}
+}
+
+QByteArray SuperSeeder::pickChunk(RemoteFolder* remote) const {
+	// A chunk, that nobody has and nobody is offered. Offers are never duplicated, so that each chunk is uploaded about once.
+	const QSet<QByteArray> has = peer_chunks_.value(remote);
+	const QSet<QByteArray> revealed = revealed_.value(remote);
+
+	for(const QByteArray& ct_hash : unspread_) {
+		if(!has.contains(ct_hash) && !revealed.contains(ct_hash) && !offered_to_.contains(ct_hash))
+			return ct_hash;
+	}
+	return QByteArray();
+}
+
+void SuperSeeder::checkFinished() {
+	if(! unspread_.isEmpty()) return;
+
+	qCDebug(log_superseeder) << "All chunks are in the swarm, revealed" << revealed_count_ << "chunks in total. Super-seeding finished";
+	active_ = false;
+	offers_.clear();
+	offered_to_.clear();
+	emit finished();
+}
+
+QJsonObject SuperSeeder::collect_state() const {
+	QJsonObject state;
+	state["active"] = active_;
+	state["unspread_chunks"] = unspread_.size();
+	state["outstanding_offers"] = offered_to_.size();
+	state["revealed_chunks"] = (double)revealed_count_;
+	return state;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,89 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <librevault/Meta.h>
+#include <librevault/util/conv_bitfield.h>
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QSet>
+
+namespace librevault {
+
+class RemoteFolder;
+class MetaStorage;
+class ChunkStorage;
+
+/* SuperSeeder hides our chunks from peers and reveals them selectively, a few chunks per peer at a time. A peer gets a new chunk only after
+ * the previous one has been seen at some other peer, so that every chunk leaves the seeder about once and then spreads peer-to-peer.
+ * When every local chunk is present somewhere in the swarm, super-seeding ends and full bitfields are advertised again. */
+class SuperSeeder : public QObject {
+	Q_OBJECT
+signals:
+	void finished();
+
+public:
+	SuperSeeder(MetaStorage* meta_storage, ChunkStorage* chunk_storage, QObject* parent);
+
+	bool active() const {return active_;}
+
+	/* Our advertisements */
+	bitfield_type maskBitfield(RemoteFolder* remote, const Meta& meta, bitfield_type bitfield) const;
+
+	/* Events */
+	void addRemote(RemoteFolder* remote);
+	void removeRemote(RemoteFolder* remote);
+	void handleLocalChunk(const blob& ct_hash);
+	void handleRemoteChunk(RemoteFolder* remote, const blob& ct_hash);
+	void handleRemoteMeta(RemoteFolder* remote, const Meta::PathRevision& revision, bitfield_type bitfield);
+
+	QJsonObject collect_state() const;
+
+private:
+	MetaStorage* meta_storage_;
+	ChunkStorage* chunk_storage_;
+
+	bool active_ = true;
+
+	QSet<QByteArray> unspread_;                         // Local chunks, not seen at any peer yet
+	QHash<QByteArray, RemoteFolder*> offered_to_;       // Outstanding offers
+	QHash<RemoteFolder*, QSet<QByteArray>> offers_;     // Outstanding offers, per peer
+	QHash<RemoteFolder*, QSet<QByteArray>> revealed_;   // Everything, ever revealed to the peer
+	QHash<RemoteFolder*, QSet<QByteArray>> peer_chunks_;
+
+	quint64 revealed_count_ = 0;
+
+	void offerMore(RemoteFolder* remote);
+	QByteArray pickChunk(RemoteFolder* remote) const;
+	void completeOffer(const QByteArray& ct_hash);
+	void checkFinished();
+};
+
+} /* namespace librevault */
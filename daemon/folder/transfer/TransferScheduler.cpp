@@ -0,0 +1,155 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "TransferScheduler.h"
+#include "Downloader.h"
+#include "control/Config.h"
+#include "control/StateCollector.h"
+#include <QJsonArray>
+#include <algorithm>
+
+namespace librevault {
+
+TransferScheduler::TransferScheduler(StateCollector* state_collector, QObject* parent) : QObject(parent), state_collector_(state_collector) {
+	maintain_timer_ = new QTimer(this);
+	connect(maintain_timer_, &QTimer::timeout, this, &TransferScheduler::maintainAll);
+	maintain_timer_->setInterval(Config::get()->getGlobal("p2p_request_timeout").toInt()*1000);
+	maintain_timer_->setTimerType(Qt::VeryCoarseTimer);
+	maintain_timer_->start();
+}
+
+void TransferScheduler::addClient(Downloader* downloader, quint32 weight) {
+	clients_[downloader].weight = std::max(weight, 1u);
+}
+
+void TransferScheduler::removeClient(Downloader* downloader) {
+	outstanding_ -= std::min(outstanding_, clients_.value(downloader).outstanding);
+	clients_.remove(downloader);
+	active_.removeAll(downloader);
+	scheduleRound();    // Its slots are free now
+}
+
+void TransferScheduler::wakeup(Downloader* downloader) {
+	if(! clients_.contains(downloader)) return;
+
+	if(! active_.contains(downloader))
+		active_.append(downloader);
+	scheduleRound();
+}
+
+bool TransferScheduler::hasFreeSlot() const {
+	return outstanding_ < slots();
+}
+
+void TransferScheduler::acquireSlots(Downloader* downloader, quint32 count) {
+	auto client_it = clients_.find(downloader);
+	if(client_it == clients_.end()) return;
+
+	client_it->outstanding += count;
+	outstanding_ += count;
+}
+
+void TransferScheduler::releaseSlots(Downloader* downloader, quint32 count) {
+	auto client_it = clients_.find(downloader);
+	if(client_it == clients_.end()) return;
+
+	count = std::min(count, client_it->outstanding);
+	client_it->outstanding -= count;
+	outstanding_ -= count;
+	if(count > 0 && !active_.isEmpty())
+		scheduleRound();
+}
+
+quint32 TransferScheduler::slots() const {
+	return Config::get()->getGlobal("p2p_download_slots_total").toUInt();
+}
+
+void TransferScheduler::scheduleRound() {
+	if(schedule_scheduled_) return;
+	schedule_scheduled_ = true;
+	QTimer::singleShot(0, this, &TransferScheduler::round);
+}
+
+void TransferScheduler::round() {
+	schedule_scheduled_ = false;
+
+	qint64 quantum = Config::get()->getGlobal("p2p_scheduler_quantum").toLongLong();
+	quint32 slots_total = slots();
+
+	while(outstanding_ < slots_total && !active_.isEmpty()) {
+		Downloader* downloader = active_.takeFirst();
+		Client& client = clients_[downloader];
+		if(client.deficit <= 0)     // Otherwise, it was cut off by the budget and continues its turn
+			client.deficit += quantum * client.weight;
+
+		bool exhausted = false;
+		while(client.deficit > 0 && outstanding_ < slots_total) {
+			quint32 requested = downloader->requestOne();
+			if(requested == 0) {
+				exhausted = true;
+				break;
+			}
+			client.deficit -= requested;
+			client.requested += requested;
+		}
+
+		if(exhausted)
+			client.deficit = 0; // Idle clients don't accumulate credit
+		else if(client.deficit > 0)
+			active_.prepend(downloader);    // Cut off by the budget. It goes first, when a slot is free, without a new quantum.
+		else
+			active_.append(downloader);
+	}
+}
+
+void TransferScheduler::maintainAll() {
+	foreach(Downloader* downloader, clients_.keys())
+		downloader->maintainRequests();
+
+	state_collector_->global_state_set("transfer_scheduler", collect_state());
+}
+
+QJsonObject TransferScheduler::collect_state() const {
+	QJsonObject state;
+	state["slots"] = (double)slots();
+	state["outstanding"] = (double)outstanding_;
+	state["active_folders"] = active_.size();
+
+	QJsonArray clients_json;
+	for(auto client_it = clients_.begin(); client_it != clients_.end(); ++client_it) {
+		QJsonObject client_json;
+		client_json["weight"] = (double)client_it->weight;
+		client_json["outstanding"] = (double)client_it->outstanding;
+		client_json["requested"] = (double)client_it->requested;
+		clients_json.append(client_json);
+	}
+	state["folders"] = clients_json;
+	return state;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,82 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+namespace librevault {
+
+class Downloader;
+class StateCollector;
+
+/* TransferScheduler shares the daemon-wide budget of outstanding block requests between folders with deficit round robin. Every round, an active
+ * downloader receives a quantum of bytes, proportional to its folder's weight, and may request blocks until it is spent, so that small folders
+ * are not starved by big ones. It also drives periodic maintenance (request timeouts) of all downloaders with a single timer. */
+class TransferScheduler : public QObject {
+	Q_OBJECT
+public:
+	TransferScheduler(StateCollector* state_collector, QObject* parent);
+
+	void addClient(Downloader* downloader, quint32 weight);
+	void removeClient(Downloader* downloader);
+
+	void wakeup(Downloader* downloader);    // Downloader has something to request
+	bool hasFreeSlot() const;   // Requests, made outside of requestOne() (e.g. endgame duplicates), must check it first
+	void acquireSlots(Downloader* downloader, quint32 count = 1);
+	void releaseSlots(Downloader* downloader, quint32 count = 1);
+
+	QJsonObject collect_state() const;
+
+private:
+	StateCollector* state_collector_;
+
+	struct Client {
+		quint32 weight = 1;
+		qint64 deficit = 0;     // bytes
+		quint32 outstanding = 0;
+		quint64 requested = 0;  // bytes, total
+	};
+	QHash<Downloader*, Client> clients_;
+	QList<Downloader*> active_;     // Round robin order
+
+	quint32 outstanding_ = 0;
+	bool schedule_scheduled_ = false;
+
+	QTimer* maintain_timer_;
+
+	quint32 slots() const;
+	void scheduleRound();
+	void round();
+	void maintainAll();
+};
+
+} /* namespace librevault */
@@ -27,8 +27,12 @@
  * files in the program, then also delete it here.
  */
 #include "Uploader.h"
+#include "control/Config.h"
+#include "folder/chunk/ChunkPrefetcher.h"
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/RemoteFolder.h"
+#include "p2p/BandwidthLimiter.h"
+#include <QTimer>
 
 namespace librevault {
 
@@ -36,6 +40,9 @@ Uploader::Uploader(ChunkStorage* chunk_storage, QObject* parent) :
 	QObject(parent),
 	chunk_storage_(chunk_storage) {
 	LOGFUNC();
+	choker_ = new Choker(this);
+
+	connect(chunk_storage_->prefetcher(), &ChunkPrefetcher::loaded, this, &Uploader::handle_loaded);
 }
 
 void Uploader::broadcast_chunk(QList<RemoteFolder*> remotes, const blob& ct_hash) {
@@ -46,27 +53,128 @@ void Uploader::broadcast_chunk(QList<RemoteFolder*> remotes, const blob& ct_hash
 
 void Uploader::handle_interested(RemoteFolder* remote) {
 	LOGFUNC();
-
-	// TODO: write good choking algorithm.
-	remote->unchoke();
+	choker_->setInterested(remote, true);
 }
 void Uploader::handle_not_interested(RemoteFolder* remote) {
 	LOGFUNC();
-
-	// TODO: write good choking algorithm.
-	remote->choke();
+	choker_->setInterested(remote, false);
+	drop_pending(remote);
 }
 
 void Uploader::handle_block_request(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept {
-	try {
-		if(!remote->am_choking() && remote->peer_interested()) {
-			remote->post_block(ct_hash, offset, get_block(ct_hash, offset, size));
+	if(remote->am_choking() || !remote->peer_interested()) return;
+
+	// Requests over the cap are dropped. The remote times them out and shrinks its request window.
+	quint64& pending_bytes = pending_bytes_[remote];
+	if(pending_bytes + size > Config::get()->getGlobal("p2p_upload_queue_max").toULongLong()) {
+		LOGD("Upload queue is full, dropped block request");
+		return;
+	}
+
+	pending_bytes += size;
+	pending_blocks_[remote].append({ct_hash, offset, size});
+
+	// Replies wait until the chunk is in memory, so the event loop is not blocked on disk reads
+	QByteArray ct_hash_q = conv_bytearray(ct_hash);
+	if(!chunk_storage_->have_cached_chunk(ct_hash))
+		chunk_storage_->prefetcher()->load(ct_hash_q, true);
+	chunk_storage_->prefetcher()->hintRequested(ct_hash_q);
+
+	schedule_send();
+}
+
+void Uploader::handle_block_cancel(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept {
+	auto pending_it = pending_blocks_.find(remote);
+	if(pending_it == pending_blocks_.end()) return;
+
+	for(auto block_it = pending_it->begin(); block_it != pending_it->end(); ++block_it) {
+		if(block_it->ct_hash == ct_hash && block_it->offset == offset && block_it->size == size) {
+			pending_bytes_[remote] -= block_it->size;
+			pending_it->erase(block_it);
+			LOGD("Cancelled queued block reply");
+			break;
 		}
-	}catch(ChunkStorage::no_such_chunk& e){
-		LOGW("Requested nonexistent block");
 	}
 }
 
+void Uploader::untrack_remote(RemoteFolder* remote) {
+	drop_pending(remote);
+	choker_->untrack(remote);
+}
+
+void Uploader::drop_pending(RemoteFolder* remote) {
+	pending_blocks_.remove(remote);
+	pending_bytes_.remove(remote);
+}
+
+void Uploader::schedule_send(std::chrono::milliseconds delay) {
+	if(send_scheduled_) return;
+	send_scheduled_ = true;
+	QTimer::singleShot(delay.count(), this, &Uploader::send_pending);
+}
+
+void Uploader::send_pending() {
+	send_scheduled_ = false;
+
+	// One block per remote per event loop iteration: remotes are served round-robin and incoming cancels are processed in between
+	bool sent = false;
+	auto min_delay = BandwidthLimiter::clock::duration::max();
+	for(auto pending_it = pending_blocks_.begin(); pending_it != pending_blocks_.end();) {
+		RemoteFolder* remote = pending_it.key();
+		if(pending_it->isEmpty() || remote->am_choking()) {
+			pending_bytes_.remove(remote);
+			pending_it = pending_blocks_.erase(pending_it);
+			continue;
+		}
+
+		// Rate limited: the block waits in the queue
+		auto delay = remote->limiter()->delay(BandwidthLimiter::UPLOAD);
+		if(delay > BandwidthLimiter::clock::duration::zero()) {
+			min_delay = std::min(min_delay, delay);
+			++pending_it;
+			continue;
+		}
+
+		// Chunk is being loaded: the remote waits, others are served
+		const blob& front_hash = pending_it->first().ct_hash;
+		if(!chunk_storage_->have_cached_chunk(front_hash) && !failed_loads_.contains(conv_bytearray(front_hash))) {
+			chunk_storage_->prefetcher()->load(conv_bytearray(front_hash), true);  // No-op while loading. Otherwise, it was evicted in the meantime
+			++pending_it;
+			continue;
+		}
+
+		PendingBlock block = pending_it->takeFirst();
+		pending_bytes_[remote] -= block.size;
+		try {
+			remote->post_block(block.ct_hash, block.offset, get_block(block.ct_hash, block.offset, block.size));
+			remote->limiter()->consume(BandwidthLimiter::UPLOAD, block.size);
+			choker_->blockUploaded(remote, block.size);
+		}catch(ChunkStorage::no_such_chunk& e){
+			LOGW("Requested nonexistent block");
+		}
+		sent = true;
+		++pending_it;
+	}
+
+	if(pending_blocks_.isEmpty()) {
+		failed_loads_.clear();
+		return;
+	}
+	if(sent)
+		schedule_send();
+	else if(min_delay != BandwidthLimiter::clock::duration::max())
+		schedule_send(std::chrono::duration_cast<std::chrono::milliseconds>(min_delay) + std::chrono::milliseconds(1));
+}
+
+void Uploader::handle_loaded(QByteArray ct_hash, bool success) {
+	if(success)
+		failed_loads_.remove(ct_hash);
+	else
+		failed_loads_.insert(ct_hash);  // get_block() throws and the block is dropped
+	if(!pending_blocks_.isEmpty())
+		schedule_send();
+}
+
 blob Uploader::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
 	auto chunk = chunk_storage_->get_chunk(ct_hash);
 	if((int)offset < chunk.size() && (int)size <= chunk.size()-(int)offset)
@@ -27,9 +27,14 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "uploader/Choker.h"
 #include "util/log.h"
 #include "blob.h"
+#include <QHash>
+#include <QList>
+#include <QSet>
 #include <QObject>
+#include <chrono>
 #include <set>
 
 namespace librevault {
@@ -50,9 +55,32 @@ public:
 	void handle_not_interested(RemoteFolder* remote);
 
 	void handle_block_request(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept;
+	void handle_block_cancel(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept;
+
+	void untrack_remote(RemoteFolder* remote);
+
+	QJsonArray collect_state() const {return choker_->collect_state();}
 
 private:
 	ChunkStorage* chunk_storage_;
+	Choker* choker_;
+
+	/* Block replies are queued and sent asynchronously, so that cancels, received in the meantime, can drop them */
+	struct PendingBlock {
+		blob ct_hash;
+		uint32_t offset;
+		uint32_t size;
+	};
+	QHash<RemoteFolder*, QList<PendingBlock>> pending_blocks_;
+	QHash<RemoteFolder*, quint64> pending_bytes_;  // Requested bytes per remote, capped by p2p_upload_queue_max
+	bool send_scheduled_ = false;
+	QSet<QByteArray> failed_loads_;     // Chunks, that couldn't be prefetched. Served synchronously
+
+	void schedule_send(std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+	void send_pending();
+	void drop_pending(RemoteFolder* remote);
+
+	void handle_loaded(QByteArray ct_hash, bool success);
 
 	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size);
 };
@@ -27,55 +27,235 @@
  * files in the program, then also delete it here.
  */
 #include "ChunkFileBuilder.h"
+#include "util/FdBudget.h"
+#include "util/PositionalFile.h"
 #include <librevault/crypto/Base32.h>
+#include <QDataStream>
 #include <QLoggingCategory>
+#include <QtEndian>
+#include <cstring>
 
 namespace librevault {
 
 Q_DECLARE_LOGGING_CATEGORY(log_downloader)
 
 /* ChunkFileBuilderFdPool */
-QFile* ChunkFileBuilderFdPool::getFile(QString path, bool release) {
-	QFile* f = !release ? opened_files_[path] : opened_files_.take(path);
-	if(f)
-		return f;
+bool ChunkFileBuilderFdPool::write(const QString& path, quint64 offset, const QByteArray& data) {
+	std::shared_ptr<PositionalFile> chunk_f, ranges_f;
+	{
+		QMutexLocker lk(&mtx_);
+		OpenedFile* opened = getFile(path);
+		if(! opened) return false;
+		opened->pins++;
+		chunk_f = opened->chunk_f;
+		ranges_f = opened->ranges_f;
+	}
 
-	f = new QFile(path);
-	if(! f->open(QIODevice::ReadWrite))
-		qCWarning(log_downloader) << "Could not open" << path << "Error:" << f->errorString();
-	opened_files_.insert(path, f);
+	if(! chunk_f->write(offset, data.constData(), data.size())) {
+		qCWarning(log_downloader) << "Could not write" << path << "Error:" << chunk_f->errorString();
+		unpin(path, chunk_f);
+		return false;
+	}
 
-	return f;
+	// Data goes to the OS before its range is logged
+	quint64 record_offset = 0;
+	{
+		QMutexLocker lk(&mtx_);
+		auto index_it = opened_index_.find(path);
+		if(index_it != opened_index_.end() && (*index_it)->chunk_f == chunk_f) {
+			record_offset = (*index_it)->ranges_size;
+			(*index_it)->ranges_size += 2*sizeof(quint32);
+		}else
+			record_offset = ranges_f->size();   // Closed meanwhile, our descriptors are still valid
+	}
+	char record[2*sizeof(quint32)];
+	qToBigEndian(quint32(offset), (uchar*)record);
+	qToBigEndian(quint32(data.size()), (uchar*)record+sizeof(quint32));
+	if(! ranges_f->write(record_offset, record, sizeof(record)))
+		qCWarning(log_downloader) << "Could not log range to" << ranges_f->fileName() << "Error:" << ranges_f->errorString();  // Only resume is affected
+
+	unpin(path, chunk_f);
+	return true;
+}
+
+void ChunkFileBuilderFdPool::closeFile(const QString& path) {
+	QMutexLocker lk(&mtx_);
+
+	auto index_it = opened_index_.find(path);
+	if(index_it == opened_index_.end()) return;
+
+	// A pinned writer keeps its own references, the descriptors are closed after it
+	opened_files_.erase(index_it.value());
+	opened_index_.erase(index_it);
+	FdBudget::get_instance()->release(2);
+}
+
+QJsonObject ChunkFileBuilderFdPool::collect_state() const {
+	QMutexLocker lk(&mtx_);
+
+	QJsonObject state;
+	state["open_files"] = int(opened_files_.size());
+	state["hits"] = double(hits_);
+	state["misses"] = double(misses_);
+	state["hit_rate"] = (hits_ + misses_) > 0 ? double(hits_) / double(hits_ + misses_) : 0.0;
+	return state;
+}
+
+ChunkFileBuilderFdPool::OpenedFile* ChunkFileBuilderFdPool::getFile(const QString& path) {
+	auto index_it = opened_index_.find(path);
+	if(index_it != opened_index_.end()) {
+		hits_++;
+		opened_files_.splice(opened_files_.begin(), opened_files_, index_it.value());
+		return &opened_files_.front();
+	}
+	misses_++;
+
+	// Chunk file and its sidecar take two descriptors. If nothing can be closed, overcommit.
+	while(! FdBudget::get_instance()->tryAcquire(2)) {
+		if(! closeLeastRecent()) {
+			FdBudget::get_instance()->reserve(2);
+			break;
+		}
+	}
+
+	OpenedFile opened;
+	opened.path = path;
+	opened.chunk_f = std::make_shared<PositionalFile>(path);
+	opened.ranges_f = std::make_shared<PositionalFile>(ChunkFileBuilder::rangesLocation(path));
+	for(auto& f : {opened.chunk_f, opened.ranges_f}) {
+		if(! f->open(QIODevice::ReadWrite)) {
+			qCWarning(log_downloader) << "Could not open" << f->fileName() << "Error:" << f->errorString();
+			FdBudget::get_instance()->release(2);
+			return nullptr;
+		}
+	}
+	quint64 ranges_size = opened.ranges_f->size();
+	opened.ranges_size = ranges_size - ranges_size % (2*sizeof(quint32));   // Overwrite a record, truncated by a crash
+
+	opened_files_.push_front(std::move(opened));
+	opened_index_.insert(path, opened_files_.begin());
+	return &opened_files_.front();
+}
+
+void ChunkFileBuilderFdPool::unpin(const QString& path, const std::shared_ptr<PositionalFile>& chunk_f) {
+	QMutexLocker lk(&mtx_);
+
+	auto index_it = opened_index_.find(path);
+	if(index_it != opened_index_.end() && (*index_it)->chunk_f == chunk_f)
+		(*index_it)->pins--;
+}
+
+bool ChunkFileBuilderFdPool::closeLeastRecent() {
+	for(auto it = opened_files_.rbegin(); it != opened_files_.rend(); ++it) {
+		if(it->pins > 0) continue;
+
+		opened_index_.remove(it->path);
+		opened_files_.erase(std::next(it).base());
+		FdBudget::get_instance()->release(2);
+		return true;
+	}
+	return false;
 }
 
 /* ChunkFileBuilder */
-ChunkFileBuilder::ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size) : file_map_(size) {
-	chunk_location_ = system_path + "/incomplete-" + conv_bytearray(ct_hash | crypto::Base32());
+ChunkFileBuilder::ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size, bool in_memory) :
+	file_map_(size),
+	in_memory_(in_memory) {
+	chunk_location_ = location(system_path, ct_hash);
+
+	if(in_memory_) {
+		memory_chunk_ = QByteArray(size, 0);
+		return;
+	}
 
+	// Resume from the previous run, if the partial chunk is still here
 	QFile f(chunk_location_);
+	QFile ranges_f(rangesLocation(chunk_location_));
+	if(f.size() == size && ranges_f.open(QIODevice::ReadOnly)) {
+		QDataStream ranges_stream(&ranges_f);
+		while(!ranges_stream.atEnd()) {
+			quint32 range_offset, range_size;
+			ranges_stream >> range_offset >> range_size;
+			if(ranges_stream.status() != QDataStream::Ok) break;    // Truncated by a crash
+			if(range_size == 0) continue;   // Not logged before a crash
+			file_map_.insert({range_offset, range_size});
+		}
+		if(! file_map_.empty())
+			qCDebug(log_downloader) << "Resumed" << chunk_location_ << "with" << (size - file_map_.size_left()) << "bytes";
+		return;
+	}
+
 	f.open(QIODevice::WriteOnly | QIODevice::Truncate);
 	f.resize(size);
+	QFile::remove(rangesLocation(chunk_location_));
 }
 
 ChunkFileBuilder::~ChunkFileBuilder() {
-	if(! chunk_location_.isEmpty())
-		QFile::remove(chunk_location_);
+	if(!chunk_location_.isEmpty() && !in_memory_)
+		ChunkFileBuilderFdPool::get_instance()->closeFile(chunk_location_);
+}
+
+QString ChunkFileBuilder::location(QString system_path, QByteArray ct_hash) {
+	return system_path + "/incomplete-" + conv_bytearray(ct_hash | crypto::Base32());
 }
 
 QFile* ChunkFileBuilder::release_chunk() {
-	QFile* f = ChunkFileBuilderFdPool::get_instance()->getFile(chunk_location_, true);
+	if(in_memory_) {
+		memory_chunk_.clear();
+		chunk_location_.clear();
+		return nullptr;
+	}
+
+	ChunkFileBuilderFdPool::get_instance()->closeFile(chunk_location_);
+	QFile::remove(rangesLocation(chunk_location_));
+
+	QFile* f = new QFile(chunk_location_);
+	if(! f->open(QIODevice::ReadOnly))
+		qCWarning(log_downloader) << "Could not open" << chunk_location_ << "Error:" << f->errorString();
 	chunk_location_.clear();
 	return f;
 }
 
-void ChunkFileBuilder::put_block(quint32 offset, const QByteArray& content) {
+void ChunkFileBuilder::discard() {
+	if(chunk_location_.isEmpty()) return;
+
+	if(! in_memory_) {
+		ChunkFileBuilderFdPool::get_instance()->closeFile(chunk_location_);
+		QFile::remove(chunk_location_);
+		QFile::remove(rangesLocation(chunk_location_));
+	}
+	memory_chunk_.clear();
+	chunk_location_.clear();
+}
+
+bool ChunkFileBuilder::put_block(quint32 offset, const QByteArray& content) {
 	auto inserted = file_map_.insert({offset, content.size()}).second;
-	if(inserted) {
-		QFile* f = ChunkFileBuilderFdPool::get_instance()->getFile(chunk_location_);
-		if(f->pos() != offset)
-			f->seek(offset);
-		f->write(content);
+	if(inserted && in_memory_)
+		std::memcpy(memory_chunk_.data() + offset, content.constData(), content.size());
+	return inserted;
+}
+
+bool ChunkFileBuilder::write_block(const QString& chunk_location, quint32 offset, const QByteArray& content) {
+	return ChunkFileBuilderFdPool::get_instance()->write(chunk_location, offset, content);
+}
+
+bool ChunkFileBuilder::verify(const QByteArray& ct_hash, Meta::StrongHashType strong_hash_type, QByteArray* verified_chunk) const {
+	if(! complete()) return false;
+
+	QByteArray chunk;
+	if(in_memory_) {
+		chunk = memory_chunk_;
+	}else{
+		QFile f(chunk_location_);
+		if(! f.open(QIODevice::ReadOnly)) return false;
+		chunk = f.readAll();
 	}
+	if(conv_bytearray(Meta::Chunk::compute_strong_hash(conv_bytearray(chunk), strong_hash_type)) != ct_hash)
+		return false;
+
+	if(verified_chunk)
+		*verified_chunk = chunk;
+	return true;
 }
 
 } /* namespace librevault */
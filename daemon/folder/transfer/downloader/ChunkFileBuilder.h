@@ -29,35 +29,75 @@
 #pragma once
 #include "util/AvailabilityMap.h"
 #include "blob.h"
-#include <QCache>
+#include <librevault/Meta.h>
 #include <QFile>
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+#include <list>
+#include <memory>
 
 namespace librevault {
 
-/* ChunkFileBuilderFdPool is a singleton class, used to open/close files automatically to reduce simultaneously open file descriptors */
+class PositionalFile;
+
+/* ChunkFileBuilderFdPool is a singleton LRU pool of open incomplete chunk files and their range sidecars. It takes descriptors from FdBudget, and closes
+ * the least recently used files, when the budget is exhausted. Writes are positional, so there is no seek+write and no userspace buffering.
+ * The lock covers only lookup and LRU bookkeeping. A file is pinned while it is written, so that it is not closed for the budget under the writer. */
 class ChunkFileBuilderFdPool {
 public:
 	static ChunkFileBuilderFdPool* get_instance() {
-		static ChunkFileBuilderFdPool* instance;
-		if(!instance)
-			instance = new ChunkFileBuilderFdPool();
-		return instance;
+		static ChunkFileBuilderFdPool instance;     // Initialized once, even if pool threads get here first
+		return &instance;
 	}
 
-	QFile* getFile(QString path, bool release = false);
+	bool write(const QString& path, quint64 offset, const QByteArray& data);    // Logs the range into the sidecar, once the data is written
+	void closeFile(const QString& path);
+
+	QJsonObject collect_state() const;
 
 private:
-	QCache<QString, QFile> opened_files_;
+	struct OpenedFile {
+		QString path;
+		std::shared_ptr<PositionalFile> chunk_f;
+		std::shared_ptr<PositionalFile> ranges_f;
+		quint64 ranges_size;    // Next range record goes here
+		int pins = 0;
+	};
+
+	mutable QMutex mtx_;
+	std::list<OpenedFile> opened_files_;   // Most recently used first
+	QHash<QString, std::list<OpenedFile>::iterator> opened_index_;
+
+	quint64 hits_ = 0;
+	quint64 misses_ = 0;
+
+	OpenedFile* getFile(const QString& path);
+	void unpin(const QString& path, const std::shared_ptr<PositionalFile>& chunk_f);
+	bool closeLeastRecent();    // Returns false, if every open file is pinned
 };
 
 /* ChunkFileBuilder constructs a chunk in a file. If complete(), then an encrypted chunk is located in  */
+/* Received ranges are logged into a sidecar file, so that a partial chunk survives daemon restarts. Both files are kept, unless discard()'ed.
+ * Small chunks can be built in memory instead. They are written to disk once, on completion, and are not resumable.
+ * put_block() only accounts the range. The data of on-disk chunks is written by write_block(), which is thread-safe and may run on ChunkIOService. */
 class ChunkFileBuilder {
 public:
-	ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size);
+	ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size, bool in_memory = false);
 	~ChunkFileBuilder();
 
-	QFile* release_chunk();
-	void put_block(quint32 offset, const QByteArray& content);
+	static QString location(QString system_path, QByteArray ct_hash);
+	static QString rangesLocation(QString chunk_location) {return chunk_location + ".ranges";}
+
+	QFile* release_chunk();     // nullptr for an in-memory chunk, its bytes are taken from verify()
+	void discard();
+	bool put_block(quint32 offset, const QByteArray& content);  // Returns false for a duplicate range
+	static bool write_block(const QString& chunk_location, quint32 offset, const QByteArray& content);    // The range is not logged, if it fails
+	bool verify(const QByteArray& ct_hash, Meta::StrongHashType strong_hash_type, QByteArray* verified_chunk = nullptr) const;    // Checks the complete chunk against its ct_hash
+
+	bool resumed() const {return !file_map_.empty();}
+	bool in_memory() const {return in_memory_;}
+	const QString& chunk_location() const {return chunk_location_;}
 
 	uint64_t size() const {return file_map_.size_original();}
 	bool complete() const {return file_map_.full();}
@@ -67,6 +107,9 @@ public:
 private:
 	AvailabilityMap<quint32> file_map_;
 	QString chunk_location_;
+
+	bool in_memory_;
+	QByteArray memory_chunk_;
 };
 
 } /* namespace librevault */
@@ -0,0 +1,78 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "PeerReputation.h"
+#include <QSet>
+
+namespace librevault {
+
+PeerReputation::PeerReputation(qreal ban_threshold) : ban_threshold_(ban_threshold) {}
+
+void PeerReputation::chunkVerified(const QList<QByteArray>& sources, quint64 bytes) {
+	QSet<QByteArray> unique_sources = sources.toSet();
+	for(const QByteArray& digest : unique_sources) {
+		Score& score = scores_[digest];
+		score.verified_bytes += bytes / unique_sources.size();
+		score.verified_chunks++;
+	}
+}
+
+void PeerReputation::chunkCorrupted(const QList<QByteArray>& sources) {
+	QSet<QByteArray> unique_sources = sources.toSet();
+	for(const QByteArray& digest : unique_sources) {
+		Score& score = scores_[digest];
+		score.blame += 1.0 / unique_sources.size();
+		score.corrupted_chunks++;
+	}
+}
+
+bool PeerReputation::banned(const QByteArray& digest) const {
+	auto score_it = scores_.constFind(digest);
+	return score_it != scores_.constEnd() && score_it->blame >= ban_threshold_;
+}
+
+qreal PeerReputation::penalty(const QByteArray& digest) const {
+	auto score_it = scores_.constFind(digest);
+	return score_it != scores_.constEnd() ? 1.0 + score_it->blame * 2 : 1.0;
+}
+
+QJsonObject PeerReputation::collect_state() const {
+	QJsonObject state;
+	for(auto score_it = scores_.constBegin(); score_it != scores_.constEnd(); ++score_it) {
+		QJsonObject score_json;
+		score_json["verified_bytes"] = (double)score_it->verified_bytes;
+		score_json["verified_chunks"] = (double)score_it->verified_chunks;
+		score_json["corrupted_chunks"] = (double)score_it->corrupted_chunks;
+		score_json["blame"] = score_it->blame;
+		score_json["banned"] = score_it->blame >= ban_threshold_;
+		state[QString::fromLatin1(score_it.key().toHex())] = score_json;
+	}
+	return state;
+}
+
+} /* namespace librevault */
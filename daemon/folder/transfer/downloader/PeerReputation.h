@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QByteArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+
+namespace librevault {
+
+/* PeerReputation accounts verified and corrupted chunks per peer. Peers are identified by their certificate digest, so the score survives reconnects.
+ * A corrupted chunk blames all of its block sources evenly: a sole source gets the full blame, and is banned after reaching the threshold. */
+class PeerReputation {
+public:
+	explicit PeerReputation(qreal ban_threshold);
+
+	void chunkVerified(const QList<QByteArray>& sources, quint64 bytes);
+	void chunkCorrupted(const QList<QByteArray>& sources);
+
+	bool banned(const QByteArray& digest) const;
+	qreal penalty(const QByteArray& digest) const;   // Multiplier for the expected delivery time, 1.0 for a clean peer
+
+	QJsonObject collect_state() const;
+
+private:
+	struct Score {
+		quint64 verified_bytes = 0;
+		quint32 verified_chunks = 0;
+		quint32 corrupted_chunks = 0;
+		qreal blame = 0;
+	};
+	QHash<QByteArray, Score> scores_;
+
+	const qreal ban_threshold_;
+};
+
+} /* namespace librevault */
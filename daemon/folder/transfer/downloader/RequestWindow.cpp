@@ -0,0 +1,133 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "RequestWindow.h"
+#include <algorithm>
+#include <cmath>
+
+namespace librevault {
+
+namespace {
+constexpr qreal THROUGHPUT_EWMA_ALPHA = 0.125;
+constexpr qreal BLOCK_TARGET_TIME = 0.010;  // Seconds. Blocks should be large enough to make per-message overhead negligible
+constexpr quint32 BLOCK_ALIGNMENT = 1024;
+
+template<class T>
+T clamp(T value, T low, T high) {return std::min(std::max(value, low), high);}
+} /* namespace */
+
+RequestWindow::RequestWindow() {
+	setLimits(Limits());
+}
+
+void RequestWindow::setLimits(const Limits& limits) {
+	limits_ = limits;
+	limits_.window_min = std::max(limits_.window_min, 1u);
+	limits_.window_max = std::max(limits_.window_max, limits_.window_min);
+	limits_.block_max = std::max(limits_.block_max, limits_.block_min);
+
+	window_ = clamp(limits_.window_initial, limits_.window_min, limits_.window_max);
+	block_size_ = clamp(limits_.block_initial, limits_.block_min, limits_.block_max);
+}
+
+void RequestWindow::requestSent() {
+	outstanding_++;
+}
+
+void RequestWindow::requestCancelled(quint32 count) {
+	outstanding_ -= std::min(count, outstanding_);
+}
+
+void RequestWindow::requestTimedOut() {
+	requestCancelled();
+
+	// Multiplicative decrease. The link is likely congested, or the estimates were too optimistic.
+	if(limits_.adaptive) {
+		window_ = std::max(window_ / 2, limits_.window_min);
+		block_size_ = std::max(block_size_ / 2, limits_.block_min);
+		throughput_ /= 2;
+	}
+}
+
+void RequestWindow::requestCompleted(quint32 bytes, clock::time_point started, std::chrono::milliseconds rtt) {
+	requestCancelled();
+
+	auto now = clock::now();
+
+	// Base latency. Ping RTT is preferred, because block latency includes queueing inside our own pipeline.
+	clock::duration latency = now - started;
+	min_latency_ = std::min(min_latency_, rtt.count() > 0 ? std::chrono::duration_cast<clock::duration>(rtt) : latency);
+
+	// Delivery rate. Blocks are pipelined, so the interval is measured from the previous delivery, not from the request.
+	clock::duration interval = now - std::max(started, last_delivery_);
+	last_delivery_ = now;
+	if(interval.count() > 0) {
+		qreal sample = qreal(bytes) / std::chrono::duration<qreal>(interval).count();
+		throughput_ = throughput_ > 0 ? throughput_ + THROUGHPUT_EWMA_ALPHA * (sample - throughput_) : sample;
+	}
+
+	if(limits_.adaptive)
+		adapt();
+}
+
+std::chrono::milliseconds RequestWindow::latency() const {
+	return min_latency_ != clock::duration::max() ? std::chrono::duration_cast<std::chrono::milliseconds>(min_latency_) : std::chrono::milliseconds(0);
+}
+
+RequestWindow::clock::duration RequestWindow::expectedDelivery() const {
+	clock::duration latency = min_latency_ != clock::duration::max() ? min_latency_ : clock::duration::zero();
+	if(throughput_ <= 0)
+		return latency;   // Unmeasured peers are optimistic, so they get a chance to be measured
+	return latency + std::chrono::duration_cast<clock::duration>(std::chrono::duration<qreal>(qreal(outstanding_ + 1) * block_size_ / throughput_));
+}
+
+QJsonObject RequestWindow::collect_state() const {
+	QJsonObject state;
+	state["block_size"] = qint64(block_size_);
+	state["window"] = qint64(window_);
+	state["outstanding"] = qint64(outstanding_);
+	state["goodput"] = throughput_;
+	state["latency"] = double(latency().count());
+	return state;
+}
+
+void RequestWindow::adapt() {
+	if(throughput_ <= 0 || min_latency_ == clock::duration::max()) return;
+
+	// Block size: enough bytes for BLOCK_TARGET_TIME at current goodput. At most doubled or halved at once, so a single sample can't swing it.
+	qreal target_block = clamp(throughput_ * BLOCK_TARGET_TIME, qreal(block_size_) / 2, qreal(block_size_) * 2);
+	quint32 block_size = quint32(target_block) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+	block_size_ = clamp(block_size, limits_.block_min, limits_.block_max);
+
+	// Window: bandwidth-delay product in blocks, doubled, so that measured goodput is not capped by the window itself
+	qreal bdp_blocks = throughput_ * std::chrono::duration<qreal>(min_latency_).count() / block_size_;
+	quint32 window = quint32(std::ceil(bdp_blocks * 2));
+	window_ = clamp(window, limits_.window_min, limits_.window_max);
+}
+
+} /* namespace librevault */
@@ -0,0 +1,90 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QJsonObject>
+#include <QtGlobal>
+#include <chrono>
+
+namespace librevault {
+
+/* RequestWindow keeps per-peer transfer estimates and limits the number of block requests in flight to the peer's bandwidth-delay product.
+ * In adaptive mode both the window and the block size follow the measured goodput and latency: they grow with the bandwidth-delay product
+ * and are halved on every timed out request. */
+class RequestWindow {
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct Limits {
+		bool adaptive = false;
+
+		quint32 window_initial = 1;
+		quint32 window_min = 1;
+		quint32 window_max = 1;
+
+		quint32 block_initial = 32768;
+		quint32 block_min = 32768;
+		quint32 block_max = 32768;
+	};
+
+	RequestWindow();
+
+	void setLimits(const Limits& limits);   // Resets current values to the initial ones
+
+	void requestSent();
+	void requestCancelled(quint32 count = 1);
+	void requestTimedOut();
+	void requestCompleted(quint32 bytes, clock::time_point started, std::chrono::milliseconds rtt);
+
+	bool hasFreeSlot() const {return outstanding_ < window_;}
+	quint32 window() const {return window_;}
+	quint32 outstanding() const {return outstanding_;}
+	quint32 blockSize() const {return block_size_;}
+
+	qreal throughput() const {return throughput_;}  // bytes/s, 0 if unknown
+	std::chrono::milliseconds latency() const;
+
+	clock::duration expectedDelivery() const;  // Estimated time for one more block to arrive. Lower is better.
+
+	QJsonObject collect_state() const;
+
+private:
+	Limits limits_;
+
+	quint32 window_;
+	quint32 outstanding_ = 0;
+	quint32 block_size_;
+
+	qreal throughput_ = 0;
+	clock::duration min_latency_ = clock::duration::max();
+	clock::time_point last_delivery_;
+
+	void adapt();
+};
+
+} /* namespace librevault */
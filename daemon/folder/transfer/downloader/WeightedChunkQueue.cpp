@@ -28,7 +28,6 @@
  */
 #include "WeightedChunkQueue.h"
 #include <QLoggingCategory>
-#include <boost/range/adaptor/map.hpp>
 
 namespace librevault {
 
@@ -37,27 +36,24 @@ float WeightedChunkQueue::Weight::value() const {
 
 	weight_value += CLUSTERED_COEFFICIENT * (clustered ? 1 : 0);
 	weight_value += IMMEDIATE_COEFFICIENT * (immediate ? 1 : 0);
-	float rarity = (float)(remotes_count - owned_by) / (float)remotes_count;
+	float rarity = owned_by > 0 ? 1.0f / (float)owned_by : 0;   // Independent of total remote count, so connects/disconnects don't reweight the whole queue
 	weight_value += rarity * RARITY_COEFFICIENT;
+	weight_value += COMPLETION_COEFFICIENT * completion;
+	weight_value += PRIORITY_COEFFICIENT * priority;
 
 	return weight_value;
 }
 
-WeightedChunkQueue::Weight WeightedChunkQueue::getCurrentWeight(QByteArray chunk) {
-	auto it = weight_ordered_chunks_.left.find(chunk);
-	if(it != weight_ordered_chunks_.left.end())
-		return it->second;
-	else
-		return Weight();
-}
-
-void WeightedChunkQueue::reweightChunk(QByteArray chunk, Weight new_weight) {
+template<class Modifier>
+void WeightedChunkQueue::reweightChunk(const QByteArray& chunk, Modifier modifier) {
 	auto chunk_it = weight_ordered_chunks_.left.find(chunk);
+	if(chunk_it == weight_ordered_chunks_.left.end()) return;
 
-	if(chunk_it != weight_ordered_chunks_.left.end() && chunk_it->second != new_weight) {
-		weight_ordered_chunks_.left.erase(chunk_it);
-		weight_ordered_chunks_.left.insert(queue_left_value(chunk, new_weight));
-	}
+	Weight new_weight = chunk_it->second;
+	modifier(new_weight);
+
+	if(chunk_it->second != new_weight)
+		weight_ordered_chunks_.left.replace_data(chunk_it, new_weight); // Repositions the node in place, without reallocation
 }
 
 void WeightedChunkQueue::addChunk(QByteArray chunk) {
@@ -68,45 +64,28 @@ void WeightedChunkQueue::removeChunk(QByteArray chunk) {
 	weight_ordered_chunks_.left.erase(chunk);
 }
 
-void WeightedChunkQueue::setRemotesCount(int count) {
-	weight_ordered_chunks_t new_queue;
-	for(auto& entry : weight_ordered_chunks_.left) {
-		QByteArray chunk = entry.first;
-		Weight weight = entry.second;
-
-		weight.remotes_count = count;
-		new_queue.left.insert(queue_left_value(chunk, weight));
-	}
-	weight_ordered_chunks_ = new_queue;
+void WeightedChunkQueue::setOwnedBy(QByteArray chunk, int count) {
+	reweightChunk(chunk, [=](Weight& weight){weight.owned_by = count;});
 }
 
-void WeightedChunkQueue::setRemotesCount(QByteArray chunk, int count) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.owned_by = count;
+void WeightedChunkQueue::setRequestable(QByteArray chunk, bool requestable) {
+	reweightChunk(chunk, [=](Weight& weight){weight.requestable = requestable;});
+}
 
-	reweightChunk(chunk, weight);
+void WeightedChunkQueue::markStarted(QByteArray chunk) {
+	reweightChunk(chunk, [](Weight& weight){weight.started = true;});
 }
 
 void WeightedChunkQueue::markClustered(QByteArray chunk) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.clustered = true;
-
-	reweightChunk(chunk, weight);
+	reweightChunk(chunk, [](Weight& weight){weight.clustered = true;});
 }
 
 void WeightedChunkQueue::markImmediate(QByteArray chunk) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.immediate = true;
-
-	reweightChunk(chunk, weight);
+	reweightChunk(chunk, [](Weight& weight){weight.immediate = true;});
 }
 
-QList<QByteArray> WeightedChunkQueue::chunks() const {
-	QList<QByteArray> chunk_list;
-	chunk_list.reserve(weight_ordered_chunks_.size());
-	for(auto& chunk_ptr : boost::adaptors::values(weight_ordered_chunks_.right))
-		chunk_list << chunk_ptr;
-	return chunk_list;
+void WeightedChunkQueue::setFileWeight(QByteArray chunk, int priority, float completion) {
+	reweightChunk(chunk, [=](Weight& weight){weight.priority = priority; weight.completion = completion;});
 }
 
 } /* namespace librevault */
@@ -35,6 +35,8 @@
 #define CLUSTERED_COEFFICIENT 10.0f
 #define IMMEDIATE_COEFFICIENT 20.0f
 #define RARITY_COEFFICIENT 25.0f
+#define COMPLETION_COEFFICIENT 15.0f
+#define PRIORITY_COEFFICIENT 100.0f
 
 inline std::size_t hash_value(const QByteArray& val) {
 	return qHash(val);
@@ -48,15 +50,24 @@ class ChunkStorage;
 
 class WeightedChunkQueue {
 	struct Weight {
+		bool requestable = false;   // Has an owner, that can be asked now, and unrequested blocks
+		bool started = false;       // Has a ChunkFileBuilder. Started chunks are finished first, so that the number of builders stays low.
+
 		bool clustered = false;
-		bool immediate = false;
+		bool immediate = false;     // Requested by the user. Goes before everything else, even if the builder limit is reached.
 
 		int owned_by = 0;
-		int remotes_count = 0;
+		int priority = 0;           // From the folder's download_priorities rules
+		float completion = 0;       // Completed part of the most complete file, containing this chunk
 
 		float value() const;
-		bool operator<(const Weight& b) const {return value() > b.value();}
-		bool operator==(const Weight& b) const {return value() == b.value();}
+		bool operator<(const Weight& b) const {
+			if(requestable != b.requestable) return requestable;
+			if(immediate != b.immediate) return immediate;
+			if(started != b.started) return started;
+			return value() > b.value();
+		}
+		bool operator==(const Weight& b) const {return requestable == b.requestable && immediate == b.immediate && started == b.started && value() == b.value();}
 		bool operator!=(const Weight& b) const {return !(*this == b);}
 	};
 	using weight_ordered_chunks_t = boost::bimap<
@@ -67,20 +78,32 @@ class WeightedChunkQueue {
 	using queue_right_value = weight_ordered_chunks_t::right_value_type;
 	weight_ordered_chunks_t weight_ordered_chunks_;
 
-	Weight getCurrentWeight(QByteArray chunk);
-	void reweightChunk(QByteArray chunk, Weight new_weight);
+	template<class Modifier>
+	void reweightChunk(const QByteArray& chunk, Modifier modifier);
 
 public:
 	void addChunk(QByteArray chunk);
 	void removeChunk(QByteArray chunk);
 
-	void setRemotesCount(int count);
-	void setRemotesCount(QByteArray chunk, int count);
+	void setOwnedBy(QByteArray chunk, int count);
+	void setRequestable(QByteArray chunk, bool requestable);
+	void markStarted(QByteArray chunk);
 
 	void markClustered(QByteArray chunk);
 	void markImmediate(QByteArray chunk);
+	void setFileWeight(QByteArray chunk, int priority, float completion);
 
-	QList<QByteArray> chunks() const;
+	// The heaviest requestable chunk, accepted by predicate. Empty, if nothing can be requested now.
+	template<class Predicate>
+	QByteArray findRequestable(Predicate predicate, bool started_only = false) const {
+		for(auto& entry : weight_ordered_chunks_.right) {
+			if(! entry.first.requestable) break;
+			if(started_only && !entry.first.started && !entry.first.immediate) break;
+			if(predicate(entry.second)) return entry.second;
+		}
+		return QByteArray();
+	}
+	size_t size() const {return weight_ordered_chunks_.size();}
 };
 
 } /* namespace librevault */
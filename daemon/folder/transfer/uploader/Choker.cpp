@@ -0,0 +1,182 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "Choker.h"
+#include "control/Config.h"
+#include "folder/RemoteFolder.h"
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <algorithm>
+
+namespace librevault {
+
+Q_LOGGING_CATEGORY(log_choker, "folder.uploader.choker")
+
+Choker::Choker(QObject* parent) : QObject(parent), last_rechoke_(clock::now()) {
+	rechoke_timer_ = new QTimer(this);
+	connect(rechoke_timer_, &QTimer::timeout, this, &Choker::rechoke);
+	rechoke_timer_->setInterval(Config::get()->getGlobal("p2p_rechoke_interval").toInt()*1000);
+	rechoke_timer_->start();
+}
+
+void Choker::setInterested(RemoteFolder* remote, bool interested) {
+	PeerStats& stats = peers_[remote];
+	if(stats.interested == interested) return;
+
+	stats.interested = interested;
+	if(! interested) {
+		if(! remote->am_choking())
+			remote->choke();
+		if(optimistic_ == remote)
+			optimistic_ = nullptr;
+	}
+
+	// Rates are not updated and unchoked peers are not reordered here, only on rechoke_timer_. Otherwise, every interest change would
+	// reshuffle the slots.
+	fillFreeSlots();
+}
+
+void Choker::untrack(RemoteFolder* remote) {
+	peers_.remove(remote);
+	if(optimistic_ == remote)
+		optimistic_ = nullptr;
+	fillFreeSlots();
+}
+
+void Choker::blockUploaded(RemoteFolder* remote, quint32 bytes) {
+	auto stats_it = peers_.find(remote);
+	if(stats_it != peers_.end())
+		stats_it->uploaded += bytes;
+}
+
+// Reciprocation first: peers that give us data fastest. Peers, that give us nothing (e.g. when we are seeding), are ordered by how fast they take it.
+bool Choker::ranksHigher(RemoteFolder* a, RemoteFolder* b) const {
+	qreal a_recip = a->request_window().throughput(), b_recip = b->request_window().throughput();
+	if(a_recip != b_recip) return a_recip > b_recip;
+	return peers_.value(a).upload_rate > peers_.value(b).upload_rate;
+}
+
+void Choker::fillFreeSlots() {
+	int free_slots = Config::get()->getGlobal("p2p_upload_slots").toInt();
+	QList<RemoteFolder*> choked;
+	for(auto stats_it = peers_.begin(); stats_it != peers_.end(); ++stats_it) {
+		RemoteFolder* remote = stats_it.key();
+		if(! stats_it->interested || remote == optimistic_) continue;
+
+		if(! remote->am_choking())
+			free_slots--;
+		else if(remote->ready())
+			choked << remote;
+	}
+	if(free_slots <= 0) return;
+
+	std::stable_sort(choked.begin(), choked.end(), [this](RemoteFolder* a, RemoteFolder* b){return ranksHigher(a, b);});
+	for(RemoteFolder* remote : choked.mid(0, free_slots)) {
+		qCDebug(log_choker) << "Unchoking" << remote->displayName() << "(free slot)";
+		remote->unchoke();
+	}
+}
+
+void Choker::updateRates() {
+	auto now = clock::now();
+	qreal interval = std::chrono::duration<qreal>(now - last_rechoke_).count();
+	last_rechoke_ = now;
+	if(interval <= 0) return;
+
+	for(PeerStats& stats : peers_) {
+		stats.upload_rate = stats.upload_rate / 2 + (stats.uploaded / interval) / 2;
+		stats.uploaded = 0;
+	}
+}
+
+void Choker::rechoke() {
+	updateRates();
+
+	QList<RemoteFolder*> candidates;
+	for(auto stats_it = peers_.begin(); stats_it != peers_.end(); ++stats_it) {
+		if(stats_it->interested && stats_it.key()->ready())
+			candidates << stats_it.key();
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end(), [this](RemoteFolder* a, RemoteFolder* b){return ranksHigher(a, b);});
+
+	QSet<RemoteFolder*> regular = candidates.mid(0, Config::get()->getGlobal("p2p_upload_slots").toInt()).toSet();
+	rotateOptimistic(regular);
+
+	for(auto stats_it = peers_.begin(); stats_it != peers_.end(); ++stats_it) {
+		RemoteFolder* remote = stats_it.key();
+		bool unchoke = stats_it->interested && (regular.contains(remote) || remote == optimistic_);
+
+		if(unchoke && remote->am_choking()) {
+			qCDebug(log_choker) << "Unchoking" << remote->displayName() << (remote == optimistic_ ? "(optimistic)" : "");
+			remote->unchoke();
+		}else if(!unchoke && !remote->am_choking()) {
+			qCDebug(log_choker) << "Choking" << remote->displayName();
+			remote->choke();
+		}
+	}
+}
+
+void Choker::rotateOptimistic(const QSet<RemoteFolder*>& regular) {
+	auto rotation_interval = std::chrono::seconds(Config::get()->getGlobal("p2p_optimistic_unchoke_interval").toUInt());
+
+	bool keep = optimistic_
+		&& peers_.value(optimistic_).interested
+		&& !regular.contains(optimistic_)
+		&& clock::now() - optimistic_since_ < rotation_interval;
+	if(keep) return;
+
+	QList<RemoteFolder*> choked;
+	for(auto stats_it = peers_.begin(); stats_it != peers_.end(); ++stats_it) {
+		if(stats_it->interested && stats_it.key()->ready() && !regular.contains(stats_it.key()) && stats_it.key() != optimistic_)
+			choked << stats_it.key();
+	}
+
+	if(! choked.isEmpty()) {
+		optimistic_ = choked.at(qrand() % choked.size());
+		optimistic_since_ = clock::now();
+	}else if(optimistic_ && (!peers_.value(optimistic_).interested || regular.contains(optimistic_)))
+		optimistic_ = nullptr;
+}
+
+QJsonArray Choker::collect_state() const {
+	QJsonArray state;
+	for(auto stats_it = peers_.begin(); stats_it != peers_.end(); ++stats_it) {
+		QJsonObject peer_json;
+		peer_json["peer"] = stats_it.key()->displayName();
+		peer_json["interested"] = stats_it->interested;
+		peer_json["unchoked"] = !stats_it.key()->am_choking();
+		peer_json["optimistic"] = stats_it.key() == optimistic_;
+		peer_json["upload_rate"] = stats_it->upload_rate;
+		peer_json["download_rate"] = stats_it.key()->request_window().throughput();
+		state.append(peer_json);
+	}
+	return state;
+}
+
+} /* namespace librevault */
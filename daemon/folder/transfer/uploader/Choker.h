@@ -0,0 +1,79 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QHash>
+#include <QJsonArray>
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+#include <chrono>
+
+namespace librevault {
+
+class RemoteFolder;
+
+/* Choker decides, which interested peers are allowed to download from us. A fixed number of upload slots is given to the peers, that upload
+ * to us fastest (or, if they upload nothing, to those who download fastest), and one more slot is rotated between the rest ("optimistic unchoke"),
+ * so that new peers get a chance to prove themselves. */
+class Choker : public QObject {
+	Q_OBJECT
+public:
+	using clock = std::chrono::steady_clock;
+
+	Choker(QObject* parent);
+
+	void setInterested(RemoteFolder* remote, bool interested);
+	void untrack(RemoteFolder* remote);
+
+	void blockUploaded(RemoteFolder* remote, quint32 bytes);
+
+	QJsonArray collect_state() const;
+
+private:
+	struct PeerStats {
+		qreal upload_rate = 0;      // bytes/s, averaged over rechoke intervals
+		quint64 uploaded = 0;       // since the last rechoke
+		bool interested = false;
+	};
+	QHash<RemoteFolder*, PeerStats> peers_;
+
+	RemoteFolder* optimistic_ = nullptr;
+	clock::time_point optimistic_since_;
+
+	QTimer* rechoke_timer_;
+	clock::time_point last_rechoke_;
+
+	bool ranksHigher(RemoteFolder* a, RemoteFolder* b) const;
+	void fillFreeSlots();
+	void rechoke();
+	void updateRates();
+	void rotateOptimistic(const QSet<RemoteFolder*>& regular);
+};
+
+} /* namespace librevault */
@@ -0,0 +1,140 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "BandwidthLimiter.h"
+#include "control/Config.h"
+#include <QDateTime>
+#include <QLoggingCategory>
+#include <QTimer>
+#include <algorithm>
+
+namespace librevault {
+
+Q_LOGGING_CATEGORY(log_bandwidth, "p2p.bandwidth")
+
+BandwidthLimiter::BandwidthLimiter(BandwidthLimiter* parent_limiter, QObject* parent) : QObject(parent), parent_limiter_(parent_limiter) {}
+
+BandwidthLimiter* BandwidthLimiter::global() {
+	static BandwidthLimiter* instance;
+	if(!instance) {
+		instance = new BandwidthLimiter(nullptr, nullptr);
+
+		// Limits may be changed at runtime through the control API, and by the schedule
+		connect(Config::get(), &Config::globalChanged, instance, [](QString key, QVariant value){
+			if(key.startsWith("bandwidth_")) instance->applyGlobalLimits();
+		});
+		instance->schedule_timer_ = new QTimer(instance);
+		connect(instance->schedule_timer_, &QTimer::timeout, instance, &BandwidthLimiter::applyGlobalLimits);
+		instance->schedule_timer_->setInterval(60*1000);
+		instance->schedule_timer_->start();
+
+		instance->applyGlobalLimits();
+	}
+	return instance;
+}
+
+bool BandwidthLimiter::isLanAddress(const QHostAddress& address) {
+	QHostAddress ipv4 = address;
+	bool is_ipv4_mapped = false;
+	quint32 ipv4_raw = address.toIPv4Address(&is_ipv4_mapped);
+	if(is_ipv4_mapped)
+		ipv4 = QHostAddress(ipv4_raw);
+
+	static const QList<QPair<QHostAddress, int>> lan_subnets = {
+		QHostAddress::parseSubnet("10.0.0.0/8"),
+		QHostAddress::parseSubnet("172.16.0.0/12"),
+		QHostAddress::parseSubnet("192.168.0.0/16"),
+		QHostAddress::parseSubnet("169.254.0.0/16"),
+		QHostAddress::parseSubnet("fc00::/7"),
+		QHostAddress::parseSubnet("fe80::/10"),
+	};
+	if(ipv4.isLoopback()) return true;
+	return std::any_of(lan_subnets.begin(), lan_subnets.end(), [&](const QPair<QHostAddress, int>& subnet){return ipv4.isInSubnet(subnet);});
+}
+
+void BandwidthLimiter::setLimits(quint64 upload, quint64 download) {
+	upload_.setRate(upload);
+	download_.setRate(download);
+}
+
+void BandwidthLimiter::setExempt(bool exempt) {
+	exempt_ = exempt;
+}
+
+BandwidthLimiter::clock::duration BandwidthLimiter::delay(Direction direction) const {
+	if(exempt_) return clock::duration::zero();
+
+	clock::duration own_delay = bucket(direction).delay();
+	return parent_limiter_ ? std::max(own_delay, parent_limiter_->delay(direction)) : own_delay;
+}
+
+void BandwidthLimiter::consume(Direction direction, quint64 bytes) {
+	if(exempt_) return;
+
+	bucket(direction).consume(bytes);
+	if(parent_limiter_)
+		parent_limiter_->consume(direction, bytes);
+}
+
+QJsonObject BandwidthLimiter::collect_state() const {
+	QJsonObject state;
+	state["upload_limit"] = (double)upload_.rate();
+	state["download_limit"] = (double)download_.rate();
+	state["exempt"] = exempt_;
+	return state;
+}
+
+void BandwidthLimiter::applyGlobalLimits() {
+	quint64 upload = Config::get()->getGlobal("bandwidth_upload_limit").toULongLong();
+	quint64 download = Config::get()->getGlobal("bandwidth_download_limit").toULongLong();
+
+	// The first matching rule of the schedule overrides the default limits. Rules like "22:00"-"06:00" wrap around midnight.
+	QDateTime now = QDateTime::currentDateTime();
+	foreach(const QVariant& rule, Config::get()->getGlobal("bandwidth_schedule").toList()) {
+		QVariantMap rule_map = rule.toMap();
+
+		QVariantList days = rule_map["days"].toList();
+		if(!days.isEmpty() && !days.contains(now.date().dayOfWeek())) continue;
+
+		QTime from = QTime::fromString(rule_map["from"].toString(), "HH:mm");
+		QTime to = QTime::fromString(rule_map["to"].toString(), "HH:mm");
+		bool active = from <= to ? (now.time() >= from && now.time() < to) : (now.time() >= from || now.time() < to);
+		if(! active) continue;
+
+		upload = rule_map["upload_limit"].toULongLong();
+		download = rule_map["download_limit"].toULongLong();
+		break;
+	}
+
+	if(upload != upload_.rate() || download != download_.rate()) {
+		qCDebug(log_bandwidth) << "Global bandwidth limits: upload" << upload << "B/s, download" << download << "B/s";
+		setLimits(upload, download);
+	}
+}
+
+} /* namespace librevault */
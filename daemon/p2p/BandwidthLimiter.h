@@ -0,0 +1,73 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "TokenBucket.h"
+#include <QHostAddress>
+#include <QJsonObject>
+#include <QObject>
+
+class QTimer;
+
+namespace librevault {
+
+/* BandwidthLimiter is a node in the global -> folder -> peer hierarchy of token buckets. A transfer is delayed until every bucket on the path
+ * to the root has tokens, and is charged to all of them. Transfers are paced, never dropped. All limiters live in the main thread. */
+class BandwidthLimiter : public QObject {
+	Q_OBJECT
+public:
+	enum Direction {UPLOAD, DOWNLOAD};
+	using clock = TokenBucket::clock;
+
+	BandwidthLimiter(BandwidthLimiter* parent_limiter, QObject* parent);
+
+	static BandwidthLimiter* global();  // Root of the hierarchy. Follows "bandwidth_*" globals and the time-of-day schedule.
+	static bool isLanAddress(const QHostAddress& address);
+
+	void setLimits(quint64 upload, quint64 download);
+	void setExempt(bool exempt);    // Exempt limiters (e.g. for LAN peers) skip the whole hierarchy
+
+	clock::duration delay(Direction direction) const;
+	void consume(Direction direction, quint64 bytes);
+
+	QJsonObject collect_state() const;
+
+private:
+	BandwidthLimiter* parent_limiter_;
+	TokenBucket upload_, download_;
+	bool exempt_ = false;
+
+	TokenBucket& bucket(Direction direction) {return direction == UPLOAD ? upload_ : download_;}
+	const TokenBucket& bucket(Direction direction) const {return direction == UPLOAD ? upload_ : download_;}
+
+	/* Global schedule */
+	QTimer* schedule_timer_ = nullptr;
+	void applyGlobalLimits();
+};
+
+} /* namespace librevault */
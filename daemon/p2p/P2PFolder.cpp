@@ -28,6 +28,7 @@
  */
 #include "P2PFolder.h"
 #include "P2PProvider.h"
+#include "V1Extensions.h"
 #include "Version.h"
 #include "control/Config.h"
 #include "folder/FolderGroup.h"
@@ -37,6 +38,7 @@
 #include "util/conv_bitarray.h"
 #include <librevault/Tokens.h>
 #include <librevault/protocol/V1Parser.h>
+#include <V1Extensions.pb.h>
 
 namespace librevault {
 
@@ -52,6 +54,13 @@ P2PFolder::P2PFolder(QWebSocket* socket, FolderGroup* fgroup, P2PProvider* provi
 	socket->setParent(this);
 	this->setParent(fgroup_);
 
+	// Per-peer rate limits, under the folder's ones
+	limiter_ = new BandwidthLimiter(fgroup_->bandwidth_limiter(), this);
+	update_limits();
+	connect(Config::get(), &Config::globalChanged, this, [this](QString key, QVariant value){
+		if(key.startsWith("bandwidth_")) update_limits();
+	});
+
 	// Set up timers
 	ping_timer_ = new QTimer(this);
 	timeout_timer_ = new QTimer(this);
@@ -120,6 +129,8 @@ QJsonObject P2PFolder::collect_state() {
 	state["user_agent"] = user_agent();
 	state["traffic_stats"] = counter_.heartbeat_json();
 	state["rtt"] = double(rtt_.count());
+	state["download_window"] = request_window_.collect_state();
+	state["bandwidth_limits"] = limiter_->collect_state();
 
 	return state;
 }
@@ -137,6 +148,11 @@ blob P2PFolder::remote_token() {
 }
 
 void P2PFolder::send_message(const blob& message) {
+	flush_have();   // Keeps messages in order
+	send_raw(message);
+}
+
+void P2PFolder::send_raw(const blob& message) {
 	counter_.add_up(message.size());
 	fgroup_->bandwidth_counter().add_up(message.size());
 	socket_->sendBinaryMessage(QByteArray::fromRawData((char*)message.data(), message.size()));
@@ -146,7 +162,7 @@ void P2PFolder::sendHandshake() {
 	V1Parser::Handshake message_struct;
 	message_struct.auth_token = local_token();
 	message_struct.device_name = Config::get()->getGlobal("client_name").toString().toStdString();
-	message_struct.user_agent = Version::current().user_agent().toStdString();
+	message_struct.user_agent = V1Extensions::advertise(Version::current().user_agent()).toStdString();
 
 	send_message(V1Parser().gen_Handshake(message_struct));
 	handshake_sent_ = true;
@@ -188,6 +204,12 @@ void P2PFolder::uninterest() {
 }
 
 void P2PFolder::post_have_meta(const Meta::PathRevision& revision, const bitfield_type& bitfield) {
+	if(supports(V1Extensions::HAVE_BATCH)) {
+		pending_have_meta_ << qMakePair(revision, bitfield);
+		schedule_flush();
+		return;
+	}
+
 	V1Parser::HaveMeta message;
 	message.revision = revision;
 	message.bitfield = bitfield;
@@ -199,6 +221,12 @@ void P2PFolder::post_have_meta(const Meta::PathRevision& revision, const bitfiel
 		<< " bits=" << conv_bitarray(message.bitfield));
 }
 void P2PFolder::post_have_chunk(const blob& ct_hash) {
+	if(supports(V1Extensions::HAVE_BATCH)) {
+		pending_have_chunk_ << ct_hash;
+		schedule_flush();
+		return;
+	}
+
 	V1Parser::HaveChunk message;
 	message.ct_hash = ct_hash;
 	send_message(V1Parser().gen_HaveChunk(message));
@@ -207,6 +235,99 @@ void P2PFolder::post_have_chunk(const blob& ct_hash) {
 		<< " ct_hash=" << ct_hash_readable(ct_hash));
 }
 
+void P2PFolder::post_index_digest(const QVector<quint64>& digests) {
+	protocol::IndexDigest message;
+	for(quint64 digest : digests)
+		message.add_buckets(digest);
+
+	blob message_raw(1 + message.ByteSize());
+	message_raw[0] = V1Extensions::INDEX_DIGEST;
+	message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+	send_message(message_raw);
+
+	LOGD("==> INDEX_DIGEST:"
+		<< " buckets=" << digests.size());
+}
+
+void P2PFolder::post_index_since(const QByteArray& log_id, quint64 seq, const QList<QByteArray>& incomplete_path_ids) {
+	protocol::IndexSince message;
+	message.set_log_id(log_id.data(), log_id.size());
+	message.set_seq(seq);
+	for(const QByteArray& path_id : incomplete_path_ids)
+		message.add_incomplete_path_ids(path_id.data(), path_id.size());
+
+	blob message_raw(1 + message.ByteSize());
+	message_raw[0] = V1Extensions::INDEX_SINCE;
+	message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+	send_message(message_raw);
+
+	LOGD("==> INDEX_SINCE:"
+		<< " seq=" << seq
+		<< " incomplete=" << incomplete_path_ids.size());
+}
+void P2PFolder::post_index_upto(const QByteArray& log_id, quint64 seq) {
+	protocol::IndexUpTo message;
+	message.set_log_id(log_id.data(), log_id.size());
+	message.set_seq(seq);
+
+	blob message_raw(1 + message.ByteSize());
+	message_raw[0] = V1Extensions::INDEX_UPTO;
+	message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+	send_message(message_raw);
+
+	LOGD("==> INDEX_UPTO:"
+		<< " seq=" << seq);
+}
+
+void P2PFolder::schedule_flush() {
+	if(flush_scheduled_) return;
+	flush_scheduled_ = true;
+	QTimer::singleShot(0, this, [this]{
+		flush_scheduled_ = false;
+		flush_have();
+	});
+}
+
+void P2PFolder::flush_have() {
+	const int batch_max = Config::get()->getGlobal("p2p_have_batch_max").toInt();
+
+	while(! pending_have_meta_.isEmpty()) {
+		protocol::HaveMetaBatch message;
+		for(int i = 0; i < batch_max && !pending_have_meta_.isEmpty(); i++) {
+			auto have_meta = pending_have_meta_.takeFirst();
+			auto entry = message.add_entries();
+			entry->set_path_id(have_meta.first.path_id_.data(), have_meta.first.path_id_.size());
+			entry->set_revision(have_meta.first.revision_);
+			for(uint32_t run : V1Extensions::encode_runs(have_meta.second))
+				entry->add_bitfield_runs(run);
+		}
+
+		blob message_raw(1 + message.ByteSize());
+		message_raw[0] = V1Extensions::HAVE_META_BATCH;
+		message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+		send_raw(message_raw);
+
+		LOGD("==> HAVE_META_BATCH:"
+			<< " count=" << message.entries_size());
+	}
+
+	while(! pending_have_chunk_.isEmpty()) {
+		protocol::HaveChunkBatch message;
+		for(int i = 0; i < batch_max && !pending_have_chunk_.isEmpty(); i++) {
+			blob ct_hash = pending_have_chunk_.takeFirst();
+			message.add_ct_hashes(ct_hash.data(), ct_hash.size());
+		}
+
+		blob message_raw(1 + message.ByteSize());
+		message_raw[0] = V1Extensions::HAVE_CHUNK_BATCH;
+		message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+		send_raw(message_raw);
+
+		LOGD("==> HAVE_CHUNK_BATCH:"
+			<< " count=" << message.ct_hashes_size());
+	}
+}
+
 void P2PFolder::request_meta(const Meta::PathRevision& revision) {
 	V1Parser::MetaRequest message;
 	message.revision = revision;
@@ -227,6 +348,48 @@ void P2PFolder::post_meta(const SignedMeta& smeta, const bitfield_type& bitfield
 		<< " revision=" << smeta.meta().revision()
 		<< " bits=" << conv_bitarray(bitfield));
 }
+void P2PFolder::request_meta_delta(const Meta::PathRevision& revision, qint64 base_revision) {
+	protocol::MetaDeltaRequest message;
+	message.set_path_id(revision.path_id_.data(), revision.path_id_.size());
+	message.set_revision(revision.revision_);
+	message.set_base_revision(base_revision);
+
+	blob message_raw(1 + message.ByteSize());
+	message_raw[0] = V1Extensions::META_DELTA_REQUEST;
+	message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+	send_message(message_raw);
+
+	LOGD("==> META_DELTA_REQUEST:"
+		<< " path_id=" << path_id_readable(revision.path_id_)
+		<< " revision=" << revision.revision_
+		<< " base_revision=" << base_revision);
+}
+void P2PFolder::post_meta_delta(const MetaDelta& delta, const bitfield_type& bitfield) {
+	protocol::MetaDeltaReply message;
+	message.set_path_id(delta.revision.path_id_.data(), delta.revision.path_id_.size());
+	message.set_revision(delta.revision.revision_);
+	message.set_base_revision(delta.base_revision);
+	for(const MetaDelta::Op& op : delta.ops) {
+		auto message_op = message.add_ops();
+		message_op->set_literal(op.literal.data(), op.literal.size());
+		message_op->set_copy_offset(op.copy_offset);
+		message_op->set_copy_length(op.copy_length);
+	}
+	message.set_signature(delta.signature.data(), delta.signature.size());
+	for(uint32_t run : V1Extensions::encode_runs(bitfield))
+		message.add_bitfield_runs(run);
+
+	blob message_raw(1 + message.ByteSize());
+	message_raw[0] = V1Extensions::META_DELTA_REPLY;
+	message.SerializeToArray(message_raw.data() + 1, message_raw.size() - 1);
+	send_message(message_raw);
+
+	LOGD("==> META_DELTA_REPLY:"
+		<< " path_id=" << path_id_readable(delta.revision.path_id_)
+		<< " revision=" << delta.revision.revision_
+		<< " base_revision=" << delta.base_revision
+		<< " ops=" << delta.ops.size());
+}
 void P2PFolder::cancel_meta(const Meta::PathRevision& revision) {
 	V1Parser::MetaCancel message;
 	message.revision = revision;
@@ -285,6 +448,27 @@ void P2PFolder::handle_message(const QByteArray& message) {
 	bump_timeout();
 
 	if(ready()) {
+		// Extension messages are accepted only after advertising the extension
+		if(!message_raw.empty() && message_raw[0] >= V1Extensions::HAVE_META_BATCH) {
+			QString extension = V1Extensions::extension_of(message_raw[0]);
+			if(!extension.isEmpty() && !supports(extension)) {
+				LOGD("Dropped a message of not negotiated extension:" << extension);
+				return;
+			}
+
+			switch(message_raw[0]) {
+				case V1Extensions::HAVE_META_BATCH: handle_HaveMetaBatch(message_raw); break;
+				case V1Extensions::HAVE_CHUNK_BATCH: handle_HaveChunkBatch(message_raw); break;
+				case V1Extensions::INDEX_DIGEST: handle_IndexDigest(message_raw); break;
+				case V1Extensions::INDEX_SINCE: handle_IndexSince(message_raw); break;
+				case V1Extensions::INDEX_UPTO: handle_IndexUpTo(message_raw); break;
+				case V1Extensions::META_DELTA_REQUEST: handle_MetaDeltaRequest(message_raw); break;
+				case V1Extensions::META_DELTA_REPLY: handle_MetaDeltaReply(message_raw); break;
+				default: socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+			}
+			return;
+		}
+
 		switch(message_type) {
 			case V1Parser::CHOKE: handle_Choke(message_raw); break;
 			case V1Parser::UNCHOKE: handle_Unchoke(message_raw); break;
@@ -318,6 +502,7 @@ void P2PFolder::handle_Handshake(const blob& message_raw) {
 
 		client_name_ = QString::fromStdString(message_struct.device_name);
 		user_agent_ = QString::fromStdString(message_struct.user_agent);
+		remote_extensions_ = V1Extensions::parse(user_agent_);
 
 		LOGD("LV Handshake successful");
 		handshake_received_ = true;
@@ -385,6 +570,88 @@ void P2PFolder::handle_HaveChunk(const blob& message_raw) {
 	emit rcvdHaveChunk(message_struct.ct_hash);
 }
 
+void P2PFolder::handle_HaveMetaBatch(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::HaveMetaBatch message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+	LOGD("<== HAVE_META_BATCH:"
+		<< " count=" << message.entries_size());
+
+	for(auto& entry : message.entries()) {
+		Meta::PathRevision revision;
+		revision.path_id_ = blob(entry.path_id().begin(), entry.path_id().end());
+		revision.revision_ = entry.revision();
+		emit rcvdHaveMeta(revision, V1Extensions::decode_runs(std::vector<uint32_t>(entry.bitfield_runs().begin(), entry.bitfield_runs().end())));
+	}
+}
+void P2PFolder::handle_HaveChunkBatch(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::HaveChunkBatch message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+	LOGD("<== HAVE_CHUNK_BATCH:"
+		<< " count=" << message.ct_hashes_size());
+
+	for(auto& ct_hash : message.ct_hashes())
+		emit rcvdHaveChunk(blob(ct_hash.begin(), ct_hash.end()));
+}
+
+void P2PFolder::handle_IndexDigest(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::IndexDigest message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+	LOGD("<== INDEX_DIGEST:"
+		<< " buckets=" << message.buckets_size());
+
+	QVector<quint64> digests;
+	digests.reserve(message.buckets_size());
+	for(quint64 digest : message.buckets())
+		digests << digest;
+	emit rcvdIndexDigest(digests);
+}
+
+void P2PFolder::handle_IndexSince(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::IndexSince message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+	LOGD("<== INDEX_SINCE:"
+		<< " seq=" << message.seq()
+		<< " incomplete=" << message.incomplete_path_ids_size());
+
+	QList<QByteArray> incomplete_path_ids;
+	for(auto& path_id : message.incomplete_path_ids())
+		incomplete_path_ids << QByteArray::fromStdString(path_id);
+	emit rcvdIndexSince(QByteArray::fromStdString(message.log_id()), message.seq(), incomplete_path_ids);
+}
+void P2PFolder::handle_IndexUpTo(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::IndexUpTo message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+	LOGD("<== INDEX_UPTO:"
+		<< " seq=" << message.seq());
+
+	emit rcvdIndexUpTo(QByteArray::fromStdString(message.log_id()), message.seq());
+}
+
 void P2PFolder::handle_MetaRequest(const blob& message_raw) {
 	LOGFUNC();
 
@@ -407,8 +674,8 @@ void P2PFolder::handle_MetaReply(const blob& message_raw) {
 	emit rcvdMetaReply(message_struct.smeta, message_struct.bitfield);
 }
 void P2PFolder::handle_MetaCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
+	// Meta replies are sent right away, so there is nothing to drop here. Signal is kept for consumers, that may queue them.
 
 	auto message_struct = V1Parser().parse_MetaCancel(message_raw);
 	LOGD("<== META_CANCEL:"
@@ -417,6 +684,57 @@ void P2PFolder::handle_MetaCancel(const blob& message_raw) {
 
 	emit rcvdMetaCancel(message_struct.revision);
 }
+void P2PFolder::handle_MetaDeltaRequest(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::MetaDeltaRequest message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+
+	Meta::PathRevision revision;
+	revision.path_id_ = blob(message.path_id().begin(), message.path_id().end());
+	revision.revision_ = message.revision();
+	LOGD("<== META_DELTA_REQUEST:"
+		<< " path_id=" << path_id_readable(revision.path_id_)
+		<< " revision=" << revision.revision_
+		<< " base_revision=" << message.base_revision());
+
+	emit rcvdMetaDeltaRequest(revision, message.base_revision());
+}
+void P2PFolder::handle_MetaDeltaReply(const blob& message_raw) {
+	LOGFUNC();
+
+	protocol::MetaDeltaReply message;
+	if(!message.ParseFromArray(message_raw.data() + 1, message_raw.size() - 1)) {
+		socket_->close(QWebSocketProtocol::CloseCodeProtocolError);
+		return;
+	}
+
+	// The delta is applied and its signature is checked by MetaDownloader, against our copy of the base revision
+	MetaDelta delta;
+	delta.revision.path_id_ = blob(message.path_id().begin(), message.path_id().end());
+	delta.revision.revision_ = message.revision();
+	delta.base_revision = message.base_revision();
+	for(auto& message_op : message.ops()) {
+		MetaDelta::Op op;
+		op.literal = QByteArray::fromStdString(message_op.literal());
+		op.copy_offset = message_op.copy_offset();
+		op.copy_length = message_op.copy_length();
+		delta.ops << op;
+	}
+	delta.signature = blob(message.signature().begin(), message.signature().end());
+	bitfield_type bitfield = V1Extensions::decode_runs(std::vector<uint32_t>(message.bitfield_runs().begin(), message.bitfield_runs().end()));
+
+	LOGD("<== META_DELTA_REPLY:"
+		<< " path_id=" << path_id_readable(delta.revision.path_id_)
+		<< " revision=" << delta.revision.revision_
+		<< " base_revision=" << delta.base_revision
+		<< " ops=" << delta.ops.size());
+
+	emit rcvdMetaDelta(delta, bitfield);
+}
 
 void P2PFolder::handle_BlockRequest(const blob& message_raw) {
 	LOGFUNC();
@@ -443,7 +761,6 @@ void P2PFolder::handle_BlockReply(const blob& message_raw) {
 	emit rcvdBlockReply(message_struct.ct_hash, message_struct.offset, message_struct.content);
 }
 void P2PFolder::handle_BlockCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = V1Parser().parse_BlockCancel(message_raw);
@@ -464,7 +781,15 @@ void P2PFolder::handlePong(quint64 rtt) {
 	rtt_ = std::chrono::milliseconds(rtt);
 }
 
+void P2PFolder::update_limits() {
+	limiter_->setLimits(Config::get()->getGlobal("bandwidth_peer_upload_limit").toULongLong(), Config::get()->getGlobal("bandwidth_peer_download_limit").toULongLong());
+	if(socket_->state() == QAbstractSocket::ConnectedState)
+		limiter_->setExempt(!Config::get()->getGlobal("bandwidth_limit_lan").toBool() && BandwidthLimiter::isLanAddress(socket_->peerAddress()));
+}
+
 void P2PFolder::handleConnected() {
+	update_limits();    // Peer address is known now
+
 	if(!provider_->isLoopback(digest()) && fgroup_->attach(this)) {
 		if(role_ == CLIENT)
 			sendHandshake();
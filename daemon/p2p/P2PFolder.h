@@ -29,6 +29,8 @@
 #pragma once
 #include "folder/RemoteFolder.h"
 #include "p2p/BandwidthCounter.h"
+#include "p2p/BandwidthLimiter.h"
+#include <QSet>
 #include <QTimer>
 #include <QWebSocket>
 #include <chrono>
@@ -64,6 +66,7 @@ public:
 	QPair<QHostAddress, quint16> endpoint() const;
 	QString client_name() const {return client_name_;}
 	QString user_agent() const {return user_agent_;}
+	bool supports(const QString& extension) const {return remote_extensions_.contains(extension);}
 	QJsonObject collect_state();
 
 	/* RPC Actions */
@@ -72,6 +75,8 @@ public:
 	// Handshake
 	void sendHandshake();
 	bool ready() const {return handshake_sent_ && handshake_received_;}
+	std::chrono::milliseconds rtt() const {return rtt_;}
+	BandwidthLimiter* limiter() {return limiter_;}
 
 	/* Message senders */
 	void choke();
@@ -81,9 +86,14 @@ public:
 
 	void post_have_meta(const Meta::PathRevision& revision, const bitfield_type& bitfield);
 	void post_have_chunk(const blob& ct_hash);
+	void post_index_digest(const QVector<quint64>& digests);
+	void post_index_since(const QByteArray& log_id, quint64 seq, const QList<QByteArray>& incomplete_path_ids);
+	void post_index_upto(const QByteArray& log_id, quint64 seq);
 
 	void request_meta(const Meta::PathRevision& revision);
 	void post_meta(const SignedMeta& smeta, const bitfield_type& bitfield);
+	void request_meta_delta(const Meta::PathRevision& revision, qint64 base_revision);
+	void post_meta_delta(const MetaDelta& delta, const bitfield_type& bitfield);
 	void cancel_meta(const Meta::PathRevision& revision);
 
 	void request_block(const blob& ct_hash, uint32_t offset, uint32_t size);
@@ -105,11 +115,25 @@ private:
 	bool handshake_sent_ = false;
 
 	BandwidthCounter counter_;
+	BandwidthLimiter* limiter_;
+
+	void update_limits();
 
 	/* These needed primarily for UI */
 	QString client_name_;
 	QString user_agent_;
 
+	QSet<QString> remote_extensions_;
+
+	/* HAVE_META and HAVE_CHUNK are coalesced into batches within one event loop iteration, if the remote supports it */
+	QList<QPair<Meta::PathRevision, bitfield_type>> pending_have_meta_;
+	QList<blob> pending_have_chunk_;
+	bool flush_scheduled_ = false;
+
+	void schedule_flush();
+	void flush_have();
+	void send_raw(const blob& message);
+
 	/* Ping/pong and timeout handlers */
 	QTimer* ping_timer_;
 	QTimer* timeout_timer_;
@@ -135,10 +159,17 @@ private:
 
 	void handle_HaveMeta(const blob& message_raw);
 	void handle_HaveChunk(const blob& message_raw);
+	void handle_HaveMetaBatch(const blob& message_raw);
+	void handle_HaveChunkBatch(const blob& message_raw);
+	void handle_IndexDigest(const blob& message_raw);
+	void handle_IndexSince(const blob& message_raw);
+	void handle_IndexUpTo(const blob& message_raw);
 
 	void handle_MetaRequest(const blob& message_raw);
 	void handle_MetaReply(const blob& message_raw);
 	void handle_MetaCancel(const blob& message_raw);
+	void handle_MetaDeltaRequest(const blob& message_raw);
+	void handle_MetaDeltaReply(const blob& message_raw);
 
 	void handle_BlockRequest(const blob& message_raw);
 	void handle_BlockReply(const blob& message_raw);
@@ -0,0 +1,66 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "TokenBucket.h"
+#include <algorithm>
+
+namespace librevault {
+
+TokenBucket::TokenBucket() : last_refill_(clock::now()) {}
+
+void TokenBucket::setRate(quint64 rate) {
+	refill();
+	rate_ = rate;
+	tokens_ = std::min(tokens_, qreal(rate_));
+}
+
+TokenBucket::clock::duration TokenBucket::delay() const {
+	if(unlimited()) return clock::duration::zero();
+
+	refill();
+	if(tokens_ > 0) return clock::duration::zero();
+	return std::chrono::duration_cast<clock::duration>(std::chrono::duration<qreal>((1 - tokens_) / rate_));
+}
+
+void TokenBucket::consume(quint64 bytes) {
+	if(unlimited()) return;
+
+	refill();
+	tokens_ -= bytes;
+}
+
+void TokenBucket::refill() const {
+	auto now = clock::now();
+	qreal elapsed = std::chrono::duration<qreal>(now - last_refill_).count();
+	last_refill_ = now;
+
+	if(! unlimited())
+		tokens_ = std::min(tokens_ + elapsed * rate_, qreal(rate_));
+}
+
+} /* namespace librevault */
@@ -0,0 +1,58 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QtGlobal>
+#include <chrono>
+
+namespace librevault {
+
+/* TokenBucket limits a byte stream to a rate. A transfer may start while the bucket has any tokens, and can take it into debt,
+ * so that blocks larger than the burst size are paced, not starved. Rate 0 means "unlimited". */
+class TokenBucket {
+public:
+	using clock = std::chrono::steady_clock;
+
+	TokenBucket();
+
+	void setRate(quint64 rate);     // bytes/s. Burst size is one second worth of tokens.
+	quint64 rate() const {return rate_;}
+	bool unlimited() const {return rate_ == 0;}
+
+	clock::duration delay() const;  // Until the next transfer may start
+	void consume(quint64 bytes);
+
+private:
+	quint64 rate_ = 0;
+	mutable qreal tokens_ = 0;
+	mutable clock::time_point last_refill_;
+
+	void refill() const;
+};
+
+} /* namespace librevault */
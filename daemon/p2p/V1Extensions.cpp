@@ -0,0 +1,102 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "V1Extensions.h"
+#include <QStringList>
+#include <algorithm>
+
+namespace librevault {
+namespace V1Extensions {
+
+const QString HAVE_BATCH = "have_batch";
+const QString DIGEST_RECONCILE = "index_digest";
+const QString WATERMARK = "watermark";
+const QString META_DELTA = "meta_delta";
+
+namespace {
+const size_t MAX_DECODED_BITS = 16*1024*1024;    // Remote's run lengths are not trusted
+} /* anonymous namespace */
+
+QString advertise(const QString& user_agent) {
+	QStringList tokens(user_agent);
+	for(const QString& extension : {HAVE_BATCH, DIGEST_RECONCILE, WATERMARK, META_DELTA})
+		tokens << "+" + extension;
+	return tokens.join(' ');
+}
+
+QSet<QString> parse(const QString& user_agent) {
+	QSet<QString> extensions;
+	for(const QString& token : user_agent.split(' ', QString::SkipEmptyParts)) {
+		if(token.startsWith('+'))
+			extensions << token.mid(1);
+	}
+	return extensions;
+}
+
+QString extension_of(uint8_t type) {
+	switch(type) {
+		case HAVE_META_BATCH:
+		case HAVE_CHUNK_BATCH: return HAVE_BATCH;
+		case INDEX_DIGEST: return DIGEST_RECONCILE;
+		case INDEX_SINCE:
+		case INDEX_UPTO: return WATERMARK;
+		case META_DELTA_REQUEST:
+		case META_DELTA_REPLY: return META_DELTA;
+		default: return QString();
+	}
+}
+
+std::vector<uint32_t> encode_runs(const bitfield_type& bitfield) {
+	std::vector<uint32_t> runs;
+	bool current = false;
+	uint32_t run = 0;
+	for(size_t i = 0; i < bitfield.size(); i++) {
+		if(bitfield[i] != current) {
+			runs.push_back(run);
+			current = !current;
+			run = 0;
+		}
+		run++;
+	}
+	if(run > 0)
+		runs.push_back(run);
+	return runs;
+}
+
+bitfield_type decode_runs(const std::vector<uint32_t>& runs) {
+	bitfield_type bitfield;
+	bool current = false;
+	for(uint32_t run : runs) {
+		bitfield.resize(std::min(bitfield.size() + run, MAX_DECODED_BITS), current);
+		current = !current;
+	}
+	return bitfield;
+}
+
+} /* namespace V1Extensions */
+} /* namespace librevault */
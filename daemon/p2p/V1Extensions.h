@@ -0,0 +1,66 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <librevault/util/conv_bitfield.h>
+#include <QSet>
+#include <QString>
+#include <vector>
+
+namespace librevault {
+
+/* Extensions to the V1 protocol. An extension is advertised in Handshake as a "+name" token, appended to the user agent, and its messages
+ * are sent only to remotes, that advertised it too. So, older peers keep working with the plain V1 messages. */
+namespace V1Extensions {
+
+enum message_type : uint8_t {
+	HAVE_META_BATCH = 100,
+	HAVE_CHUNK_BATCH = 101,
+	INDEX_DIGEST = 102,
+	INDEX_SINCE = 103,
+	INDEX_UPTO = 104,
+	META_DELTA_REQUEST = 105,
+	META_DELTA_REPLY = 106,
+};
+
+/* Extension names */
+extern const QString HAVE_BATCH;        // HAVE_META_BATCH and HAVE_CHUNK_BATCH
+extern const QString DIGEST_RECONCILE;  // INDEX_DIGEST instead of replaying every HAVE_META on connect
+extern const QString WATERMARK;         // INDEX_SINCE and INDEX_UPTO: known peers get only the changes since their last sync
+extern const QString META_DELTA;        // META_DELTA_REQUEST and META_DELTA_REPLY: new revisions of big files are sent as a delta
+
+QString advertise(const QString& user_agent);       // Appends supported extensions
+QSet<QString> parse(const QString& user_agent);     // Extensions, advertised by the remote
+QString extension_of(uint8_t type);                 // Extension, that defines this message type. Empty, if unknown
+
+/* Run-length coding of bitfields */
+std::vector<uint32_t> encode_runs(const bitfield_type& bitfield);
+bitfield_type decode_runs(const std::vector<uint32_t>& runs);
+
+} /* namespace V1Extensions */
+} /* namespace librevault */
@@ -0,0 +1,92 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "FdBudget.h"
+#include <QtGlobal>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#   include <sys/resource.h>
+#endif
+
+namespace librevault {
+
+FdBudget::FdBudget() {
+	int process_limit = 512;    // MSVC CRT default
+#ifdef Q_OS_UNIX
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		process_limit = int(std::min(rl.rlim_cur, rlim_t(65536)));
+	else
+		process_limit = 65536;
+#endif
+	limit_ = std::max(process_limit / 2, 16);  // Other half is left for sockets and everything else
+}
+
+bool FdBudget::tryAcquire(int count) {
+	QMutexLocker lk(&mtx_);
+	if(used_ + count > limit_) {
+		denied_++;
+		return false;
+	}
+	used_ += count;
+	peak_ = std::max(peak_, used_);
+	return true;
+}
+
+void FdBudget::reserve(int count) {
+	QMutexLocker lk(&mtx_);
+	used_ += count;
+	peak_ = std::max(peak_, used_);
+}
+
+void FdBudget::release(int count) {
+	QMutexLocker lk(&mtx_);
+	used_ = std::max(used_ - count, 0);
+}
+
+int FdBudget::limit() const {
+	QMutexLocker lk(&mtx_);
+	return limit_;
+}
+
+int FdBudget::used() const {
+	QMutexLocker lk(&mtx_);
+	return used_;
+}
+
+QJsonObject FdBudget::collect_state() const {
+	QMutexLocker lk(&mtx_);
+	QJsonObject state;
+	state["limit"] = limit_;
+	state["used"] = used_;
+	state["peak"] = peak_;
+	state["denied"] = double(denied_);
+	return state;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QJsonObject>
+#include <QMutex>
+
+namespace librevault {
+
+/* FdBudget is a process-wide accounting of file descriptors. Components, that keep files open for a long time (file pools, databases,
+ * filesystem watchers), take their share from it, so that together they stay well under the process limit and leave room for sockets. */
+class FdBudget {
+public:
+	static FdBudget* get_instance() {
+		static FdBudget instance;     // Initialized once, even if pool threads get here first
+		return &instance;
+	}
+
+	bool tryAcquire(int count = 1);     // For caches. Fails, if the budget is exhausted.
+	void reserve(int count = 1);        // For mandatory users (databases, watchers). Always succeeds, may overcommit.
+	void release(int count = 1);
+
+	int limit() const;
+	int used() const;
+
+	QJsonObject collect_state() const;
+
+private:
+	FdBudget();
+
+	mutable QMutex mtx_;
+	int limit_;
+	int used_ = 0;
+	int peak_ = 0;
+	quint64 denied_ = 0;
+};
+
+} /* namespace librevault */
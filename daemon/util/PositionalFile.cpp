@@ -0,0 +1,252 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "PositionalFile.h"
+#include <algorithm>
+#include <vector>
+#ifdef Q_OS_UNIX
+#   include <cerrno>
+#   include <cstring>
+#   include <fcntl.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#   include <linux/fs.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#endif
+
+namespace librevault {
+
+PositionalFile::PositionalFile(QString path) : path_(std::move(path)) {
+#ifndef Q_OS_UNIX
+	file_.setFileName(path_);
+#endif
+}
+
+PositionalFile::~PositionalFile() {
+	close();
+}
+
+#ifdef Q_OS_UNIX
+bool PositionalFile::open(QIODevice::OpenMode mode) {
+	int flags = O_CLOEXEC;
+	if((mode & QIODevice::ReadWrite) == QIODevice::ReadWrite)
+		flags |= O_RDWR | O_CREAT;
+	else if(mode & QIODevice::WriteOnly)
+		flags |= O_WRONLY | O_CREAT;
+	else
+		flags |= O_RDONLY;
+	if(mode & QIODevice::Truncate)
+		flags |= O_TRUNC;
+
+	fd_ = ::open(QFile::encodeName(path_).constData(), flags, 0666);
+	if(fd_ < 0) {
+		setError(QString::fromLocal8Bit(strerror(errno)));
+		return false;
+	}
+	return true;
+}
+
+void PositionalFile::close() {
+	if(fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+bool PositionalFile::isOpen() const {
+	return fd_ >= 0;
+}
+
+quint64 PositionalFile::size() const {
+	struct stat st;
+	if(fstat(fd_, &st) != 0) return 0;
+	return st.st_size;
+}
+
+bool PositionalFile::preallocate(quint64 size) {
+#ifdef Q_OS_LINUX
+	if(fallocate(fd_, 0, 0, size) == 0)
+		return true;
+	// Filesystem does not support fallocate(), so at least set the size in one go
+#endif
+	if(ftruncate(fd_, size) == 0)
+		return true;
+
+	setError(QString::fromLocal8Bit(strerror(errno)));
+	return false;
+}
+
+bool PositionalFile::write(quint64 offset, const char* data, qint64 size) {
+	while(size > 0) {
+		ssize_t written = pwrite(fd_, data, size, offset);
+		if(written < 0) {
+			if(errno == EINTR) continue;
+			setError(QString::fromLocal8Bit(strerror(errno)));
+			return false;
+		}
+		data += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+qint64 PositionalFile::read(quint64 offset, char* data, qint64 size) {
+	qint64 total = 0;
+	while(total < size) {
+		ssize_t bytes_read = pread(fd_, data+total, size-total, offset+total);
+		if(bytes_read < 0) {
+			if(errno == EINTR) continue;
+			setError(QString::fromLocal8Bit(strerror(errno)));
+			return -1;
+		}
+		if(bytes_read == 0) break;  // EOF
+		total += bytes_read;
+	}
+	return total;
+}
+
+bool PositionalFile::sync() {
+	if(fsync(fd_) == 0)
+		return true;
+
+	setError(QString::fromLocal8Bit(strerror(errno)));
+	return false;
+}
+
+bool PositionalFile::copy_range(PositionalFile& src, quint64 src_offset, quint64 dst_offset, quint64 size) {
+#ifdef Q_OS_LINUX
+#   ifdef FICLONERANGE
+	// Reflink. Works only on CoW filesystems (btrfs, xfs) and for block-aligned ranges.
+	file_clone_range clone_range;
+	clone_range.src_fd = src.fd_;
+	clone_range.src_offset = src_offset;
+	clone_range.src_length = size;
+	clone_range.dest_offset = dst_offset;
+	if(ioctl(fd_, FICLONERANGE, &clone_range) == 0)
+		return true;
+#   endif
+#   ifdef SYS_copy_file_range
+	// In-kernel copy
+	while(size > 0) {
+		loff_t src_off = src_offset, dst_off = dst_offset;
+		ssize_t copied = syscall(SYS_copy_file_range, src.fd_, &src_off, fd_, &dst_off, size, 0u);
+		if(copied < 0 && errno == EINTR) continue;
+		if(copied <= 0) break;  // Not supported here, or unexpected EOF. Copy the rest by hand.
+		src_offset += copied;
+		dst_offset += copied;
+		size -= copied;
+	}
+	if(size == 0)
+		return true;
+#   endif
+#endif
+	return copy_range_buffered(src, src_offset, dst_offset, size);
+}
+#else
+bool PositionalFile::open(QIODevice::OpenMode mode) {
+	QMutexLocker lk(&mtx_);
+	return file_.open(mode);
+}
+
+void PositionalFile::close() {
+	QMutexLocker lk(&mtx_);
+	file_.close();
+}
+
+bool PositionalFile::isOpen() const {
+	QMutexLocker lk(&mtx_);
+	return file_.isOpen();
+}
+
+quint64 PositionalFile::size() const {
+	QMutexLocker lk(&mtx_);
+	return file_.size();
+}
+
+bool PositionalFile::preallocate(quint64 size) {
+	QMutexLocker lk(&mtx_);
+	return file_.resize(size);
+}
+
+bool PositionalFile::write(quint64 offset, const char* data, qint64 size) {
+	QMutexLocker lk(&mtx_);
+	return file_.seek(offset) && file_.write(data, size) == size;
+}
+
+qint64 PositionalFile::read(quint64 offset, char* data, qint64 size) {
+	QMutexLocker lk(&mtx_);
+	if(!file_.seek(offset)) return -1;
+	return file_.read(data, size);
+}
+
+bool PositionalFile::sync() {
+	QMutexLocker lk(&mtx_);
+	return file_.flush();
+}
+
+bool PositionalFile::copy_range(PositionalFile& src, quint64 src_offset, quint64 dst_offset, quint64 size) {
+	return copy_range_buffered(src, src_offset, dst_offset, size);
+}
+#endif
+
+bool PositionalFile::copy_range_buffered(PositionalFile& src, quint64 src_offset, quint64 dst_offset, quint64 size) {
+	std::vector<char> buffer(std::min(size, quint64(1024*1024)));
+	while(size > 0) {
+		qint64 portion = std::min(size, quint64(buffer.size()));
+		if(src.read(src_offset, buffer.data(), portion) != portion) {
+			setError(QStringLiteral("Could not read source range from ") + src.fileName() + ": " + src.errorString());
+			return false;
+		}
+		if(!write(dst_offset, buffer.data(), portion))
+			return false;
+		src_offset += portion;
+		dst_offset += portion;
+		size -= portion;
+	}
+	return true;
+}
+
+QString PositionalFile::errorString() const {
+	QMutexLocker lk(&mtx_);
+#ifdef Q_OS_UNIX
+	return error_string_;
+#else
+	return error_string_.isEmpty() ? file_.errorString() : error_string_;
+#endif
+}
+
+void PositionalFile::setError(QString error_string) {
+	QMutexLocker lk(&mtx_);
+	error_string_ = std::move(error_string);
+}
+
+} /* namespace librevault */
@@ -0,0 +1,74 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+namespace librevault {
+
+/* PositionalFile is a thin wrapper around a native file descriptor, that supports concurrent reads and writes at explicit offsets
+ * (pread/pwrite on Unix). On platforms without positional I/O it falls back to a QFile, serialized by a mutex. */
+class PositionalFile {
+public:
+	explicit PositionalFile(QString path);
+	~PositionalFile();
+
+	bool open(QIODevice::OpenMode mode);
+	void close();
+	bool isOpen() const;
+
+	quint64 size() const;
+	bool preallocate(quint64 size);
+	bool write(quint64 offset, const char* data, qint64 size);
+	qint64 read(quint64 offset, char* data, qint64 size);
+	bool sync();
+
+	// Copies a range from another file without passing it through userspace, if filesystem allows it (reflink or copy_file_range)
+	bool copy_range(PositionalFile& src, quint64 src_offset, quint64 dst_offset, quint64 size);
+
+	QString fileName() const {return path_;}
+	QString errorString() const;
+
+private:
+	QString path_;
+
+#ifdef Q_OS_UNIX
+	int fd_ = -1;
+#else
+	QFile file_;
+#endif
+	mutable QMutex mtx_;
+	QString error_string_;
+
+	void setError(QString error_string);
+	bool copy_range_buffered(PositionalFile& src, quint64 src_offset, quint64 dst_offset, quint64 size);
+};
+
+} /* namespace librevault */